@@ -0,0 +1,589 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021 Ripose
+//
+// This file is part of Valhalla.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License version 3 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Additional permission under GNU AGPL version 3 section 7
+//
+// If you modify this Program, or any covered work, by linking or combining it
+// with FastCGI (or a modified version of that library), containing parts
+// covered by the terms of the FastCGI Open Market Licence, the licensors of
+// this Program grant you additional permission to convey the resulting work.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Measures end-to-end request handling without a web server. A built-in
+ * FastCGI client replays a mix of requests with different header counts, query
+ * string sizes, and body sizes over a Unix domain socket to vla_accept_threads()
+ * running in the same process. Every client thread keeps one connection open
+ * and has one request in flight at a time. Throughput and latency percentiles
+ * are printed as JSON.
+ *
+ * Usage: bench_fcgi [-c connections] [-n requests per connection]
+ *                   [-w workers] [-i epoll|io_uring] [-m mix]
+ *
+ * A mix is a comma separated list of weight:headers:query:body entries. Each
+ * entry describes a request with that many HTTP headers, a query string of
+ * that many bytes, and a body of that many bytes. Requests with a body are sent
+ * as POST, the rest as GET. Entries are sent in proportion to their weights.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/include/valhalla.h"
+#include "client.h"
+#include "stats.h"
+
+#ifndef VLA_VERSION
+#define VLA_VERSION "unknown"
+#endif
+
+/* The mix used if none is given. Mostly small GETs, some with many headers
+ * and a long query string, and some uploads.
+ */
+#define DEFAULT_MIX "8:4:0:0,1:16:256:0,1:8:64:4096"
+
+/* The most entries in a mix. */
+#define MAX_MIX 16
+
+/* A kind of request in a mix. */
+typedef struct mix_entry
+{
+    /* How often the request is sent relative to the other entries. */
+    size_t weight;
+
+    /* The number of HTTP headers. */
+    size_t headers;
+
+    /* The length of the query string. */
+    size_t query;
+
+    /* The length of the body. */
+    size_t body;
+
+    /* The encoded request. */
+    client_buffer request;
+} mix_entry;
+
+/* Arguments of a server thread. */
+typedef struct server_args
+{
+    /* The context to accept requests for. */
+    vla_context *ctx;
+
+    /* The number of worker threads. */
+    size_t workers;
+
+    /* The return value of vla_accept_threads(). */
+    int ret;
+} server_args;
+
+/* Arguments of a client thread. */
+typedef struct client_args
+{
+    /* The path of the socket to connect to. */
+    const char *path;
+
+    /* The number of requests to send. */
+    size_t requests;
+
+    /* The requests to send in turn, as often as their entry's weight. */
+    const client_buffer *const *schedule;
+
+    /* The length of schedule. */
+    size_t schedule_len;
+
+    /* The index in schedule of the first request. */
+    size_t offset;
+
+    /* The latency of every request in nanoseconds. */
+    double *latencies;
+
+    /* The number of requests that failed. */
+    size_t errors;
+} client_args;
+
+/**
+ * Counts a name-value pair.
+ */
+static int count_pair(const char *name, const char *value, void *arg)
+{
+    (void)name;
+    (void)value;
+    *(size_t *)arg += 1;
+    return 0;
+}
+
+/**
+ * Reads every part of the request and responds with a summary of it.
+ */
+static enum vla_handle_code handler_echo(const vla_request *req, void *arg)
+{
+    size_t headers = 0, query = 0, id_len;
+    vla_request_header_iterate(req, count_pair, &headers);
+    vla_request_query_iterate(req, count_pair, &query);
+    const char *id = vla_request_param_get(req, "id", &id_len);
+    vla_request_body_get(req, 0);
+    vla_printf(
+        req,
+        "id=%.*s headers=%zu query=%zu body=%zu\n",
+        (int)id_len, id, headers, query, vla_request_body_get_length(req)
+    );
+    return VLA_HANDLE_RESPOND_ACCEPT;
+}
+
+/**
+ * Stops the server.
+ */
+static enum vla_handle_code handler_stop(const vla_request *req, void *arg)
+{
+    return VLA_HANDLE_IGNORE_TERM;
+}
+
+/**
+ * Entry point of the server thread.
+ */
+static void *server_main(void *arg)
+{
+    server_args *args = arg;
+    args->ret = vla_accept_threads(args->ctx, args->workers);
+    return NULL;
+}
+
+/**
+ * Entry point of a client thread.
+ */
+static void *client_main(void *arg)
+{
+    client_args *args = arg;
+    client_conn conn;
+    if (client_connect(&conn, args->path))
+    {
+        args->errors = args->requests;
+        return NULL;
+    }
+    for (size_t i = 0; i < args->requests; ++i)
+    {
+        const client_buffer *request =
+            args->schedule[(args->offset + i) % args->schedule_len];
+        double start = stats_now_ns();
+        uint16_t id;
+        size_t stdout_len = 0;
+        if (client_send(&conn, request->data, request->len) ||
+            client_read_end(&conn, &id, &stdout_len))
+        {
+            args->errors += args->requests - i;
+            break;
+        }
+        args->latencies[i] = stats_now_ns() - start;
+        if (stdout_len == 0)
+        {
+            args->errors += 1;
+        }
+    }
+    client_close(&conn);
+    return NULL;
+}
+
+/**
+ * Encodes the request of a mix entry.
+ *
+ * @param entry The entry to encode the request of.
+ *
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+static int build_entry(mix_entry *entry)
+{
+    char *query = malloc(entry->query + 32);
+    char *uri = malloc(entry->query + 64);
+    char *body = malloc(entry->body + 1);
+    client_buffer params = {0};
+    int ret = query == NULL || uri == NULL || body == NULL;
+
+    /* A query string of short pairs cut to length. */
+    size_t len = 0;
+    for (size_t i = 0; !ret && len < entry->query; ++i)
+    {
+        len += sprintf(query + len, "%sk%zu=value%zu", len ? "&" : "", i, i);
+    }
+    if (!ret)
+    {
+        query[entry->query] = '\0';
+        sprintf(uri, "/bench/42%s%s", entry->query ? "?" : "", query);
+        memset(body, 'b', entry->body);
+        body[entry->body] = '\0';
+
+        char length[32];
+        snprintf(length, sizeof(length), "%zu", entry->body);
+        ret = client_add_param(
+                  &params, "REQUEST_METHOD", entry->body ? "POST" : "GET") ||
+              client_add_param(&params, "DOCUMENT_URI", "/bench/42") ||
+              client_add_param(&params, "REQUEST_URI", uri) ||
+              client_add_param(&params, "QUERY_STRING", query) ||
+              client_add_param(&params, "CONTENT_LENGTH", length) ||
+              client_add_param(&params, "SERVER_PROTOCOL", "HTTP/1.1");
+    }
+    for (size_t i = 0; !ret && i < entry->headers; ++i)
+    {
+        char name[48], value[64];
+        snprintf(name, sizeof(name), "HTTP_X_BENCH_%zu", i);
+        snprintf(value, sizeof(value), "header-value-%zu-abcdefghijklmnop", i);
+        ret = client_add_param(&params, name, value);
+    }
+    ret = ret || client_build_request(
+        &entry->request, 1, 1, &params, body, entry->body
+    );
+
+    client_buffer_free(&params);
+    free(body);
+    free(uri);
+    free(query);
+    return ret ? -1 : 0;
+}
+
+/**
+ * Parses a mix.
+ *
+ * @param str The mix, as described at the top of this file.
+ *
+ * @param[out] mix The entries of the mix. At least MAX_MIX long.
+ *
+ * @return The number of entries, 0 if the mix is malformed.
+ */
+static size_t parse_mix(const char *str, mix_entry *mix)
+{
+    size_t n = 0;
+    while (n < MAX_MIX)
+    {
+        mix_entry *entry = &mix[n];
+        *entry = (mix_entry) {0};
+        int end;
+        if (sscanf(
+                str,
+                "%zu:%zu:%zu:%zu%n",
+                &entry->weight,
+                &entry->headers,
+                &entry->query,
+                &entry->body,
+                &end) != 4 ||
+            entry->weight == 0)
+        {
+            return 0;
+        }
+        ++n;
+        str += end;
+        if (*str == '\0')
+        {
+            return n;
+        }
+        if (*str++ != ',')
+        {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Prints the results as JSON.
+ */
+static void print_results(
+    const char *backend,
+    const char *backend_used,
+    size_t conns,
+    size_t requests,
+    size_t workers,
+    const mix_entry *mix,
+    size_t n_mix,
+    double secs,
+    double *latencies,
+    size_t n_latencies,
+    size_t errors)
+{
+    printf(
+        "{\n  \"benchmark\": \"bench_fcgi\",\n  \"version\": \"%s\",\n"
+        "  \"backend\": \"%s\",\n  \"backend_used\": \"%s\",\n"
+        "  \"connections\": %zu,\n  \"requests\": %zu,\n"
+        "  \"workers\": %zu,\n  \"mix\": [\n",
+        VLA_VERSION, backend, backend_used, conns, conns * requests, workers
+    );
+    for (size_t i = 0; i < n_mix; ++i)
+    {
+        printf(
+            "    {\"weight\": %zu, \"headers\": %zu, \"query_bytes\": %zu, "
+            "\"body_bytes\": %zu}%s\n",
+            mix[i].weight, mix[i].headers, mix[i].query, mix[i].body,
+            i + 1 < n_mix ? "," : ""
+        );
+    }
+    printf(
+        "  ],\n  \"seconds\": %.3f,\n  \"requests_per_second\": %.0f,\n"
+        "  \"errors\": %zu,\n",
+        secs, (conns * requests - errors) / secs, errors
+    );
+
+    double total = 0;
+    for (size_t i = 0; i < n_latencies; ++i)
+    {
+        total += latencies[i];
+    }
+    stats_sort(latencies, n_latencies);
+    if (n_latencies)
+    {
+        printf(
+            "  \"latency\": {\"mean_ns\": %.0f, \"p50_ns\": %.0f, "
+            "\"p99_ns\": %.0f, \"p999_ns\": %.0f, \"max_ns\": %.0f}\n}\n",
+            total / n_latencies,
+            stats_percentile(latencies, n_latencies, 50),
+            stats_percentile(latencies, n_latencies, 99),
+            stats_percentile(latencies, n_latencies, 99.9),
+            latencies[n_latencies - 1]
+        );
+    }
+    else
+    {
+        printf("  \"latency\": null\n}\n");
+    }
+}
+
+/**
+ * Runs the benchmark and prints the results.
+ *
+ * @param backend The I/O backend of the server.
+ *
+ * @param conns The number of client connections.
+ *
+ * @param requests The number of requests per connection.
+ *
+ * @param workers The number of server worker threads.
+ *
+ * @param mix The requests to send.
+ *
+ * @param n_mix The number of entries in mix.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int run(
+    enum vla_io_backend backend,
+    size_t conns,
+    size_t requests,
+    size_t workers,
+    mix_entry *mix,
+    size_t n_mix)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/valhalla-bench-%d.sock", getpid());
+
+    vla_context *ctx = vla_init_io(backend);
+    if (ctx == NULL || vla_listen(ctx, path, 1024))
+    {
+        fprintf(stderr, "Could not listen on %s\n", path);
+        vla_free(ctx);
+        return -1;
+    }
+    vla_add_route(ctx, VLA_HTTP_ALL, "/bench/:id", handler_echo, NULL, NULL);
+    vla_add_route(ctx, VLA_HTTP_GET, "/stop", handler_stop, NULL, NULL);
+
+    /* Every entry appears as often as its weight. */
+    size_t schedule_len = 0;
+    for (size_t i = 0; i < n_mix; ++i)
+    {
+        schedule_len += mix[i].weight;
+    }
+    const client_buffer **schedule =
+        calloc(schedule_len, sizeof(client_buffer *));
+    client_args *clients = calloc(conns, sizeof(client_args));
+    pthread_t *tids = calloc(conns, sizeof(pthread_t));
+    double *latencies = calloc(conns * requests, sizeof(double));
+    if (schedule == NULL || clients == NULL || tids == NULL ||
+        latencies == NULL)
+    {
+        fprintf(stderr, "Could not allocate memory\n");
+        free(latencies);
+        free(tids);
+        free(clients);
+        free(schedule);
+        vla_free(ctx);
+        return -1;
+    }
+    for (size_t i = 0, k = 0; i < n_mix; ++i)
+    {
+        for (size_t j = 0; j < mix[i].weight; ++j)
+        {
+            schedule[k++] = &mix[i].request;
+        }
+    }
+
+    server_args server = {.ctx = ctx, .workers = workers};
+    pthread_t server_tid;
+    pthread_create(&server_tid, NULL, server_main, &server);
+
+    double start = stats_now_ns();
+    for (size_t i = 0; i < conns; ++i)
+    {
+        clients[i] = (client_args) {
+            .path = path,
+            .requests = requests,
+            .schedule = schedule,
+            .schedule_len = schedule_len,
+            .offset = i,
+            .latencies = latencies + i * requests,
+        };
+        pthread_create(&tids[i], NULL, client_main, &clients[i]);
+    }
+    size_t errors = 0;
+    for (size_t i = 0; i < conns; ++i)
+    {
+        pthread_join(tids[i], NULL);
+        errors += clients[i].errors;
+    }
+    double secs = (stats_now_ns() - start) / 1e9;
+
+    /* Stop the server. */
+    client_buffer stop = {0};
+    client_buffer params = {0};
+    client_conn conn;
+    if (client_add_param(&params, "REQUEST_METHOD", "GET") == 0 &&
+        client_add_param(&params, "DOCUMENT_URI", "/stop") == 0 &&
+        client_build_request(&stop, 1, 0, &params, NULL, 0) == 0 &&
+        client_connect(&conn, path) == 0)
+    {
+        uint16_t id;
+        client_send(&conn, stop.data, stop.len);
+        client_read_end(&conn, &id, NULL);
+        client_close(&conn);
+    }
+    pthread_join(server_tid, NULL);
+
+    vla_stats stats;
+    vla_get_stats(ctx, &stats);
+
+    /* Only requests that got a response have a latency. */
+    size_t n_latencies = 0;
+    for (size_t i = 0; i < conns; ++i)
+    {
+        for (size_t j = 0; j < requests; ++j)
+        {
+            if (clients[i].latencies[j] > 0)
+            {
+                latencies[n_latencies++] = clients[i].latencies[j];
+            }
+        }
+    }
+    print_results(
+        backend == VLA_IO_URING ? "io_uring" : "epoll",
+        stats_used_backend(&stats),
+        conns, requests, workers, mix, n_mix,
+        secs, latencies, n_latencies, errors
+    );
+
+    client_buffer_free(&params);
+    client_buffer_free(&stop);
+    free(latencies);
+    free(tids);
+    free(clients);
+    free(schedule);
+    vla_free(ctx);
+    unlink(path);
+    return errors || server.ret ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t conns = 16, requests = 20000, workers = 1;
+    enum vla_io_backend backend = VLA_IO_EPOLL;
+    const char *mix_str = DEFAULT_MIX;
+    int opt, usage = 0;
+    while ((opt = getopt(argc, argv, "c:n:w:i:m:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            conns = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'n':
+            requests = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'w':
+            workers = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'i':
+            if (strcmp(optarg, "epoll") == 0)
+            {
+                backend = VLA_IO_EPOLL;
+            }
+            else if (strcmp(optarg, "io_uring") == 0)
+            {
+                backend = VLA_IO_URING;
+            }
+            else
+            {
+                usage = 1;
+            }
+            break;
+
+        case 'm':
+            mix_str = optarg;
+            break;
+
+        default:
+            usage = 1;
+            break;
+        }
+    }
+
+    mix_entry mix[MAX_MIX];
+    size_t n_mix = parse_mix(mix_str, mix);
+    if (usage || conns == 0 || requests == 0 || workers == 0 || n_mix == 0)
+    {
+        fprintf(
+            stderr,
+            "Usage: %s [-c connections] [-n requests per connection] "
+            "[-w workers] [-i epoll|io_uring] "
+            "[-m weight:headers:query:body,...]\n",
+            argv[0]
+        );
+        return EXIT_FAILURE;
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < n_mix && ret == 0; ++i)
+    {
+        ret = build_entry(&mix[i]);
+    }
+    if (ret)
+    {
+        fprintf(stderr, "Could not build the requests\n");
+    }
+    else
+    {
+        ret = run(backend, conns, requests, workers, mix, n_mix);
+    }
+
+    for (size_t i = 0; i < n_mix; ++i)
+    {
+        client_buffer_free(&mix[i].request);
+    }
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
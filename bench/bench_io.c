@@ -0,0 +1,263 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021 Ripose
+//
+// This file is part of Valhalla.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License version 3 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Additional permission under GNU AGPL version 3 section 7
+//
+// If you modify this Program, or any covered work, by linking or combining it
+// with FastCGI (or a modified version of that library), containing parts
+// covered by the terms of the FastCGI Open Market Licence, the licensors of
+// this Program grant you additional permission to convey the resulting work.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Compares the throughput of the I/O backends. Every client thread keeps one
+ * connection open and sends small GET requests over it one at a time.
+ *
+ * Usage: bench_io [connections] [requests per connection] [workers]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/include/valhalla.h"
+#include "client.h"
+#include "stats.h"
+
+/* Arguments of a server thread. */
+typedef struct server_args
+{
+    /* The context to accept requests for. */
+    vla_context *ctx;
+
+    /* The number of worker threads. */
+    size_t workers;
+
+    /* The return value of vla_accept_threads(). */
+    int ret;
+} server_args;
+
+/* Arguments of a client thread. */
+typedef struct client_args
+{
+    /* The path of the socket to connect to. */
+    const char *path;
+
+    /* The number of requests to send. */
+    size_t requests;
+
+    /* The encoded request. */
+    const client_buffer *request;
+
+    /* 0 if every request succeeded, -1 otherwise. */
+    int ret;
+} client_args;
+
+/**
+ * Responds with a short body.
+ */
+static enum vla_handle_code handler_hello(const vla_request *req, void *arg)
+{
+    vla_puts(req, "Hello, World!");
+    return VLA_HANDLE_RESPOND_ACCEPT;
+}
+
+/**
+ * Stops the server.
+ */
+static enum vla_handle_code handler_stop(const vla_request *req, void *arg)
+{
+    return VLA_HANDLE_IGNORE_TERM;
+}
+
+/**
+ * Entry point of the server thread.
+ */
+static void *server_main(void *arg)
+{
+    server_args *args = arg;
+    args->ret = vla_accept_threads(args->ctx, args->workers);
+    return NULL;
+}
+
+/**
+ * Entry point of a client thread.
+ */
+static void *client_main(void *arg)
+{
+    client_args *args = arg;
+    client_conn conn;
+    args->ret = client_connect(&conn, args->path);
+    for (size_t i = 0; args->ret == 0 && i < args->requests; ++i)
+    {
+        uint16_t id;
+        if (client_send(&conn, args->request->data, args->request->len) ||
+            client_read_end(&conn, &id, NULL))
+        {
+            args->ret = -1;
+        }
+    }
+    client_close(&conn);
+    return NULL;
+}
+
+/**
+ * Encodes a GET request.
+ *
+ * @param[out] out The buffer to encode the request into.
+ *
+ * @param uri The URI of the request.
+ *
+ * @param keep_conn Nonzero to keep the connection open.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int build_get(client_buffer *out, const char *uri, int keep_conn)
+{
+    client_buffer params = {0};
+    int ret = client_add_param(&params, "REQUEST_METHOD", "GET") ||
+              client_add_param(&params, "DOCUMENT_URI", uri) ||
+              client_add_param(&params, "REQUEST_URI", uri) ||
+              client_add_param(&params, "QUERY_STRING", "") ||
+              client_add_param(&params, "SERVER_PROTOCOL", "HTTP/1.1") ||
+              client_add_param(&params, "HTTP_HOST", "localhost") ||
+              client_build_request(out, 1, keep_conn, &params, NULL, 0);
+    client_buffer_free(&params);
+    return ret ? -1 : 0;
+}
+
+/**
+ * Runs the benchmark for an I/O backend and prints the results.
+ *
+ * @param name The name of the backend.
+ *
+ * @param backend The backend.
+ *
+ * @param conns The number of client connections.
+ *
+ * @param requests The number of requests per connection.
+ *
+ * @param workers The number of server worker threads.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int run(
+    const char *name,
+    enum vla_io_backend backend,
+    size_t conns,
+    size_t requests,
+    size_t workers)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/valhalla-bench-%d.sock", getpid());
+
+    vla_context *ctx = vla_init_io(backend);
+    if (ctx == NULL || vla_listen(ctx, path, 1024))
+    {
+        fprintf(stderr, "Could not listen on %s\n", path);
+        vla_free(ctx);
+        return -1;
+    }
+    vla_add_route(ctx, VLA_HTTP_GET, "/hello", handler_hello, NULL, NULL);
+    vla_add_route(ctx, VLA_HTTP_GET, "/stop", handler_stop, NULL, NULL);
+
+    server_args server = {.ctx = ctx, .workers = workers};
+    pthread_t server_tid;
+    pthread_create(&server_tid, NULL, server_main, &server);
+
+    client_buffer request = {0};
+    build_get(&request, "/hello", 1);
+    client_args *clients = calloc(conns, sizeof(client_args));
+    pthread_t *tids = calloc(conns, sizeof(pthread_t));
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < conns; ++i)
+    {
+        clients[i] = (client_args) {
+            .path = path,
+            .requests = requests,
+            .request = &request,
+        };
+        pthread_create(&tids[i], NULL, client_main, &clients[i]);
+    }
+    int ret = 0;
+    for (size_t i = 0; i < conns; ++i)
+    {
+        pthread_join(tids[i], NULL);
+        ret |= clients[i].ret;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    /* Stop the server. */
+    client_buffer stop = {0};
+    build_get(&stop, "/stop", 0);
+    client_conn conn;
+    if (client_connect(&conn, path) == 0)
+    {
+        uint16_t id;
+        client_send(&conn, stop.data, stop.len);
+        client_read_end(&conn, &id, NULL);
+        client_close(&conn);
+    }
+    pthread_join(server_tid, NULL);
+    ret |= server.ret;
+
+    vla_stats stats;
+    vla_get_stats(ctx, &stats);
+    double secs = (end.tv_sec - start.tv_sec) +
+                  (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf(
+        "%-8s %-8s %6zu %10zu %9.3f %12.0f%s\n",
+        name, stats_used_backend(&stats), conns, conns * requests, secs,
+        conns * requests / secs,
+        ret ? " (errors)" : ""
+    );
+
+    client_buffer_free(&stop);
+    client_buffer_free(&request);
+    free(tids);
+    free(clients);
+    vla_free(ctx);
+    unlink(path);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    size_t conns = argc > 1 ? strtoul(argv[1], NULL, 10) : 16;
+    size_t requests = argc > 2 ? strtoul(argv[2], NULL, 10) : 20000;
+    size_t workers = argc > 3 ? strtoul(argv[3], NULL, 10) : 1;
+    if (conns == 0 || workers == 0)
+    {
+        fprintf(stderr, "Usage: %s [connections] [requests] [workers]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf(
+        "%-8s %-8s %6s %10s %9s %12s\n",
+        "backend", "used", "conns", "requests", "seconds", "requests/s"
+    );
+    int ret = run("epoll", VLA_IO_EPOLL, conns, requests, workers);
+    ret |= run("io_uring", VLA_IO_URING, conns, requests, workers);
+
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,352 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021 Ripose
+//
+// This file is part of Valhalla.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License version 3 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Additional permission under GNU AGPL version 3 section 7
+//
+// If you modify this Program, or any covered work, by linking or combining it
+// with FastCGI (or a modified version of that library), containing parts
+// covered by the terms of the FastCGI Open Market Licence, the licensors of
+// this Program grant you additional permission to convey the resulting work.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Benchmarks the router on realistic route sets. For every set and size it
+ * measures how long route_add() and route_freeze() take, how much memory the
+ * route tree and the frozen table use, and the latency distribution of lookups
+ * in the route tree, in the frozen table, and through route_get() once frozen.
+ * Static routes are found in a hash by route_get(), so the tree and the frozen
+ * table are timed with route_get_tree() to compare them on every set. Results
+ * are printed as JSON so they can be compared across versions.
+ *
+ * Usage: bench_routes [lookups]
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <talloc.h>
+
+#include "../src/route.h"
+#include "stats.h"
+
+#ifndef VLA_VERSION
+#define VLA_VERSION "unknown"
+#endif
+
+/* The route counts to benchmark. */
+static const size_t route_counts[] = {10, 100, 1000, 10000};
+
+/* The number of lookups timed together for one latency sample. A single lookup
+ * takes about as long as reading the clock.
+ */
+#define BATCH 32
+
+/* A route and a URI matching it. */
+typedef struct route_pair
+{
+    /* The route passed to route_add(). */
+    char *route;
+
+    /* A URI matching the route. */
+    char *uri;
+} route_pair;
+
+/* Looks up a route, like route_get(). */
+typedef const route_info_t *(*lookup_route)(
+    route_node_t *root,
+    const char *route,
+    enum vla_http_method method);
+
+/* Creates the i-th route of a route set. */
+typedef int (*make_route)(void *ctx, size_t i, route_pair *pair);
+
+/* A kind of route set. */
+typedef struct route_set
+{
+    /* The name of the set in the results. */
+    const char *name;
+
+    /* Creates the routes of the set. */
+    make_route make;
+} route_set;
+
+/**
+ * Routes without captures, like the endpoints of a REST API.
+ */
+static int make_static(void *ctx, size_t i, route_pair *pair)
+{
+    pair->route = talloc_asprintf(ctx, "/api/v1/resource%zu/list", i);
+    pair->uri = pair->route;
+    return pair->route == NULL;
+}
+
+/**
+ * Routes with a capture in the middle.
+ */
+static int make_capture(void *ctx, size_t i, route_pair *pair)
+{
+    pair->route = talloc_asprintf(ctx, "/api/v1/items%zu/:id/details", i);
+    pair->uri = talloc_asprintf(ctx, "/api/v1/items%zu/42/details", i);
+    return pair->route == NULL || pair->uri == NULL;
+}
+
+/**
+ * Routes ending in a match all, like static file directories.
+ */
+static int make_wildcard(void *ctx, size_t i, route_pair *pair)
+{
+    pair->route = talloc_asprintf(ctx, "/static%zu/*", i);
+    pair->uri = talloc_asprintf(ctx, "/static%zu/css/site.css", i);
+    return pair->route == NULL || pair->uri == NULL;
+}
+
+/**
+ * Long routes that branch at several levels and mix captures with a match all.
+ */
+static int make_deep(void *ctx, size_t i, route_pair *pair)
+{
+    size_t org = i / 100, team = i / 10 % 10, repo = i % 10;
+    pair->route = talloc_asprintf(
+        ctx, "/v2/org%zu/team%zu/:member/repos/repo%zu/tree/*", org, team, repo
+    );
+    pair->uri = talloc_asprintf(
+        ctx,
+        "/v2/org%zu/team%zu/alice/repos/repo%zu/tree/src/main.c",
+        org, team, repo
+    );
+    return pair->route == NULL || pair->uri == NULL;
+}
+
+/**
+ * An even mix of the other sets.
+ */
+static int make_mixed(void *ctx, size_t i, route_pair *pair)
+{
+    static const make_route makes[] = {
+        make_static, make_capture, make_wildcard, make_deep
+    };
+    return makes[i % 4](ctx, i, pair);
+}
+
+/* The route sets to benchmark. */
+static const route_set route_sets[] = {
+    {"static", make_static},
+    {"capture", make_capture},
+    {"wildcard", make_wildcard},
+    {"deep", make_deep},
+    {"mixed", make_mixed},
+};
+
+/**
+ * Adds a route. Necessary because route_add takes a va_list.
+ */
+static int add_route(route_node_t *root, const char *route, ...)
+{
+    va_list ap;
+    va_start(ap, route);
+    int ret = route_add(root, VLA_HTTP_GET, route, NULL, NULL, ap);
+    va_end(ap);
+    return ret;
+}
+
+/**
+ * Times route lookups and prints their latency distribution as a JSON object.
+ *
+ * @param lookup The lookup function to time.
+ *
+ * @param root The root of the route tree.
+ *
+ * @param pairs The routes whose URIs are looked up in turn.
+ *
+ * @param n The number of routes.
+ *
+ * @param lookups The number of lookups.
+ *
+ * @return 0 on success, -1 if a lookup failed or memory could not be
+ *         allocated.
+ */
+static int print_lookups(
+    lookup_route lookup,
+    route_node_t *root,
+    const route_pair *pairs,
+    size_t n,
+    size_t lookups)
+{
+    size_t n_samples = lookups / BATCH ? lookups / BATCH : 1;
+    double *samples = malloc(n_samples * sizeof(double));
+    if (samples == NULL)
+    {
+        return -1;
+    }
+
+    /* Warm the caches so the first samples aren't outliers. */
+    size_t found = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        found += lookup(root, pairs[i].uri, VLA_HTTP_GET) != NULL;
+    }
+
+    size_t next = 0;
+    double total = 0;
+    for (size_t s = 0; s < n_samples; ++s)
+    {
+        double start = stats_now_ns();
+        for (size_t i = 0; i < BATCH; ++i)
+        {
+            found += lookup(root, pairs[next].uri, VLA_HTTP_GET) != NULL;
+            next = next + 1 < n ? next + 1 : 0;
+        }
+        samples[s] = (stats_now_ns() - start) / BATCH;
+        total += samples[s];
+    }
+    if (found != n + n_samples * BATCH)
+    {
+        free(samples);
+        return -1;
+    }
+
+    stats_sort(samples, n_samples);
+    printf(
+        "{\"mean_ns\": %.1f, \"p50_ns\": %.1f, \"p90_ns\": %.1f, "
+        "\"p99_ns\": %.1f, \"p999_ns\": %.1f, \"max_ns\": %.1f}",
+        total / n_samples,
+        stats_percentile(samples, n_samples, 50),
+        stats_percentile(samples, n_samples, 90),
+        stats_percentile(samples, n_samples, 99),
+        stats_percentile(samples, n_samples, 99.9),
+        samples[n_samples - 1]
+    );
+    free(samples);
+    return 0;
+}
+
+/**
+ * Benchmarks one size of a route set and prints the result as a JSON object.
+ *
+ * @param set The route set.
+ *
+ * @param n The number of routes.
+ *
+ * @param lookups The number of lookups to time for each kind of lookup.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int bench_set(const route_set *set, size_t n, size_t lookups)
+{
+    void *mem_ctx = talloc_new(NULL);
+    route_pair *pairs = talloc_array(mem_ctx, route_pair, n);
+    if (pairs == NULL)
+    {
+        talloc_free(mem_ctx);
+        return -1;
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (set->make(pairs, i, &pairs[i]))
+        {
+            talloc_free(mem_ctx);
+            return -1;
+        }
+    }
+
+    double start = stats_now_ns();
+    route_node_t *root = route_init_root(mem_ctx);
+    for (size_t i = 0; root && i < n; ++i)
+    {
+        if (add_route(root, pairs[i].route, NULL))
+        {
+            root = NULL;
+        }
+    }
+    double build = stats_now_ns() - start;
+    if (root == NULL)
+    {
+        fprintf(stderr, "Could not add the %s routes\n", set->name);
+        talloc_free(mem_ctx);
+        return -1;
+    }
+    size_t tree_bytes = talloc_total_size(root);
+
+    printf(
+        "    {\"set\": \"%s\", \"routes\": %zu, \"build_ns\": %.0f, "
+        "\"build_ns_per_route\": %.1f, \"tree_bytes\": %zu, ",
+        set->name, n, build, build / n, tree_bytes
+    );
+    printf("\"tree_lookup\": ");
+    int ret = print_lookups(route_get_tree, root, pairs, n, lookups);
+
+    start = stats_now_ns();
+    ret = ret ? ret : route_freeze(root);
+    double freeze = stats_now_ns() - start;
+    if (ret == 0)
+    {
+        printf(
+            ", \"freeze_ns\": %.0f, \"table_bytes\": %zu, "
+            "\"frozen_lookup\": ",
+            freeze, talloc_total_size(root) - tree_bytes
+        );
+        ret = print_lookups(route_get_tree, root, pairs, n, lookups);
+    }
+    if (ret == 0)
+    {
+        printf(", \"lookup\": ");
+        ret = print_lookups(route_get, root, pairs, n, lookups);
+    }
+    printf("}");
+
+    talloc_free(mem_ctx);
+    if (ret)
+    {
+        fprintf(stderr, "Lookups of the %s routes failed\n", set->name);
+    }
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    size_t lookups = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    if (lookups == 0)
+    {
+        fprintf(stderr, "Usage: %s [lookups]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf(
+        "{\n  \"benchmark\": \"bench_routes\",\n  \"version\": \"%s\",\n"
+        "  \"lookups\": %zu,\n  \"batch\": %d,\n  \"results\": [\n",
+        VLA_VERSION, lookups, BATCH
+    );
+    const char *sep = "";
+    for (size_t i = 0; i < sizeof(route_sets) / sizeof(*route_sets); ++i)
+    {
+        for (size_t j = 0; j < sizeof(route_counts) / sizeof(*route_counts); ++j)
+        {
+            printf("%s", sep);
+            if (bench_set(&route_sets[i], route_counts[j], lookups))
+            {
+                return EXIT_FAILURE;
+            }
+            sep = ",\n";
+        }
+    }
+    printf("\n  ]\n}\n");
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,356 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021 Ripose
+//
+// This file is part of Valhalla.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License version 3 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Additional permission under GNU AGPL version 3 section 7
+//
+// If you modify this Program, or any covered work, by linking or combining it
+// with FastCGI (or a modified version of that library), containing parts
+// covered by the terms of the FastCGI Open Market Licence, the licensors of
+// this Program grant you additional permission to convey the resulting work.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "client.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* FastCGI record types used by the client. */
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+
+/* The length of a record header. */
+#define FCGI_HEADER_LEN 8
+
+/* The maximum length of the content of a record. */
+#define FCGI_MAX_CONTENT_LEN 0xFFFF
+
+/* The size of a single read from the socket. */
+#define READ_SIZE (64 * 1024)
+
+int client_buffer_append(client_buffer *buf, const void *data, size_t len)
+{
+    if (buf->len + len > buf->cap)
+    {
+        size_t cap = buf->cap ? buf->cap * 2 : 256;
+        while (cap < buf->len + len)
+        {
+            cap *= 2;
+        }
+        unsigned char *tmp = realloc(buf->data, cap);
+        if (tmp == NULL)
+        {
+            return -1;
+        }
+        buf->data = tmp;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+void client_buffer_free(client_buffer *buf)
+{
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+}
+
+/**
+ * Appends the length of a name or value of a name-value pair.
+ *
+ * @param buf The buffer to append to.
+ *
+ * @param len The length.
+ *
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+static int append_pair_length(client_buffer *buf, size_t len)
+{
+    if (len < 0x80)
+    {
+        unsigned char b = len;
+        return client_buffer_append(buf, &b, 1);
+    }
+    unsigned char b[4] = {
+        (len >> 24) | 0x80, (len >> 16) & 0xFF, (len >> 8) & 0xFF, len & 0xFF,
+    };
+    return client_buffer_append(buf, b, sizeof(b));
+}
+
+int client_add_param(client_buffer *params, const char *name, const char *value)
+{
+    size_t name_len = strlen(name);
+    size_t value_len = strlen(value);
+    if (append_pair_length(params, name_len) ||
+        append_pair_length(params, value_len) ||
+        client_buffer_append(params, name, name_len) ||
+        client_buffer_append(params, value, value_len))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Appends a record to a buffer.
+ *
+ * @param out The buffer to append to.
+ *
+ * @param type The record type.
+ *
+ * @param id The request id.
+ *
+ * @param content The content of the record.
+ *
+ * @param len The length of content. At most FCGI_MAX_CONTENT_LEN.
+ *
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+static int append_record(
+    client_buffer *out,
+    unsigned char type,
+    uint16_t id,
+    const void *content,
+    size_t len)
+{
+    unsigned char hdr[FCGI_HEADER_LEN] = {
+        1, type, id >> 8, id & 0xFF, len >> 8, len & 0xFF, 0, 0,
+    };
+    if (client_buffer_append(out, hdr, sizeof(hdr)))
+    {
+        return -1;
+    }
+    return len ? client_buffer_append(out, content, len) : 0;
+}
+
+/**
+ * Appends a stream as records followed by the empty record ending it.
+ *
+ * @param out The buffer to append to.
+ *
+ * @param type The stream type.
+ *
+ * @param id The request id.
+ *
+ * @param data The stream. Can be NULL if len is 0.
+ *
+ * @param len The length of the stream.
+ *
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+static int append_stream(
+    client_buffer *out,
+    unsigned char type,
+    uint16_t id,
+    const unsigned char *data,
+    size_t len)
+{
+    while (len > 0)
+    {
+        size_t n = len < FCGI_MAX_CONTENT_LEN ? len : FCGI_MAX_CONTENT_LEN;
+        if (append_record(out, type, id, data, n))
+        {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return append_record(out, type, id, NULL, 0);
+}
+
+int client_build_request(
+    client_buffer *out,
+    uint16_t id,
+    int keep_conn,
+    const client_buffer *params,
+    const void *body,
+    size_t body_len)
+{
+    /* Responder role. */
+    unsigned char begin[8] = {0, 1, keep_conn ? 1 : 0};
+    if (append_record(out, FCGI_BEGIN_REQUEST, id, begin, sizeof(begin)) ||
+        append_stream(out, FCGI_PARAMS, id, params->data, params->len) ||
+        append_stream(out, FCGI_STDIN, id, body, body_len))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int client_connect(client_conn *conn, const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    memset(conn, 0, sizeof(*conn));
+    for (int attempt = 0; attempt < 100; ++attempt)
+    {
+        conn->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (conn->fd < 0)
+        {
+            return -1;
+        }
+        if (connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        {
+            return 0;
+        }
+        close(conn->fd);
+        if (errno != ENOENT && errno != ECONNREFUSED)
+        {
+            break;
+        }
+        struct timespec delay = {.tv_nsec = 10 * 1000 * 1000};
+        nanosleep(&delay, NULL);
+    }
+    conn->fd = -1;
+    return -1;
+}
+
+void client_close(client_conn *conn)
+{
+    if (conn->fd >= 0)
+    {
+        close(conn->fd);
+    }
+    conn->fd = -1;
+    client_buffer_free(&conn->in);
+    conn->in_pos = 0;
+}
+
+int client_send(client_conn *conn, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    while (len > 0)
+    {
+        ssize_t n = send(conn->fd, p, len, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Makes sure a number of unprocessed bytes are buffered.
+ *
+ * @param conn The connection to read from.
+ *
+ * @param len The number of bytes needed.
+ *
+ * @return 0 on success, -1 on error or if the connection was closed.
+ */
+static int fill(client_conn *conn, size_t len)
+{
+    if (conn->in.len - conn->in_pos >= len)
+    {
+        return 0;
+    }
+    if (conn->in_pos > 0)
+    {
+        memmove(
+            conn->in.data,
+            conn->in.data + conn->in_pos,
+            conn->in.len - conn->in_pos
+        );
+        conn->in.len -= conn->in_pos;
+        conn->in_pos = 0;
+    }
+    while (conn->in.len < len)
+    {
+        size_t want = len - conn->in.len > READ_SIZE ?
+            len - conn->in.len : READ_SIZE;
+        if (conn->in.cap - conn->in.len < want)
+        {
+            size_t cap = conn->in.len + want;
+            unsigned char *tmp = realloc(conn->in.data, cap);
+            if (tmp == NULL)
+            {
+                return -1;
+            }
+            conn->in.data = tmp;
+            conn->in.cap = cap;
+        }
+        ssize_t n = recv(
+            conn->fd, conn->in.data + conn->in.len,
+            conn->in.cap - conn->in.len, 0
+        );
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        conn->in.len += n;
+    }
+    return 0;
+}
+
+int client_read_end(client_conn *conn, uint16_t *id, size_t *stdout_len)
+{
+    for (;;)
+    {
+        if (fill(conn, FCGI_HEADER_LEN))
+        {
+            return -1;
+        }
+        const unsigned char *hdr = conn->in.data + conn->in_pos;
+        unsigned char type = hdr[1];
+        uint16_t rec_id = hdr[2] << 8 | hdr[3];
+        size_t content_len = hdr[4] << 8 | hdr[5];
+        size_t rec_len = FCGI_HEADER_LEN + content_len + hdr[6];
+        if (fill(conn, rec_len))
+        {
+            return -1;
+        }
+        conn->in_pos += rec_len;
+
+        if (type == FCGI_STDOUT && stdout_len)
+        {
+            *stdout_len += content_len;
+        }
+        else if (type == FCGI_END_REQUEST)
+        {
+            *id = rec_id;
+            return 0;
+        }
+    }
+}
@@ -0,0 +1,164 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021 Ripose
+//
+// This file is part of Valhalla.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License version 3 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Additional permission under GNU AGPL version 3 section 7
+//
+// If you modify this Program, or any covered work, by linking or combining it
+// with FastCGI (or a modified version of that library), containing parts
+// covered by the terms of the FastCGI Open Market Licence, the licensors of
+// this Program grant you additional permission to convey the resulting work.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __BENCH_CLIENT_H__
+#define __BENCH_CLIENT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A growable byte buffer. */
+typedef struct client_buffer
+{
+    /* The bytes. */
+    unsigned char *data;
+
+    /* The number of bytes in data. */
+    size_t len;
+
+    /* The capacity of data. */
+    size_t cap;
+} client_buffer;
+
+/* A connection to a FastCGI application. */
+typedef struct client_conn
+{
+    /* The socket. */
+    int fd;
+
+    /* Bytes that were read but not processed yet. */
+    client_buffer in;
+
+    /* The position of the first unprocessed byte in in. */
+    size_t in_pos;
+} client_conn;
+
+/**
+ * Appends bytes to a buffer.
+ *
+ * @param buf The buffer to append to.
+ *
+ * @param data The bytes to append.
+ *
+ * @param len The number of bytes to append.
+ *
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int client_buffer_append(client_buffer *buf, const void *data, size_t len);
+
+/**
+ * Frees the memory of a buffer.
+ *
+ * @param buf The buffer to free.
+ */
+void client_buffer_free(client_buffer *buf);
+
+/**
+ * Appends a name-value pair to a FCGI_PARAMS stream.
+ *
+ * @param params The stream to append to.
+ *
+ * @param name The name.
+ *
+ * @param value The value.
+ *
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int client_add_param(client_buffer *params, const char *name, const char *value);
+
+/**
+ * Appends every record of a request to a buffer.
+ *
+ * @param out The buffer to append to.
+ *
+ * @param id The request id.
+ *
+ * @param keep_conn Nonzero to ask the application to keep the connection open.
+ *
+ * @param params The FCGI_PARAMS stream.
+ *
+ * @param body The request body. Can be NULL if body_len is 0.
+ *
+ * @param body_len The length of body.
+ *
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int client_build_request(
+    client_buffer *out,
+    uint16_t id,
+    int keep_conn,
+    const client_buffer *params,
+    const void *body,
+    size_t body_len);
+
+/**
+ * Connects to an application listening on a Unix domain socket. Retries for up
+ * to a second while the socket doesn't exist yet.
+ *
+ * @param conn The connection to initialize.
+ *
+ * @param path The path of the socket.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int client_connect(client_conn *conn, const char *path);
+
+/**
+ * Closes a connection.
+ *
+ * @param conn The connection to close.
+ */
+void client_close(client_conn *conn);
+
+/**
+ * Writes bytes to a connection.
+ *
+ * @param conn The connection to write to.
+ *
+ * @param data The bytes to write.
+ *
+ * @param len The number of bytes to write.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int client_send(client_conn *conn, const void *data, size_t len);
+
+/**
+ * Reads records until any request ends.
+ *
+ * @param conn The connection to read from.
+ *
+ * @param[out] id The id of the request that ended.
+ *
+ * @param[out] stdout_len The number of FCGI_STDOUT bytes received for all
+ *                        requests while waiting. Can be NULL.
+ *
+ * @return 0 on success, -1 on error or if the connection was closed.
+ */
+int client_read_end(client_conn *conn, uint16_t *id, size_t *stdout_len);
+
+#endif // __BENCH_CLIENT_H__
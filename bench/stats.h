@@ -0,0 +1,74 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021 Ripose
+//
+// This file is part of Valhalla.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License version 3 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Additional permission under GNU AGPL version 3 section 7
+//
+// If you modify this Program, or any covered work, by linking or combining it
+// with FastCGI (or a modified version of that library), containing parts
+// covered by the terms of the FastCGI Open Market Licence, the licensors of
+// this Program grant you additional permission to convey the resulting work.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __BENCH_STATS_H__
+#define __BENCH_STATS_H__
+
+#include <stddef.h>
+
+#include "../src/include/valhalla.h"
+
+/**
+ * Gets the time of a monotonic clock.
+ *
+ * @return The time in nanoseconds.
+ */
+double stats_now_ns();
+
+/**
+ * Sorts samples in ascending order.
+ *
+ * @param samples The samples to sort.
+ *
+ * @param n The number of samples.
+ */
+void stats_sort(double *samples, size_t n);
+
+/**
+ * Gets a percentile of sorted samples.
+ *
+ * @param samples The samples in ascending order.
+ *
+ * @param n The number of samples. Must not be 0.
+ *
+ * @param p The percentile, between 0 and 100.
+ *
+ * @return The smallest sample that is at least p percent of the samples.
+ */
+double stats_percentile(const double *samples, size_t n, double p);
+
+/**
+ * Names the I/O backend a server's workers actually ran. It differs from the
+ * requested backend if io_uring fell back to epoll.
+ *
+ * @param stats The counters of the server's context.
+ *
+ * @return "io_uring", "epoll", or "mixed" if workers ran different backends.
+ */
+const char *stats_used_backend(const vla_stats *stats);
+
+#endif // __BENCH_STATS_H__
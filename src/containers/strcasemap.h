@@ -31,34 +31,184 @@
 
 #include "khash.h"
 
-#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Keys are read a word or vector at a time, which can run past their nul
+ * terminator. Reads are only done when they can't cross into the next page,
+ * so they're safe, but the sanitizers would still flag them. */
+#define STRCASE_NO_SANITIZE \
+    __attribute__((no_sanitize_address, no_sanitize_thread))
+
+/* The size of a page, the granularity reads can fault at. */
+#define STRCASE_PAGE_SIZE 4096
+
+/**
+ * Checks if a read starting at a pointer stays within its page.
+ *
+ * @param ptr The start of the read.
+ *
+ * @param size The size of the read.
+ *
+ * @return Nonzero if the read can't fault when ptr itself is readable.
+ */
+static inline int strcase_read_ok(const void *ptr, size_t size)
+{
+    return ((uintptr_t)ptr & (STRCASE_PAGE_SIZE - 1)) <=
+        STRCASE_PAGE_SIZE - size;
+}
 
 /**
- * Hashes a string ignoring case.
+ * Lowercases an ASCII character. Unlike tolower, doesn't depend on the locale.
  *
- * @param ptr A pointer to the string to hash.
+ * @param c The character to lowercase.
  *
- * @param unused Length of ptr. Unused because strings are nul terminated.
+ * @return The lowercase character.
+ */
+static inline unsigned char strcase_fold(unsigned char c)
+{
+    return c | ((unsigned char)(c - 'A') < 26) << 5;
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/* Every byte set to 0x01 and 0x80 respectively. */
+#define STRCASE_ONES 0x0101010101010101ull
+#define STRCASE_HIGHS 0x8080808080808080ull
+
+/**
+ * Lowercases the ASCII characters in a word.
  *
- * @param seed The seed to use in the hash function.
+ * @param w The word to lowercase.
  *
- * @return The hash of ptr.
+ * @return The lowercase word.
  */
-static size_t hash_ignorecase(const char *str)
+static inline uint64_t strcase_fold_word(uint64_t w)
 {
-    char buf[512];
-    size_t len;
-    for (len = 0; len < sizeof(buf) - 1 && str[len]; ++len)
+    uint64_t low = w & ~STRCASE_HIGHS;
+    /* Sets the high bit of each byte that is at least 'A' and over 'Z'. */
+    uint64_t ge_a = low + STRCASE_ONES * (0x80 - 'A');
+    uint64_t gt_z = low + STRCASE_ONES * (0x7F - 'Z');
+    uint64_t upper = (ge_a ^ gt_z) & ~w & STRCASE_HIGHS;
+    return w | upper >> 2;
+}
+#endif
+
+/**
+ * Mixes a word into a hash.
+ *
+ * @param h The hash so far.
+ *
+ * @param w The word to mix in.
+ *
+ * @return The new hash.
+ */
+static inline uint64_t strcase_mix(uint64_t h, uint64_t w)
+{
+    h = (h ^ w) * 0x9E3779B97F4A7C15ull;
+    return h ^ h >> 29;
+}
+
+/**
+ * Hashes a string ignoring ASCII case in a single pass.
+ *
+ * @param str The nul-terminated string to hash.
+ *
+ * @return The hash of str.
+ */
+STRCASE_NO_SANITIZE static inline khint_t hash_ignorecase(const char *str)
+{
+    uint64_t h = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    /* Eight characters at a time while the reads stay within a page. */
+    while (strcase_read_ok(str, sizeof(uint64_t)))
     {
-        buf[len] = tolower(str[len]);
+        uint64_t w;
+        memcpy(&w, str, sizeof(w));
+        uint64_t zeros = (w - STRCASE_ONES) & ~w & STRCASE_HIGHS;
+        if (zeros)
+        {
+            /* Only the lowest flagged byte is certain to be the terminator,
+             * and only the characters before it are part of the string. */
+            w &= ((zeros & -zeros) >> 7) - 1;
+            return strcase_mix(h, strcase_fold_word(w)) >> 32;
+        }
+        h = strcase_mix(h, strcase_fold_word(w));
+        str += sizeof(w);
     }
-    buf[len] = '\0';
-
-    return kh_str_hash_func(buf);
+#endif
+    /* Near the end of a page, hash the rest the same way one character at a
+     * time. */
+    uint64_t w = 0;
+    unsigned shift = 0;
+    for (; *str; ++str)
+    {
+        w |= (uint64_t)strcase_fold(*str) << shift;
+        shift += 8;
+        if (shift == 64)
+        {
+            h = strcase_mix(h, w);
+            w = 0;
+            shift = 0;
+        }
+    }
+    return strcase_mix(h, w) >> 32;
 }
 
-#define strcase_str_hash_equal(a, b) (strcasecmp(a, b) == 0)
+/**
+ * Compares two strings for equality ignoring ASCII case.
+ *
+ * @param a The first nul-terminated string.
+ *
+ * @param b The second nul-terminated string.
+ *
+ * @return Nonzero if the strings are equal, 0 otherwise.
+ */
+STRCASE_NO_SANITIZE static inline int strcase_equal(const char *a, const char *b)
+{
+#ifdef __SSE2__
+    /* Sixteen characters at a time while the reads stay within a page. */
+    while (strcase_read_ok(a, 16) && strcase_read_ok(b, 16))
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *)a);
+        __m128i vb = _mm_loadu_si128((const __m128i *)b);
+        /* Adds 0x20 to every character in 'A' to 'Z'. */
+        __m128i upper_a = _mm_cmplt_epi8(
+            _mm_sub_epi8(va, _mm_set1_epi8((char)('A' + 128))), _mm_set1_epi8(-128 + 26)
+        );
+        __m128i upper_b = _mm_cmplt_epi8(
+            _mm_sub_epi8(vb, _mm_set1_epi8((char)('A' + 128))), _mm_set1_epi8(-128 + 26)
+        );
+        va = _mm_or_si128(va, _mm_and_si128(upper_a, _mm_set1_epi8(0x20)));
+        vb = _mm_or_si128(vb, _mm_and_si128(upper_b, _mm_set1_epi8(0x20)));
+
+        unsigned diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xFFFF;
+        unsigned ends = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(va, _mm_setzero_si128())
+        );
+        if (diff | ends)
+        {
+            /* Equal only if the strings end together before they differ. */
+            unsigned first = (diff | ends) & -(diff | ends);
+            return !(diff & first);
+        }
+        a += 16;
+        b += 16;
+    }
+#endif
+    /* Near the end of a page, compare the rest one character at a time. */
+    while (*a && strcase_fold(*a) == strcase_fold(*b))
+    {
+        ++a;
+        ++b;
+    }
+    return strcase_fold(*a) == strcase_fold(*b);
+}
 
-KHASH_INIT(strcase, kh_cstr_t, void *, 1, hash_ignorecase, strcase_str_hash_equal);
+/* Maps strings, ignoring case, to positions. */
+KHASH_INIT(strcase, kh_cstr_t, size_t, 1, hash_ignorecase, strcase_equal);
 
 #endif // __STRCASEMAP_H__
\ No newline at end of file
@@ -25,37 +25,232 @@
 //
 ////////////////////////////////////////////////////////////////////////////////
 
+/* For accept4. */
+#define _GNU_SOURCE
+
 #include "context.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
-#include <fcgiapp.h>
 #include <talloc.h>
 
+#include "buffer/sds.h"
+#include "fcgi.h"
+#include "header.h"
 #include "request.h"
+#include "uring.h"
+
+/* The maximum number of events handled per call to epoll_wait. */
+#define MAX_EVENTS 64
+
+/* The counters and reclamation epoch of a single worker. */
+typedef struct worker_slot
+{
+    /* The counters. Only written by the worker. */
+    vla_stats counts;
+
+    /* The epoch the worker's current request started in. 0 between requests.
+     * Only written by the worker.
+     */
+    uint64_t epoch;
+
+    /* The slot of the next worker. */
+    struct worker_slot *next;
+} worker_slot;
+
+/* A route tree replaced by vla_routes_publish() that requests may still be
+ * using.
+ */
+typedef struct retired_routes
+{
+    /* The route tree. A child of this struct. */
+    route_node_t *root;
+
+    /* The epoch that began when the tree was replaced. Requests that started
+     * in it or later use a newer tree.
+     */
+    uint64_t epoch;
+
+    /* The next retired tree. */
+    struct retired_routes *next;
+} retired_routes;
+
+typedef struct vla_routes
+{
+    /* The route tree being built. A child of this struct. */
+    route_node_t *root;
+} vla_routes;
 
 typedef struct vla_context
 {
+    /* The route tree. Read-only while requests are being accepted, but can be
+     * replaced atomically by vla_routes_publish().
+     */
     route_node_t *route_tree_root;
 
+    /* The not found handler. Read-only while requests are being accepted. */
     route_info_t *unknown_info;
+
+    /* The socket requests are accepted on. */
+    int listen_fd;
+
+    /* The I/O backend requests are accepted with. */
+    enum vla_io_backend io_backend;
+
+    /* The current reclamation epoch. Starts at 1 so 0 can mark idle workers.
+     */
+    uint64_t epoch;
+
+    /* Protects workers, retired, and allocating under the context while
+     * requests are being accepted. Never taken while handling a request.
+     */
+    pthread_mutex_t lock;
+
+    /* The slot of every worker that ran for this context. */
+    worker_slot *workers;
+
+    /* The replaced route trees that have not been freed yet. */
+    retired_routes *retired;
 } vla_context;
 
-vla_context *vla_init()
+/* State shared between the workers accepting requests for a context. */
+typedef struct accept_group
+{
+    /* The context requests are accepted for. */
+    vla_context *ctx;
+
+    /* A pipe that becomes readable once workers should stop accepting
+     * requests. Both ends are -1 if there is only a single worker.
+     */
+    int stop_pipe[2];
+} accept_group;
+
+/* A worker thread accepting requests. */
+typedef struct worker_thread
 {
-    if (FCGX_Init())
+    /* The thread id. */
+    pthread_t tid;
+
+    /* The group this worker belongs to. */
+    accept_group *group;
+
+    /* The return value of the worker's accept loop. */
+    int ret;
+} worker_thread;
+
+/* The state of a worker's event loop. */
+typedef struct worker
+{
+    /* The group this worker belongs to. */
+    accept_group *group;
+
+    /* The talloc context connections and requests are allocated under. */
+    void *mem_ctx;
+
+    /* The request object reused for every request the worker handles. NULL
+     * until the first request arrives.
+     */
+    vla_request *req;
+
+    /* The counters and reclamation epoch of the worker. */
+    worker_slot *slot;
+
+    /* The epoll instance. */
+    int epfd;
+} worker;
+
+/* A connection from the web server served by a worker. */
+typedef struct connection
+{
+    /* The FastCGI connection. A child of this struct. */
+    fcgi_conn *fconn;
+
+    /* The socket. */
+    int fd;
+
+    /* The events the socket is registered for. */
+    uint32_t events;
+} connection;
+
+/**
+ * Responds with 405 Method Not Allowed and the Allow header of the route.
+ *
+ * @param req The request whose route doesn't handle its method.
+ *
+ * @param arg Unused.
+ *
+ * @return VLA_HANDLE_RESPOND_ACCEPT.
+ */
+static enum vla_handle_code method_not_allowed(const vla_request *req, void *arg)
+{
+    (void)arg;
+    if (vla_response_set_status_code(req, 405) ||
+        vla_response_header_replace_all(
+            req, "Allow", request_get_route_match(req)->allow))
     {
-        return NULL;
+        /* TODO Logging */
+    }
+    return VLA_HANDLE_RESPOND_ACCEPT;
+}
+
+/* The empty middleware of not_allowed_info. */
+static vla_middleware_func no_middleware[1];
+
+/* The empty middleware arguments of not_allowed_info. */
+static void *no_middleware_args[1];
+
+/* Handles requests whose route doesn't handle their method. */
+static const route_info_t not_allowed_info = {
+    .hdlr = method_not_allowed,
+    .mw = no_middleware,
+    .mw_args = no_middleware_args,
+};
+
+/* Identifies the listening socket in a worker's epoll set. */
+static char listen_tag;
+
+/* Identifies the stop pipe in a worker's epoll set. */
+static char stop_tag;
+
+/**
+ * Destructor for vla_context.
+ *
+ * @param ctx The vla_context to destruct.
+ *
+ * @return Always 0.
+ */
+static int context_destructor(vla_context *ctx)
+{
+    if (ctx->listen_fd != FCGI_LISTENSOCK_FILENO)
+    {
+        close(ctx->listen_fd);
     }
+    pthread_mutex_destroy(&ctx->lock);
+    return 0;
+}
+
+vla_context *vla_init()
+{
+    return vla_init_io(VLA_IO_EPOLL);
+}
 
+vla_context *vla_init_io(enum vla_io_backend backend)
+{
     vla_context *ctx = talloc(NULL, vla_context);
     if (ctx == NULL)
     {
         return NULL;
     }
     talloc_set_name_const(ctx, "Top Level Valhalla Context");
+    header_init();
     ctx->route_tree_root = route_init_root(ctx);
     if (ctx->route_tree_root == NULL)
     {
@@ -64,9 +259,32 @@ vla_context *vla_init()
         return NULL;
     }
     ctx->unknown_info = NULL;
+    ctx->listen_fd = FCGI_LISTENSOCK_FILENO;
+    ctx->io_backend = backend;
+    ctx->epoch = 1;
+    ctx->workers = NULL;
+    ctx->retired = NULL;
+    pthread_mutex_init(&ctx->lock, NULL);
+    talloc_set_destructor(ctx, context_destructor);
     return ctx;
 }
 
+int vla_listen(vla_context *ctx, const char *path, int backlog)
+{
+    int fd = fcgi_listen(path, backlog);
+    if (fd < 0)
+    {
+        /* TODO Logging */
+        return -1;
+    }
+    if (ctx->listen_fd != FCGI_LISTENSOCK_FILENO)
+    {
+        close(ctx->listen_fd);
+    }
+    ctx->listen_fd = fd;
+    return 0;
+}
+
 int vla_free(void *ptr)
 {
     return talloc_free(ptr);
@@ -119,108 +337,764 @@ int vla_set_not_found_handler(
     return 0;
 }
 
+vla_routes *vla_routes_new()
+{
+    vla_routes *routes = talloc(NULL, vla_routes);
+    if (routes == NULL)
+    {
+        return NULL;
+    }
+    routes->root = route_init_root(routes);
+    if (routes->root == NULL)
+    {
+        /* TODO Logging */
+        talloc_free(routes);
+        return NULL;
+    }
+    return routes;
+}
+
+int vla_routes_add(
+    vla_routes *routes,
+    uint32_t methods,
+    const char *route,
+    vla_handler_func handler,
+    void *handler_arg,
+    ...)
+{
+    va_list ap;
+    va_start(ap, handler_arg);
+    int ret = route_add(routes->root, methods, route, handler, handler_arg, ap);
+    va_end(ap);
+    return ret;
+}
+
+/**
+ * Frees every retired route tree that no request started on. Must be called
+ * with the context's lock held.
+ *
+ * @param ctx The context to free the retired route trees of.
+ *
+ * @return The number of retired route trees that are still in use.
+ */
+static size_t reclaim_routes(vla_context *ctx)
+{
+    /* The epoch of the oldest request in progress. */
+    uint64_t oldest = UINT64_MAX;
+    for (const worker_slot *slot = ctx->workers; slot; slot = slot->next)
+    {
+        uint64_t epoch = __atomic_load_n(&slot->epoch, __ATOMIC_SEQ_CST);
+        if (epoch && epoch < oldest)
+        {
+            oldest = epoch;
+        }
+    }
+
+    size_t in_use = 0;
+    retired_routes **it = &ctx->retired;
+    while (*it)
+    {
+        retired_routes *retired = *it;
+        if (retired->epoch <= oldest)
+        {
+            *it = retired->next;
+            talloc_free(retired);
+        }
+        else
+        {
+            ++in_use;
+            it = &retired->next;
+        }
+    }
+    return in_use;
+}
+
+int vla_routes_publish(vla_context *ctx, vla_routes *routes)
+{
+    if (route_freeze(routes->root))
+    {
+        /* TODO Logging */
+        return -1;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    retired_routes *retired = talloc(ctx, retired_routes);
+    if (retired == NULL)
+    {
+        /* TODO Logging */
+        pthread_mutex_unlock(&ctx->lock);
+        return -1;
+    }
+    route_node_t *old = __atomic_exchange_n(
+        &ctx->route_tree_root,
+        talloc_steal(ctx, routes->root),
+        __ATOMIC_SEQ_CST
+    );
+    /* Workers that enter the new epoch load the root after it was replaced. */
+    retired->epoch = __atomic_add_fetch(&ctx->epoch, 1, __ATOMIC_SEQ_CST);
+    retired->root = talloc_steal(retired, old);
+    retired->next = ctx->retired;
+    ctx->retired = retired;
+    reclaim_routes(ctx);
+    pthread_mutex_unlock(&ctx->lock);
+
+    talloc_free(routes);
+    return 0;
+}
+
+size_t vla_routes_reclaim(vla_context *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    size_t in_use = reclaim_routes(ctx);
+    pthread_mutex_unlock(&ctx->lock);
+    return in_use;
+}
+
 const route_info_t *context_get_route(
     vla_context *ctx,
     const char *uri,
-    enum vla_http_method method)
+    enum vla_http_method method,
+    route_match *match,
+    route_cache *cache)
+{
+    route_node_t *root =
+        __atomic_load_n(&ctx->route_tree_root, __ATOMIC_SEQ_CST);
+    const route_info_t *route = cache ?
+        route_cache_lookup(cache, root, uri, method, match) :
+        route_lookup(root, uri, method, match);
+    if (route)
+    {
+        return route;
+    }
+    return match && match->allow ? &not_allowed_info : ctx->unknown_info;
+}
+
+int context_freeze_routes(vla_context *ctx)
 {
-    const route_info_t *route = route_get(ctx->route_tree_root, uri, method);
-    return route ? route : ctx->unknown_info;
+    /* Keeps the tree from being replaced and freed while it is frozen. */
+    pthread_mutex_lock(&ctx->lock);
+    int ret = route_freeze(
+        __atomic_load_n(&ctx->route_tree_root, __ATOMIC_RELAXED)
+    );
+    pthread_mutex_unlock(&ctx->lock);
+    return ret;
 }
 
 /**
- * Callback function for handling iterating over response headers. Prints
- * headers to the response.
+ * Callback function for handling iterating over response headers. Appends
+ * headers to the response header block.
  *
  * @param hdr The header.
  *
  * @param val The value of the header.
  *
- * @param ptr A pointer to the FCGI request.
+ * @param ptr A pointer to the sds string holding the header block.
  *
  * @return 0 on success, -1 on error.
  */
 int resp_header_handler(const char *hdr, const char *val, void *ptr)
 {
-    FCGX_Request *f_req = (FCGX_Request *)ptr;
-    if (FCGX_FPrintF(f_req->out, "%s: %s\r\n", hdr, val) < 0)
+    sds *block = (sds *)ptr;
+    sds tmp = sdscatprintf(*block, "%s: %s\r\n", hdr, val);
+    if (tmp == NULL)
     {
         return -1;
     }
+    *block = tmp;
     return 0;
 }
 
 /**
- * Sends a response to the web server.
+ * Sends a response to the web server and ends the request. The header block and
+ * body are handed to the FastCGI engine as a single scatter-gather write. The
+ * body of a response to a HEAD request is dropped.
  *
- * @param f_req The FCGI request.
+ * @param f_req The FCGI request. Freed by this function.
  *
  * @param req The request containg the response information.
  *
  * @return 0 if the response was successfully sent, -1 otherwise.
  */
-static int send_response(FCGX_Request *f_req, const vla_request *req)
+static int send_response(fcgi_request *f_req, const vla_request *req)
 {
-    if (response_header_iterate(req, resp_header_handler, f_req))
+    sds block = sdsempty();
+    if (block == NULL)
+    {
+        fcgi_request_finish(f_req, NULL, 0);
+        return -1;
+    }
+    if (response_header_iterate(req, resp_header_handler, &block))
     {
+        sdsfree(block);
+        fcgi_request_finish(f_req, NULL, 0);
         return -1;
     }
-    if (FCGX_PutS("\r\n", f_req->out) < 0)
+    sds tmp = sdscatlen(block, "\r\n", 2);
+    if (tmp == NULL)
     {
+        sdsfree(block);
+        fcgi_request_finish(f_req, NULL, 0);
         return -1;
     }
-    const char *body = response_get_body(req);
-    size_t body_len = response_get_body_length(req);
-    if (FCGX_PutStr(body, body_len, f_req->out) < 0)
+    block = tmp;
+
+    struct iovec iov[2] = {
+        {.iov_base = block, .iov_len = sdslen(block)},
+        {
+            .iov_base = (void *)response_get_body(req),
+            .iov_len = response_get_body_length(req),
+        },
+    };
+    int ret = fcgi_request_finish(
+        f_req, iov, req->method == VLA_HTTP_HEAD ? 1 : 2
+    );
+    sdsfree(block);
+
+    return ret;
+}
+
+/**
+ * Adds one to a counter of a worker. Only the worker writes its counters, so
+ * this needs no atomic read-modify-write. The relaxed accesses keep readers in
+ * vla_get_stats() from seeing torn values.
+ *
+ * @param counter The counter.
+ */
+static inline void stat_inc(uint64_t *counter)
+{
+    __atomic_store_n(
+        counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED
+    );
+}
+
+/**
+ * Counts how the route of a request was found.
+ *
+ * @param stats The counters of the worker that handled the request.
+ *
+ * @param match How the route was found.
+ */
+static void count_route(vla_stats *stats, const route_match *match)
+{
+    switch (match->type)
+    {
+    case ROUTE_MATCH_STATIC:
+        stat_inc(&stats->route_static_hits);
+        break;
+
+    case ROUTE_MATCH_DYNAMIC:
+        stat_inc(&stats->route_dynamic_hits);
+        break;
+
+    case ROUTE_MATCH_NONE:
+        stat_inc(&stats->route_misses);
+        break;
+    }
+    stat_inc(match->cached ?
+        &stats->route_cache_hits : &stats->route_cache_misses);
+}
+
+/**
+ * Marks the start of a request on a worker. Route trees the request can see
+ * are not freed until leave_routes() is called.
+ *
+ * @param ctx The context the request is handled for.
+ *
+ * @param slot The slot of the worker handling the request.
+ */
+static inline void enter_routes(vla_context *ctx, worker_slot *slot)
+{
+    /* The store must be visible before the request loads the route tree, so a
+     * publisher either sees the epoch or the request sees the new tree.
+     */
+    __atomic_store_n(
+        &slot->epoch,
+        __atomic_load_n(&ctx->epoch, __ATOMIC_SEQ_CST),
+        __ATOMIC_SEQ_CST
+    );
+}
+
+/**
+ * Marks the end of a request on a worker. The request must not use its route
+ * info afterwards.
+ *
+ * @param slot The slot of the worker that handled the request.
+ */
+static inline void leave_routes(worker_slot *slot)
+{
+    __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Handles a request and ends it.
+ *
+ * @param w The worker the request was accepted by.
+ *
+ * @param f_req The FCGI request to handle. Freed by this function.
+ *
+ * @param[out] code The code returned by the request's handler.
+ *
+ * @return 0 on success, -1 if the request could not be initialized.
+ */
+static int handle_request(
+    worker *w,
+    fcgi_request *f_req,
+    enum vla_handle_code *code)
+{
+    if (w->req == NULL)
+    {
+        w->req = request_alloc(w->mem_ctx);
+        if (w->req == NULL)
+        {
+            /* TODO error logging. */
+            fcgi_request_finish(f_req, NULL, 0);
+            return -1;
+        }
+    }
+    vla_request *req = w->req;
+
+    enter_routes(w->group->ctx, w->slot);
+    if (request_init(req, w->group->ctx, f_req))
     {
+        /* TODO error logging. */
+        request_reset(req);
+        leave_routes(w->slot);
+        fcgi_request_finish(f_req, NULL, 0);
         return -1;
     }
+    count_route(&w->slot->counts, request_get_route_match(req));
+    *code = vla_request_next_func(req);
+
+    if (*code & VLA_RESPOND_FLAG)
+    {
+        if (send_response(f_req, req))
+        {
+            /* TODO Error logging */
+        }
+    }
+    else
+    {
+        fcgi_request_finish(f_req, NULL, 0);
+    }
+
+    request_reset(req);
+    leave_routes(w->slot);
     return 0;
 }
 
-int vla_accept(vla_context *ctx)
+/**
+ * Tells every worker in a group to stop accepting requests. Workers finish the
+ * request they are handling before stopping.
+ *
+ * @param group The group to stop.
+ */
+static void stop_group(accept_group *group)
+{
+    if (group->stop_pipe[1] != -1)
+    {
+        /* The pipe is never read, so it stays readable for every worker. */
+        while (write(group->stop_pipe[1], "", 1) < 0 && errno == EINTR);
+    }
+}
+
+/**
+ * Accepts every pending connection and adds it to a worker's event loop.
+ *
+ * @param w The worker accepting the connections.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int accept_connections(worker *w)
+{
+    for (;;)
+    {
+        int fd = accept4(
+            w->group->ctx->listen_fd,
+            NULL,
+            NULL,
+            SOCK_NONBLOCK | SOCK_CLOEXEC
+        );
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                /* Another worker got there first. */
+                return 0;
+            }
+            /* TODO Logging */
+            return -1;
+        }
+
+        connection *conn = talloc(w->mem_ctx, connection);
+        if (conn == NULL)
+        {
+            /* TODO Logging */
+            close(fd);
+            return -1;
+        }
+        conn->fconn = fcgi_conn_new(conn, fd);
+        if (conn->fconn == NULL)
+        {
+            /* TODO Logging */
+            talloc_free(conn);
+            return -1;
+        }
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+
+        struct epoll_event ev = {.events = conn->events, .data.ptr = conn};
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev))
+        {
+            /* TODO Logging */
+            talloc_free(conn);
+            return -1;
+        }
+    }
+}
+
+/**
+ * Handles every request of a connection that was received completely.
+ *
+ * @param fconn The connection to handle the requests of.
+ *
+ * @param arg A pointer to the worker the connection belongs to.
+ *
+ * @return 0 to keep accepting requests, 1 if a handler asked to stop, -1 on
+ *         error.
+ */
+static int serve_requests(fcgi_conn *fconn, void *arg)
+{
+    worker *w = arg;
+    fcgi_request *f_req;
+    while ((f_req = fcgi_conn_next_request(fconn)))
+    {
+        enum vla_handle_code code;
+        if (handle_request(w, f_req, &code))
+        {
+            return -1;
+        }
+        if (!(code & VLA_ACCEPT_FLAG))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Reads from a connection, handles every request that was received completely,
+ * and writes queued output. The connection is closed once the web server is
+ * done with it.
+ *
+ * @param w The worker the connection belongs to.
+ *
+ * @param conn The connection.
+ *
+ * @param events The events reported for the connection's socket.
+ *
+ * @return 0 to keep accepting requests, 1 if a handler asked to stop, -1 on
+ *         error.
+ */
+static int serve_connection(worker *w, connection *conn, uint32_t events)
+{
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    {
+        /* Errors and EOF mark the connection as closing. */
+        fcgi_conn_read(conn->fconn);
+    }
+
+    int ret = serve_requests(conn->fconn, w);
+    int pending = fcgi_conn_flush(conn->fconn);
+    int closing = fcgi_conn_closing(conn->fconn);
+    if (pending < 0 || (pending == 0 && closing))
+    {
+        talloc_free(conn);
+        return ret;
+    }
+
+    /* Stop reading from closing connections and only wait for queued output
+     * to be written. */
+    uint32_t want = closing ? 0 : EPOLLIN;
+    if (pending)
+    {
+        want |= EPOLLOUT;
+    }
+    if (want != conn->events)
+    {
+        struct epoll_event ev = {.events = want, .data.ptr = conn};
+        if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, conn->fd, &ev))
+        {
+            /* TODO Logging */
+            talloc_free(conn);
+            return ret;
+        }
+        conn->events = want;
+    }
+    return ret;
+}
+
+/**
+ * Runs an epoll event loop over the listening socket and every connection a
+ * worker accepted, keeping connections open for as long as the web server asks
+ * it to.
+ *
+ * @param w The worker to run the loop for.
+ *
+ * @return 0 if every request was handled successfully, -1 otherwise.
+ */
+static int epoll_loop(worker *w)
 {
-    FCGX_Request f_req;
-    if (FCGX_InitRequest(&f_req, 0, 0))
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->epfd < 0)
     {
         /* TODO: Debugging */
         return -1;
     }
 
-    while (FCGX_Accept_r(&f_req) == 0)
+    /* EPOLLEXCLUSIVE wakes a single worker per incoming connection instead of
+     * all of them. */
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLEXCLUSIVE,
+        .data.ptr = &listen_tag,
+    };
+    accept_group *group = w->group;
+    int ret = epoll_ctl(w->epfd, EPOLL_CTL_ADD, group->ctx->listen_fd, &ev);
+    if (ret == 0 && group->stop_pipe[0] != -1)
+    {
+        ev = (struct epoll_event) {.events = EPOLLIN, .data.ptr = &stop_tag};
+        ret = epoll_ctl(w->epfd, EPOLL_CTL_ADD, group->stop_pipe[0], &ev);
+    }
+
+    int running = ret == 0;
+    while (running)
     {
-        const vla_request *req = request_new(ctx, &f_req);
-        if (req == NULL)
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, -1);
+        if (n < 0)
         {
-            /* TODO error logging. */
-            goto error;
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            /* TODO: Debugging */
+            ret = -1;
+            break;
         }
-        enum vla_handle_code code = vla_request_next_func(req);
 
-        if (code & VLA_RESPOND_FLAG)
+        for (int i = 0; i < n && running; ++i)
         {
-            if (send_response(&f_req, req))
+            void *tag = events[i].data.ptr;
+            if (tag == &stop_tag)
             {
-                /* TODO Error logging */
-                goto error;
+                running = 0;
+            }
+            else if (tag == &listen_tag)
+            {
+                if (accept_connections(w))
+                {
+                    ret = -1;
+                    running = 0;
+                }
+            }
+            else
+            {
+                int status = serve_connection(w, tag, events[i].events);
+                if (status)
+                {
+                    ret = status < 0 ? -1 : 0;
+                    running = 0;
+                }
             }
         }
+    }
 
-        talloc_free((vla_request *)req);
-        FCGX_Finish_r(&f_req);
+    close(w->epfd);
+    return ret;
+}
 
-        if (!(code & VLA_ACCEPT_FLAG))
+/**
+ * Accepts and handles requests until a handler asks to stop or an error
+ * occurs. Each call runs its own event loop with the context's I/O backend,
+ * falling back to epoll if io_uring isn't available. Every call has its own
+ * talloc hierarchy, so it can safely run on multiple threads at once.
+ *
+ * @param group The group the worker belongs to.
+ *
+ * @return 0 if every request was handled successfully, -1 otherwise.
+ */
+static int accept_loop(accept_group *group)
+{
+    worker w = {.group = group};
+    w.mem_ctx = talloc_new(NULL);
+    if (w.mem_ctx == NULL)
+    {
+        /* TODO: Debugging */
+        return -1;
+    }
+    talloc_set_name_const(w.mem_ctx, "Valhalla Worker");
+
+    /* The slot outlives the worker so vla_get_stats() keeps counting the
+     * requests it handled. */
+    vla_context *ctx = group->ctx;
+    pthread_mutex_lock(&ctx->lock);
+    w.slot = talloc_zero(ctx, worker_slot);
+    if (w.slot)
+    {
+        w.slot->next = ctx->workers;
+        ctx->workers = w.slot;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    if (w.slot == NULL)
+    {
+        /* TODO Logging */
+        talloc_free(w.mem_ctx);
+        return -1;
+    }
+
+    uring_loop *loop = NULL;
+    if (group->ctx->io_backend == VLA_IO_URING)
+    {
+        loop = uring_loop_new(
+            w.mem_ctx, group->ctx->listen_fd, group->stop_pipe[0]
+        );
+    }
+
+    /* Counted so a fallback to epoll shows up in vla_get_stats(). */
+    stat_inc(loop ? &w.slot->counts.uring_workers :
+                    &w.slot->counts.epoll_workers);
+
+    int ret = loop ? uring_loop_run(loop, serve_requests, &w) : epoll_loop(&w);
+
+    stop_group(group);
+    talloc_free(w.mem_ctx);
+    vla_routes_reclaim(ctx);
+
+    return ret;
+}
+
+/**
+ * Entry point of a worker thread.
+ *
+ * @param arg A pointer to the worker_thread.
+ *
+ * @return Always NULL. The result is stored in the worker_thread.
+ */
+static void *worker_thread_main(void *arg)
+{
+    worker_thread *worker = arg;
+    worker->ret = accept_loop(worker->group);
+    return NULL;
+}
+
+void vla_get_stats(vla_context *ctx, vla_stats *stats)
+{
+    *stats = (vla_stats) {0};
+    pthread_mutex_lock(&ctx->lock);
+    for (const worker_slot *slot = ctx->workers; slot; slot = slot->next)
+    {
+        const vla_stats *c = &slot->counts;
+        stats->route_static_hits +=
+            __atomic_load_n(&c->route_static_hits, __ATOMIC_RELAXED);
+        stats->route_dynamic_hits +=
+            __atomic_load_n(&c->route_dynamic_hits, __ATOMIC_RELAXED);
+        stats->route_misses +=
+            __atomic_load_n(&c->route_misses, __ATOMIC_RELAXED);
+        stats->route_cache_hits +=
+            __atomic_load_n(&c->route_cache_hits, __ATOMIC_RELAXED);
+        stats->route_cache_misses +=
+            __atomic_load_n(&c->route_cache_misses, __ATOMIC_RELAXED);
+        stats->uring_workers +=
+            __atomic_load_n(&c->uring_workers, __ATOMIC_RELAXED);
+        stats->epoll_workers +=
+            __atomic_load_n(&c->epoll_workers, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+int vla_accept(vla_context *ctx)
+{
+    return vla_accept_threads(ctx, 1);
+}
+
+int vla_accept_threads(vla_context *ctx, size_t n)
+{
+    if (n == 0)
+    {
+        return -1;
+    }
+    if (context_freeze_routes(ctx))
+    {
+        /* TODO Logging */
+        return -1;
+    }
+
+    /* Workers accept until the backlog is drained, which must not block. */
+    int flags = fcntl(ctx->listen_fd, F_GETFL);
+    if (flags < 0 || fcntl(ctx->listen_fd, F_SETFL, flags | O_NONBLOCK))
+    {
+        /* TODO Logging */
+        return -1;
+    }
+
+    accept_group group = {
+        .ctx = ctx,
+        .stop_pipe = {-1, -1},
+    };
+    if (n == 1)
+    {
+        return accept_loop(&group);
+    }
+
+    worker_thread *workers = talloc_array(NULL, worker_thread, n);
+    if (workers == NULL)
+    {
+        /* TODO Logging */
+        return -1;
+    }
+    if (pipe(group.stop_pipe))
+    {
+        /* TODO Logging */
+        talloc_free(workers);
+        return -1;
+    }
+
+    int ret = 0;
+    size_t started = 0;
+    for (; started < n; ++started)
+    {
+        workers[started] = (worker_thread) {
+            .group = &group,
+            .ret = 0,
+        };
+        if (pthread_create(
+                &workers[started].tid,
+                NULL,
+                worker_thread_main,
+                &workers[started]))
         {
+            /* TODO Logging */
+            stop_group(&group);
+            ret = -1;
             break;
         }
     }
 
-    FCGX_Free(&f_req, 0);
+    for (size_t i = 0; i < started; ++i)
+    {
+        pthread_join(workers[i].tid, NULL);
+        if (workers[i].ret)
+        {
+            ret = -1;
+        }
+    }
 
-    return 0;
+    close(group.stop_pipe[0]);
+    close(group.stop_pipe[1]);
+    talloc_free(workers);
 
-error:
-    FCGX_Finish_r(&f_req);
-    FCGX_Free(&f_req, 0);
-    return -1;
+    return ret;
 }
@@ -33,7 +33,9 @@
 #include "route.h"
 
 /**
- * Gets the route_info_t corresponding to the route.
+ * Gets the route_info_t corresponding to the route. If the route exists, but
+ * not for the method, a route_info_t responding with 405 Method Not Allowed is
+ * returned instead, as long as match isn't NULL.
  *
  * @param ctx The vla_context to get the route from.
  *
@@ -41,12 +43,30 @@
  *
  * @param method The HTTP request method.
  *
+ * @param[out] match Details about how the route was matched. Can be NULL if
+ *                   cache is NULL.
+ *
+ * @param cache A route cache to look the route up in first. Can be NULL.
+ *
  * @return The route_info_t corresponding to the route. NULL if it doesn't
  *         exist.
  */
 const route_info_t *context_get_route(
     vla_context *ctx,
     const char *uri,
-    enum vla_http_method method);
+    enum vla_http_method method,
+    route_match *match,
+    route_cache *cache);
+
+/**
+ * Freezes the routes of a context so lookups use the compiled route table. Must
+ * be called before requests are accepted. Does nothing if the routes are
+ * already frozen.
+ *
+ * @param ctx The vla_context to freeze the routes of.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int context_freeze_routes(vla_context *ctx);
 
 #endif // __CONTEXT_H__
\ No newline at end of file
@@ -0,0 +1,1416 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021 Ripose
+//
+// This file is part of Valhalla.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License version 3 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Additional permission under GNU AGPL version 3 section 7
+//
+// If you modify this Program, or any covered work, by linking or combining it
+// with FastCGI (or a modified version of that library), containing parts
+// covered by the terms of the FastCGI Open Market Licence, the licensors of
+// this Program grant you additional permission to convey the resulting work.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "fcgi.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <talloc.h>
+
+#include "containers/khash.h"
+#include "include/valhalla.h"
+
+/* The only version of the protocol. */
+#define FCGI_VERSION_1 1
+
+/* The length of a record header. */
+#define FCGI_HEADER_LEN 8
+
+/* The maximum length of the content of a record. */
+#define FCGI_MAX_CONTENT_LEN 0xFFFF
+
+/* The FCGI_BEGIN_REQUEST flag asking to keep the connection open. */
+#define FCGI_KEEP_CONN 1
+
+/* The only supported role. */
+#define FCGI_RESPONDER 1
+
+/* Protocol statuses of FCGI_END_REQUEST. */
+#define FCGI_REQUEST_COMPLETE 0
+#define FCGI_UNKNOWN_ROLE 3
+
+/* The size of the buffer the socket is read into. */
+#define READ_BUFFER_SIZE (16 * 1024)
+
+/* The maximum number of iovecs written with a single system call. */
+#define WRITE_IOV_MAX 64
+
+/* The maximum number of records written with a single system call. */
+#define WRITE_RECORD_MAX (WRITE_IOV_MAX / 2)
+
+/* Describes how far a request has been received. */
+enum request_state
+{
+    /* Parameters or the body are still being received. */
+    REQUEST_RECEIVING,
+
+    /* The request was received completely, but hasn't been taken yet. */
+    REQUEST_READY,
+
+    /* The request was taken by fcgi_conn_next_request. */
+    REQUEST_ACTIVE,
+};
+
+typedef struct fcgi_request
+{
+    /* The connection the request was received on. */
+    fcgi_conn *conn;
+
+    /* The FastCGI request id. */
+    uint16_t id;
+
+    /* How far the request has been received. */
+    enum request_state state;
+
+    /* Nonzero if the web server asked to keep the connection open. */
+    int keep_conn;
+
+    /* The FCGI_PARAMS stream. Name-value pairs are decoded in place once the
+     * stream is complete.
+     */
+    char *params;
+
+    /* The length of the FCGI_PARAMS stream. */
+    size_t params_len;
+
+    /* A NULL terminated array of "NAME=VALUE" strings pointing into params. */
+    char **envp;
+
+    /* FCGI_STDIN data that was received but not read yet. */
+    char *in;
+
+    /* The amount of data in the in buffer. */
+    size_t in_len;
+
+    /* The position of the first unread byte in the in buffer. */
+    size_t in_pos;
+
+    /* Nonzero once the end of the FCGI_STDIN stream was received. */
+    int in_done;
+
+    /* Nonzero if anything was written to FCGI_STDERR. */
+    int err_written;
+
+    /* The next request in the connection's ready queue. */
+    struct fcgi_request *next_ready;
+} fcgi_request;
+
+/* Maps request ids to the requests of a connection. */
+KHASH_MAP_INIT_INT(fcgi_req, fcgi_request *)
+
+typedef struct fcgi_conn
+{
+    /* The socket. */
+    int fd;
+
+    /* The header of the record being read. */
+    unsigned char hdr[FCGI_HEADER_LEN];
+
+    /* The number of header bytes read. */
+    size_t hdr_len;
+
+    /* The type of the record being read. */
+    unsigned char type;
+
+    /* The request id of the record being read. */
+    uint16_t id;
+
+    /* Content left in the record being read. */
+    size_t content_left;
+
+    /* Padding left in the record being read. */
+    size_t padding_left;
+
+    /* Content of a FCGI_BEGIN_REQUEST or management record. */
+    unsigned char *rec;
+
+    /* The number of bytes in rec. */
+    size_t rec_len;
+
+    /* Every request on this connection that hasn't ended, by id. */
+    khash_t(fcgi_req) *reqs;
+
+    /* The request the record being read belongs to. NULL if there is none. */
+    fcgi_request *cur;
+
+    /* Requests that were received completely but haven't been taken yet, in
+     * the order they became ready.
+     */
+    fcgi_request *ready_head;
+
+    /* The last request in the ready queue. */
+    fcgi_request *ready_tail;
+
+    /* Nonzero if the connection should be closed. */
+    int closing;
+
+    /* Output that couldn't be written without blocking. */
+    char *wbuf;
+
+    /* The amount of data in wbuf. */
+    size_t wbuf_len;
+
+    /* The position of the first unwritten byte in wbuf. */
+    size_t wbuf_pos;
+
+    /* Nonzero if output is always queued instead of written. */
+    int defer_writes;
+
+    /* Buffer the socket is read into. Allocated on the first read. */
+    unsigned char *rbuf;
+} fcgi_conn;
+
+/**
+ * Appends data to a talloc allocated buffer, growing it geometrically. One
+ * byte past the end of the data is always available for a nul terminator.
+ *
+ * @param ctx The talloc context of the buffer.
+ *
+ * @param[in,out] buf The buffer.
+ *
+ * @param[in,out] len The length of the data in the buffer.
+ *
+ * @param data The data to append.
+ *
+ * @param n The length of data.
+ *
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+static int buffer_append(
+    void *ctx,
+    char **buf,
+    size_t *len,
+    const void *data,
+    size_t n)
+{
+    size_t cap = talloc_array_length(*buf);
+    if (*len + n + 1 > cap)
+    {
+        size_t new_cap = cap * 2 > *len + n + 1 ? cap * 2 : *len + n + 1;
+        char *new_buf = talloc_realloc(ctx, *buf, char, new_cap);
+        if (new_buf == NULL)
+        {
+            return -1;
+        }
+        *buf = new_buf;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    return 0;
+}
+
+/*
+ *==============================================================================
+ * Writing
+ *==============================================================================
+ */
+
+/**
+ * Fills in a record header.
+ *
+ * @param[out] hdr The header to fill in.
+ *
+ * @param type The record type.
+ *
+ * @param id The request id.
+ *
+ * @param len The content length.
+ */
+static void set_header(
+    unsigned char *hdr,
+    enum fcgi_record_type type,
+    uint16_t id,
+    size_t len)
+{
+    hdr[0] = FCGI_VERSION_1;
+    hdr[1] = type;
+    hdr[2] = id >> 8;
+    hdr[3] = id & 0xFF;
+    hdr[4] = len >> 8;
+    hdr[5] = len & 0xFF;
+    hdr[6] = 0;
+    hdr[7] = 0;
+}
+
+/**
+ * Fills in a FCGI_END_REQUEST record.
+ *
+ * @param[out] rec The 16 byte record to fill in.
+ *
+ * @param id The request id.
+ *
+ * @param protocol_status The protocol status.
+ */
+static void set_end_request(
+    unsigned char *rec,
+    uint16_t id,
+    unsigned char protocol_status)
+{
+    set_header(rec, FCGI_END_REQUEST, id, 8);
+    memset(rec + FCGI_HEADER_LEN, 0, 8);
+    rec[FCGI_HEADER_LEN + 4] = protocol_status;
+}
+
+/**
+ * Queues data that couldn't be written without blocking.
+ *
+ * @param conn The connection the data is written to.
+ *
+ * @param iov The data to queue.
+ *
+ * @param iovcnt The number of elements in iov.
+ *
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+static int queue_output(fcgi_conn *conn, const struct iovec *iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; ++i)
+    {
+        if (buffer_append(
+                conn, &conn->wbuf, &conn->wbuf_len,
+                iov[i].iov_base, iov[i].iov_len))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes every byte described by an iovec array. Whatever can't be written
+ * without blocking is queued and written by fcgi_conn_flush(). Nothing is
+ * written directly while earlier output is still queued or if the connection
+ * defers writes.
+ *
+ * @param conn The connection to write to.
+ *
+ * @param iov The data to write. Modified to track progress.
+ *
+ * @param iovcnt The number of elements in iov.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int conn_write(fcgi_conn *conn, struct iovec *iov, int iovcnt)
+{
+    if (conn->defer_writes || conn->wbuf_pos < conn->wbuf_len)
+    {
+        return queue_output(conn, iov, iovcnt);
+    }
+
+    while (iovcnt > 0)
+    {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+        ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                conn->wbuf_pos = conn->wbuf_len = 0;
+                return queue_output(conn, iov, iovcnt);
+            }
+            return -1;
+        }
+
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes data as records of a stream, followed by a trailer.
+ *
+ * Data is never copied. Record headers are interleaved with the caller's
+ * buffers and written with as few system calls as possible.
+ *
+ * @param conn The connection to write to.
+ *
+ * @param type The stream type.
+ *
+ * @param id The request id.
+ *
+ * @param iov The data to write.
+ *
+ * @param iovcnt The number of elements in iov.
+ *
+ * @param trailer Bytes written after the data. Can be NULL.
+ *
+ * @param trailer_len The length of trailer.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int write_stream(
+    fcgi_conn *conn,
+    enum fcgi_record_type type,
+    uint16_t id,
+    const struct iovec *iov,
+    int iovcnt,
+    const void *trailer,
+    size_t trailer_len)
+{
+    unsigned char hdrs[WRITE_RECORD_MAX][FCGI_HEADER_LEN];
+    struct iovec out[WRITE_IOV_MAX];
+    int outcnt = 0;
+    size_t hdrcnt = 0;
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; ++i)
+    {
+        total += iov[i].iov_len;
+    }
+
+    size_t off = 0;
+    while (total > 0)
+    {
+        /* Each record needs a header and at least one buffer. */
+        if (outcnt + 2 > WRITE_IOV_MAX || hdrcnt == WRITE_RECORD_MAX)
+        {
+            if (conn_write(conn, out, outcnt))
+            {
+                return -1;
+            }
+            outcnt = 0;
+            hdrcnt = 0;
+        }
+
+        size_t rec_len = total < FCGI_MAX_CONTENT_LEN ?
+            total : FCGI_MAX_CONTENT_LEN;
+        set_header(hdrs[hdrcnt], type, id, rec_len);
+        out[outcnt++] = (struct iovec) {
+            .iov_base = hdrs[hdrcnt++],
+            .iov_len = FCGI_HEADER_LEN,
+        };
+        total -= rec_len;
+
+        while (rec_len > 0)
+        {
+            if (outcnt == WRITE_IOV_MAX)
+            {
+                if (conn_write(conn, out, outcnt))
+                {
+                    return -1;
+                }
+                outcnt = 0;
+                hdrcnt = 0;
+            }
+            size_t len = iov->iov_len - off;
+            if (len > rec_len)
+            {
+                len = rec_len;
+            }
+            if (len > 0)
+            {
+                out[outcnt++] = (struct iovec) {
+                    .iov_base = (char *)iov->iov_base + off,
+                    .iov_len = len,
+                };
+            }
+            rec_len -= len;
+            off += len;
+            if (off == iov->iov_len)
+            {
+                ++iov;
+                off = 0;
+            }
+        }
+    }
+
+    if (trailer_len > 0)
+    {
+        if (outcnt == WRITE_IOV_MAX)
+        {
+            if (conn_write(conn, out, outcnt))
+            {
+                return -1;
+            }
+            outcnt = 0;
+        }
+        out[outcnt++] = (struct iovec) {
+            .iov_base = (void *)trailer,
+            .iov_len = trailer_len,
+        };
+    }
+
+    return outcnt > 0 ? conn_write(conn, out, outcnt) : 0;
+}
+
+/**
+ * Writes a single record.
+ *
+ * @param conn The connection to write to.
+ *
+ * @param type The record type.
+ *
+ * @param id The request id.
+ *
+ * @param content The content of the record.
+ *
+ * @param len The length of content. At most FCGI_MAX_CONTENT_LEN.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int write_record(
+    fcgi_conn *conn,
+    enum fcgi_record_type type,
+    uint16_t id,
+    const void *content,
+    size_t len)
+{
+    unsigned char hdr[FCGI_HEADER_LEN];
+    set_header(hdr, type, id, len);
+    struct iovec iov[2] = {
+        {.iov_base = hdr, .iov_len = FCGI_HEADER_LEN},
+        {.iov_base = (void *)content, .iov_len = len},
+    };
+    return conn_write(conn, iov, len ? 2 : 1);
+}
+
+/**
+ * Ends a request that was never handed out.
+ *
+ * @param conn The connection the request was received on.
+ *
+ * @param id The request id.
+ *
+ * @param protocol_status The protocol status of the FCGI_END_REQUEST record.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int reject_request(
+    fcgi_conn *conn,
+    uint16_t id,
+    unsigned char protocol_status)
+{
+    unsigned char rec[FCGI_HEADER_LEN + 8];
+    set_end_request(rec, id, protocol_status);
+    struct iovec iov = {.iov_base = rec, .iov_len = sizeof(rec)};
+    return conn_write(conn, &iov, 1);
+}
+
+/*
+ *==============================================================================
+ * Reading
+ *==============================================================================
+ */
+
+/**
+ * Reads the length of a name or value in a name-value pair.
+ *
+ * @param[in,out] p The position to read from. Moved past the length.
+ *
+ * @param end The end of the buffer.
+ *
+ * @param[out] len The length.
+ *
+ * @return 0 on success, -1 if the length is truncated.
+ */
+static int read_pair_length(
+    const unsigned char **p,
+    const unsigned char *end,
+    size_t *len)
+{
+    if (*p >= end)
+    {
+        return -1;
+    }
+    if (**p & 0x80)
+    {
+        if (end - *p < 4)
+        {
+            return -1;
+        }
+        *len = ((size_t)((*p)[0] & 0x7F) << 24) |
+               ((size_t)(*p)[1] << 16) |
+               ((size_t)(*p)[2] << 8) |
+               (size_t)(*p)[3];
+        *p += 4;
+    }
+    else
+    {
+        *len = **p;
+        *p += 1;
+    }
+    return 0;
+}
+
+/**
+ * Reads the header of a name-value pair and validates it.
+ *
+ * @param[in,out] p The position to read from. Moved to the start of the name.
+ *
+ * @param end The end of the buffer.
+ *
+ * @param[out] name_len The length of the name.
+ *
+ * @param[out] value_len The length of the value.
+ *
+ * @return 0 on success, -1 if the pair is malformed.
+ */
+static int read_pair(
+    const unsigned char **p,
+    const unsigned char *end,
+    size_t *name_len,
+    size_t *value_len)
+{
+    if (read_pair_length(p, end, name_len) ||
+        read_pair_length(p, end, value_len))
+    {
+        return -1;
+    }
+    if (*name_len > (size_t)(end - *p) ||
+        *value_len > (size_t)(end - *p) - *name_len)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Decodes the FCGI_PARAMS stream of a request in place.
+ *
+ * Every pair is rewritten to "NAME=VALUE\0" in the space it already occupies.
+ * The length prefix of a pair is at least two bytes, so only the name has to be
+ * moved back by one byte to make room for the '='. The value stays where it is
+ * and is terminated by overwriting the first byte of the next pair once that
+ * pair's lengths have been read.
+ *
+ * @param req The request to decode the parameters of.
+ *
+ * @return 0 on success, -1 if the stream is malformed or memory could not be
+ *         allocated.
+ */
+static int decode_params(fcgi_request *req)
+{
+    const unsigned char *start = (unsigned char *)req->params;
+    const unsigned char *end = start + req->params_len;
+
+    size_t count = 0;
+    for (const unsigned char *p = start; p < end; ++count)
+    {
+        size_t name_len, value_len;
+        if (read_pair(&p, end, &name_len, &value_len))
+        {
+            return -1;
+        }
+        p += name_len + value_len;
+    }
+
+    req->envp = talloc_array(req, char *, count + 1);
+    if (req->envp == NULL)
+    {
+        return -1;
+    }
+
+    const unsigned char *p = start;
+    size_t name_len = 0, value_len = 0;
+    if (p < end)
+    {
+        read_pair(&p, end, &name_len, &value_len);
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        char *name = (char *)p - 1;
+        memmove(name, p, name_len);
+        name[name_len] = '=';
+        req->envp[i] = name;
+
+        char *value_end = (char *)p + name_len + value_len;
+        p = (unsigned char *)value_end;
+        if (p < end)
+        {
+            read_pair(&p, end, &name_len, &value_len);
+        }
+        *value_end = '\0';
+    }
+    req->envp[count] = NULL;
+
+    return 0;
+}
+
+/**
+ * Handles a FCGI_BEGIN_REQUEST record once its content was received.
+ *
+ * @param conn The connection the record was received on.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int begin_request(fcgi_conn *conn)
+{
+    if (conn->rec_len != 8 || conn->id == 0)
+    {
+        return -1;
+    }
+    if (conn->cur)
+    {
+        /* The id is already in use. */
+        return -1;
+    }
+    unsigned int role = conn->rec[0] << 8 | conn->rec[1];
+    if (role != FCGI_RESPONDER)
+    {
+        return reject_request(conn, conn->id, FCGI_UNKNOWN_ROLE);
+    }
+
+    fcgi_request *req = talloc_zero(conn, fcgi_request);
+    if (req == NULL)
+    {
+        return -1;
+    }
+    req->conn = conn;
+    req->id = conn->id;
+    req->state = REQUEST_RECEIVING;
+    req->keep_conn = conn->rec[2] & FCGI_KEEP_CONN;
+
+    int ret;
+    khiter_t k = kh_put(fcgi_req, conn->reqs, req->id, &ret);
+    if (ret < 0)
+    {
+        talloc_free(req);
+        return -1;
+    }
+    kh_value(conn->reqs, k) = req;
+    conn->cur = req;
+
+    return 0;
+}
+
+/**
+ * Answers a FCGI_GET_VALUES record once its content was received.
+ *
+ * @param conn The connection the record was received on.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int get_values(fcgi_conn *conn)
+{
+    static const char mpxs_conns[] = "FCGI_MPXS_CONNS";
+
+    unsigned char result[sizeof(mpxs_conns) + 2];
+    size_t result_len = 0;
+
+    const unsigned char *p = conn->rec;
+    const unsigned char *end = p + conn->rec_len;
+    while (p < end)
+    {
+        size_t name_len, value_len;
+        if (read_pair(&p, end, &name_len, &value_len))
+        {
+            return -1;
+        }
+        if (name_len == sizeof(mpxs_conns) - 1 &&
+            memcmp(p, mpxs_conns, name_len) == 0 &&
+            result_len == 0)
+        {
+            result[result_len++] = name_len;
+            result[result_len++] = 1;
+            memcpy(result + result_len, mpxs_conns, name_len);
+            result_len += name_len;
+            result[result_len++] = '1';
+        }
+        p += name_len + value_len;
+    }
+
+    return write_record(conn, FCGI_GET_VALUES_RESULT, 0, result, result_len);
+}
+
+/**
+ * Finds a request of a connection by id.
+ *
+ * @param conn The connection to search.
+ *
+ * @param id The request id.
+ *
+ * @return The request, NULL if no request with the id exists.
+ */
+static fcgi_request *find_request(const fcgi_conn *conn, uint16_t id)
+{
+    khiter_t k = kh_get(fcgi_req, conn->reqs, id);
+    return k == kh_end(conn->reqs) ? NULL : kh_value(conn->reqs, k);
+}
+
+/**
+ * Removes a request from its connection and frees it.
+ *
+ * @param req The request to remove.
+ */
+static void remove_request(fcgi_request *req)
+{
+    fcgi_conn *conn = req->conn;
+    khiter_t k = kh_get(fcgi_req, conn->reqs, req->id);
+    if (k != kh_end(conn->reqs))
+    {
+        kh_del(fcgi_req, conn->reqs, k);
+    }
+    if (req->state == REQUEST_READY)
+    {
+        fcgi_request **p = &conn->ready_head;
+        fcgi_request *prev = NULL;
+        while (*p != req)
+        {
+            prev = *p;
+            p = &(*p)->next_ready;
+        }
+        *p = req->next_ready;
+        if (conn->ready_tail == req)
+        {
+            conn->ready_tail = prev;
+        }
+    }
+    if (conn->cur == req)
+    {
+        conn->cur = NULL;
+    }
+    talloc_free(req);
+}
+
+/**
+ * Handles the start of a record after its header was read.
+ *
+ * @param conn The connection the record is being received on.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int start_record(fcgi_conn *conn)
+{
+    conn->rec_len = 0;
+    switch (conn->type)
+    {
+    case FCGI_BEGIN_REQUEST:
+    case FCGI_GET_VALUES:
+        if (talloc_array_length(conn->rec) < conn->content_left)
+        {
+            talloc_free(conn->rec);
+            conn->rec = talloc_array(conn, unsigned char, conn->content_left);
+            if (conn->rec == NULL)
+            {
+                return -1;
+            }
+        }
+        break;
+
+    case FCGI_PARAMS:
+    {
+        /* envp points into params once the stream ended, so more parameters
+         * would move it out from under envp. */
+        fcgi_request *req = conn->cur;
+        if (req && req->envp)
+        {
+            return -1;
+        }
+
+        /* The common case is a single FCGI_PARAMS record, so size the buffer
+         * exactly for it. */
+        if (req && req->params == NULL)
+        {
+            req->params = talloc_array(req, char, conn->content_left + 1);
+            if (req->params == NULL)
+            {
+                return -1;
+            }
+        }
+        break;
+    }
+    }
+    return 0;
+}
+
+/**
+ * Answers a request that's too large with an HTTP error before it was handed
+ * out, and closes the connection so the rest of it isn't received. The request
+ * is freed.
+ *
+ * @param req The request to refuse.
+ *
+ * @param status The CGI response, e.g. "Status: 413 Payload Too Large\r\n\r\n".
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int refuse_request(fcgi_request *req, const char *status)
+{
+    fcgi_conn *conn = req->conn;
+    struct iovec iov = {.iov_base = (void *)status, .iov_len = strlen(status)};
+    int ret = fcgi_request_finish(req, &iov, 1);
+    conn->closing = 1;
+    return ret;
+}
+
+/**
+ * Handles part of the content of a record.
+ *
+ * @param conn The connection the record is being received on.
+ *
+ * @param data The content.
+ *
+ * @param n The length of data.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int record_content(fcgi_conn *conn, const unsigned char *data, size_t n)
+{
+    fcgi_request *req;
+    switch (conn->type)
+    {
+    case FCGI_BEGIN_REQUEST:
+    case FCGI_GET_VALUES:
+        memcpy(conn->rec + conn->rec_len, data, n);
+        conn->rec_len += n;
+        break;
+
+    case FCGI_PARAMS:
+        req = conn->cur;
+        if (req && req->envp == NULL)
+        {
+            if (n > VLA_MAX_PARAMS_SIZE - req->params_len)
+            {
+                return refuse_request(
+                    req, "Status: 431 Request Header Fields Too Large\r\n\r\n"
+                );
+            }
+            return buffer_append(req, &req->params, &req->params_len, data, n);
+        }
+        break;
+
+    case FCGI_STDIN:
+        req = conn->cur;
+        if (req && !req->in_done)
+        {
+            /* Reuse the buffer once everything in it was read. */
+            if (req->in_pos == req->in_len)
+            {
+                req->in_pos = req->in_len = 0;
+            }
+            if (n > VLA_MAX_BODY_SIZE - (req->in_len - req->in_pos))
+            {
+                return refuse_request(
+                    req, "Status: 413 Payload Too Large\r\n\r\n"
+                );
+            }
+            return buffer_append(req, &req->in, &req->in_len, data, n);
+        }
+        break;
+    }
+    return 0;
+}
+
+/**
+ * Marks a request as ready once its parameters and body were received
+ * completely. Handlers never wait on the socket for the body this way.
+ *
+ * @param req The request to update.
+ */
+static void update_state(fcgi_request *req)
+{
+    if (req->state == REQUEST_RECEIVING && req->envp && req->in_done)
+    {
+        fcgi_conn *conn = req->conn;
+        req->state = REQUEST_READY;
+        req->next_ready = NULL;
+        if (conn->ready_tail)
+        {
+            conn->ready_tail->next_ready = req;
+        }
+        else
+        {
+            conn->ready_head = req;
+        }
+        conn->ready_tail = req;
+    }
+}
+
+/**
+ * Handles the end of the content of a record.
+ *
+ * @param conn The connection the record was received on.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int end_record(fcgi_conn *conn)
+{
+    fcgi_request *req;
+    switch (conn->type)
+    {
+    case FCGI_BEGIN_REQUEST:
+        return begin_request(conn);
+
+    case FCGI_GET_VALUES:
+        return get_values(conn);
+
+    case FCGI_PARAMS:
+        req = conn->cur;
+        if (req && req->envp == NULL && conn->hdr[4] == 0 && conn->hdr[5] == 0)
+        {
+            if (decode_params(req))
+            {
+                return -1;
+            }
+            update_state(req);
+        }
+        break;
+
+    case FCGI_STDIN:
+        req = conn->cur;
+        if (req && conn->hdr[4] == 0 && conn->hdr[5] == 0)
+        {
+            req->in_done = 1;
+            update_state(req);
+        }
+        break;
+
+    case FCGI_ABORT_REQUEST:
+        req = conn->cur;
+        if (req && req->state != REQUEST_ACTIVE)
+        {
+            remove_request(req);
+            return reject_request(conn, conn->id, FCGI_REQUEST_COMPLETE);
+        }
+        break;
+
+    default:
+        if (conn->id == 0 && conn->type != FCGI_GET_VALUES_RESULT)
+        {
+            unsigned char body[8] = {conn->type};
+            return write_record(conn, FCGI_UNKNOWN_TYPE, 0, body, sizeof(body));
+        }
+        break;
+    }
+    return 0;
+}
+
+/**
+ * Processes data read from the socket.
+ *
+ * @param conn The connection the data was read from.
+ *
+ * @param data The data.
+ *
+ * @param n The length of data.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int process(fcgi_conn *conn, const unsigned char *data, size_t n)
+{
+    const unsigned char *end = data + n;
+    while (data < end)
+    {
+        if (conn->content_left > 0)
+        {
+            size_t len = (size_t)(end - data) < conn->content_left ?
+                (size_t)(end - data) : conn->content_left;
+            if (record_content(conn, data, len))
+            {
+                return -1;
+            }
+            data += len;
+            conn->content_left -= len;
+            if (conn->content_left == 0 && end_record(conn))
+            {
+                return -1;
+            }
+        }
+        else if (conn->padding_left > 0)
+        {
+            size_t len = (size_t)(end - data) < conn->padding_left ?
+                (size_t)(end - data) : conn->padding_left;
+            data += len;
+            conn->padding_left -= len;
+        }
+        else
+        {
+            size_t len = FCGI_HEADER_LEN - conn->hdr_len;
+            if (len > (size_t)(end - data))
+            {
+                len = end - data;
+            }
+            memcpy(conn->hdr + conn->hdr_len, data, len);
+            conn->hdr_len += len;
+            data += len;
+            if (conn->hdr_len < FCGI_HEADER_LEN)
+            {
+                break;
+            }
+            conn->hdr_len = 0;
+
+            if (conn->hdr[0] != FCGI_VERSION_1)
+            {
+                return -1;
+            }
+            conn->type = conn->hdr[1];
+            conn->id = conn->hdr[2] << 8 | conn->hdr[3];
+            conn->cur = conn->id ? find_request(conn, conn->id) : NULL;
+            conn->content_left = conn->hdr[4] << 8 | conn->hdr[5];
+            conn->padding_left = conn->hdr[6];
+            if (start_record(conn))
+            {
+                return -1;
+            }
+            if (conn->content_left == 0 && end_record(conn))
+            {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ *==============================================================================
+ * Public
+ *==============================================================================
+ */
+
+int fcgi_listen(const char *path, int backlog)
+{
+    int fd = -1;
+    const char *port = strrchr(path, ':');
+    if (port)
+    {
+        char host[port - path + 1];
+        memcpy(host, path, port - path);
+        host[port - path] = '\0';
+
+        struct addrinfo hints = {
+            .ai_family = AF_UNSPEC,
+            .ai_socktype = SOCK_STREAM,
+            .ai_flags = AI_PASSIVE,
+        };
+        struct addrinfo *res;
+        if (getaddrinfo(*host ? host : NULL, port + 1, &hints, &res))
+        {
+            return -1;
+        }
+        for (struct addrinfo *ai = res; ai; ai = ai->ai_next)
+        {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+            {
+                continue;
+            }
+            int on = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            {
+                break;
+            }
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+    }
+    else
+    {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        if (strlen(path) >= sizeof(addr.sun_path))
+        {
+            return -1;
+        }
+        strcpy(addr.sun_path, path);
+        unlink(path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)))
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd >= 0 && listen(fd, backlog))
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/**
+ * Destructor for fcgi_conn.
+ *
+ * @param conn The connection to destruct.
+ *
+ * @return Always 0.
+ */
+static int conn_destructor(fcgi_conn *conn)
+{
+    kh_destroy(fcgi_req, conn->reqs);
+    close(conn->fd);
+    return 0;
+}
+
+fcgi_conn *fcgi_conn_new(void *ctx, int fd)
+{
+    fcgi_conn *conn = talloc(ctx, fcgi_conn);
+    if (conn == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    conn->reqs = kh_init(fcgi_req);
+    if (conn->reqs == NULL)
+    {
+        talloc_free(conn);
+        close(fd);
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->hdr_len = 0;
+    conn->type = 0;
+    conn->id = 0;
+    conn->content_left = 0;
+    conn->padding_left = 0;
+    conn->rec = NULL;
+    conn->rec_len = 0;
+    conn->cur = NULL;
+    conn->ready_head = NULL;
+    conn->ready_tail = NULL;
+    conn->closing = 0;
+    conn->wbuf = NULL;
+    conn->wbuf_len = 0;
+    conn->wbuf_pos = 0;
+    conn->defer_writes = 0;
+    conn->rbuf = NULL;
+    talloc_set_destructor(conn, conn_destructor);
+    return conn;
+}
+
+int fcgi_conn_process(fcgi_conn *conn, const void *data, size_t n)
+{
+    if (process(conn, data, n))
+    {
+        conn->closing = 1;
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+int fcgi_conn_read(fcgi_conn *conn)
+{
+    if (conn->rbuf == NULL)
+    {
+        conn->rbuf = talloc_array(conn, unsigned char, READ_BUFFER_SIZE);
+        if (conn->rbuf == NULL)
+        {
+            conn->closing = 1;
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    ssize_t n;
+    do
+    {
+        n = read(conn->fd, conn->rbuf, READ_BUFFER_SIZE);
+    } while (n < 0 && errno == EINTR);
+
+    if (n == 0)
+    {
+        conn->closing = 1;
+        return 0;
+    }
+    if (n < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            conn->closing = 1;
+        }
+        return -1;
+    }
+    return fcgi_conn_process(conn, conn->rbuf, n) ? -1 : 1;
+}
+
+fcgi_request *fcgi_conn_next_request(fcgi_conn *conn)
+{
+    fcgi_request *req = conn->ready_head;
+    if (req == NULL)
+    {
+        return NULL;
+    }
+    conn->ready_head = req->next_ready;
+    if (conn->ready_head == NULL)
+    {
+        conn->ready_tail = NULL;
+    }
+    req->state = REQUEST_ACTIVE;
+    return req;
+}
+
+int fcgi_conn_closing(const fcgi_conn *conn)
+{
+    return conn->closing;
+}
+
+int fcgi_conn_flush(fcgi_conn *conn)
+{
+    while (conn->wbuf_pos < conn->wbuf_len)
+    {
+        ssize_t n = send(
+            conn->fd,
+            conn->wbuf + conn->wbuf_pos,
+            conn->wbuf_len - conn->wbuf_pos,
+            MSG_NOSIGNAL
+        );
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 1;
+            }
+            conn->closing = 1;
+            return -1;
+        }
+        conn->wbuf_pos += n;
+    }
+
+    /* Release large buffers once a burst of output was written. */
+    if (talloc_array_length(conn->wbuf) > READ_BUFFER_SIZE)
+    {
+        TALLOC_FREE(conn->wbuf);
+    }
+    conn->wbuf_pos = conn->wbuf_len = 0;
+    return 0;
+}
+
+void fcgi_conn_defer_writes(fcgi_conn *conn)
+{
+    conn->defer_writes = 1;
+}
+
+void *fcgi_conn_take_output(fcgi_conn *conn, void *ctx, size_t *len)
+{
+    if (conn->wbuf_pos == conn->wbuf_len)
+    {
+        return NULL;
+    }
+    if (conn->wbuf_pos > 0)
+    {
+        memmove(
+            conn->wbuf,
+            conn->wbuf + conn->wbuf_pos,
+            conn->wbuf_len - conn->wbuf_pos
+        );
+    }
+
+    void *buf = talloc_steal(ctx, conn->wbuf);
+    *len = conn->wbuf_len - conn->wbuf_pos;
+    conn->wbuf = NULL;
+    conn->wbuf_len = 0;
+    conn->wbuf_pos = 0;
+    return buf;
+}
+
+const char *const *fcgi_request_envp(const fcgi_request *req)
+{
+    return (const char *const *)req->envp;
+}
+
+size_t fcgi_request_read(fcgi_request *req, void *buf, size_t cap)
+{
+    size_t len = req->in_len - req->in_pos;
+    if (len > cap)
+    {
+        len = cap;
+    }
+    if (len > 0)
+    {
+        memcpy(buf, req->in + req->in_pos, len);
+        req->in_pos += len;
+    }
+    return len;
+}
+
+int fcgi_request_write(
+    fcgi_request *req,
+    enum fcgi_record_type type,
+    const struct iovec *iov,
+    int iovcnt)
+{
+    if (type == FCGI_STDERR)
+    {
+        req->err_written = 1;
+    }
+    if (write_stream(req->conn, type, req->id, iov, iovcnt, NULL, 0))
+    {
+        req->conn->closing = 1;
+        return -1;
+    }
+    return 0;
+}
+
+int fcgi_request_finish(
+    fcgi_request *req,
+    const struct iovec *iov,
+    int iovcnt)
+{
+    fcgi_conn *conn = req->conn;
+
+    /* Empty FCGI_STDERR and FCGI_STDOUT records and a FCGI_END_REQUEST. */
+    unsigned char trailer[FCGI_HEADER_LEN * 2 + FCGI_HEADER_LEN + 8];
+    unsigned char *p = trailer;
+    if (req->err_written)
+    {
+        set_header(p, FCGI_STDERR, req->id, 0);
+        p += FCGI_HEADER_LEN;
+    }
+    set_header(p, FCGI_STDOUT, req->id, 0);
+    p += FCGI_HEADER_LEN;
+    set_end_request(p, req->id, FCGI_REQUEST_COMPLETE);
+    p += FCGI_HEADER_LEN + 8;
+
+    int ret = write_stream(
+        conn, FCGI_STDOUT, req->id, iov, iovcnt, trailer, p - trailer
+    );
+    if (ret || !req->keep_conn)
+    {
+        conn->closing = 1;
+    }
+    remove_request(req);
+
+    return ret;
+}
@@ -0,0 +1,225 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021 Ripose
+//
+// This file is part of Valhalla.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License version 3 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Additional permission under GNU AGPL version 3 section 7
+//
+// If you modify this Program, or any covered work, by linking or combining it
+// with FastCGI (or a modified version of that library), containing parts
+// covered by the terms of the FastCGI Open Market Licence, the licensors of
+// this Program grant you additional permission to convey the resulting work.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __FCGI_H__
+#define __FCGI_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* File descriptor of the listening socket handed over by the web server. */
+#define FCGI_LISTENSOCK_FILENO 0
+
+/* FastCGI record types. */
+enum fcgi_record_type
+{
+    FCGI_BEGIN_REQUEST     = 1,
+    FCGI_ABORT_REQUEST     = 2,
+    FCGI_END_REQUEST       = 3,
+    FCGI_PARAMS            = 4,
+    FCGI_STDIN             = 5,
+    FCGI_STDOUT            = 6,
+    FCGI_STDERR            = 7,
+    FCGI_DATA              = 8,
+    FCGI_GET_VALUES        = 9,
+    FCGI_GET_VALUES_RESULT = 10,
+    FCGI_UNKNOWN_TYPE      = 11,
+};
+
+/* A connection to the web server. Freeing it closes the socket. */
+typedef struct fcgi_conn fcgi_conn;
+
+/* A request received over a connection. */
+typedef struct fcgi_request fcgi_request;
+
+/**
+ * Opens a listening socket.
+ *
+ * @param path ":port" or "host:port" for a TCP socket, otherwise the path of a
+ *             Unix domain socket. An existing file at path is removed.
+ *
+ * @param backlog The maximum length of the queue of pending connections.
+ *
+ * @return The file descriptor of the socket, -1 on error.
+ */
+int fcgi_listen(const char *path, int backlog);
+
+/**
+ * Initializes a connection.
+ *
+ * @param ctx The talloc context the connection should be a child of.
+ *
+ * @param fd The connected socket. The connection takes ownership of it.
+ *
+ * @return A new connection. NULL on error, in which case fd is closed.
+ */
+fcgi_conn *fcgi_conn_new(void *ctx, int fd);
+
+/**
+ * Reads from the socket once and processes every complete record. The socket
+ * is expected to be non-blocking.
+ *
+ * @param conn The connection to read from.
+ *
+ * @return 1 if data was read, 0 if the web server closed the connection, -1 on
+ *         error. errno is set on error and is EAGAIN if there was nothing to
+ *         read.
+ */
+int fcgi_conn_read(fcgi_conn *conn);
+
+/**
+ * Processes data that was read from the socket by the caller.
+ *
+ * @param conn The connection the data was read from.
+ *
+ * @param data The data.
+ *
+ * @param n The length of data.
+ *
+ * @return 0 on success, -1 on a protocol error. errno is set on error.
+ */
+int fcgi_conn_process(fcgi_conn *conn, const void *data, size_t n);
+
+/**
+ * Takes the next request whose parameters and body have been received
+ * completely.
+ *
+ * @param conn The connection to get the request from.
+ *
+ * @return A request that belongs to the connection. NULL if no request is
+ *         ready yet.
+ */
+fcgi_request *fcgi_conn_next_request(fcgi_conn *conn);
+
+/**
+ * Checks if a connection should be closed. This is the case after a protocol
+ * error, once the web server closed its end, or once a request finished that
+ * didn't ask to keep the connection open.
+ *
+ * @param conn The connection to check.
+ *
+ * @return Nonzero if the connection should be closed, 0 otherwise.
+ */
+int fcgi_conn_closing(const fcgi_conn *conn);
+
+/**
+ * Writes output that was queued because the socket wasn't writable.
+ *
+ * @param conn The connection to flush.
+ *
+ * @return 0 if all output was written, 1 if output is still queued, -1 on
+ *         error.
+ */
+int fcgi_conn_flush(fcgi_conn *conn);
+
+/**
+ * Makes a connection queue all of its output instead of writing it. The caller
+ * takes the output with fcgi_conn_take_output() and writes it itself.
+ *
+ * @param conn The connection to defer writes of.
+ */
+void fcgi_conn_defer_writes(fcgi_conn *conn);
+
+/**
+ * Takes the queued output of a connection.
+ *
+ * @param conn The connection to take the output of.
+ *
+ * @param ctx The talloc context the output should become a child of.
+ *
+ * @param[out] len The length of the output.
+ *
+ * @return The output. Should be freed with talloc_free(). NULL if no output is
+ *         queued.
+ */
+void *fcgi_conn_take_output(fcgi_conn *conn, void *ctx, size_t *len);
+
+/**
+ * Gets the parameters of a request.
+ *
+ * @param req The request to get the parameters of.
+ *
+ * @return A NULL terminated array of "NAME=VALUE" strings. Belongs to req.
+ */
+const char *const *fcgi_request_envp(const fcgi_request *req);
+
+/**
+ * Reads the request body. The body is buffered before the request is handed
+ * out, so this never blocks.
+ *
+ * @param req The request to read the body of.
+ *
+ * @param[out] buf The buffer to read into.
+ *
+ * @param cap The size of buf in bytes.
+ *
+ * @return The number of bytes read.
+ */
+size_t fcgi_request_read(fcgi_request *req, void *buf, size_t cap);
+
+/**
+ * Writes data to an output stream of a request. Data is only copied if the
+ * socket isn't writable, in which case it's queued for fcgi_conn_flush().
+ *
+ * @param req The request to write to.
+ *
+ * @param type FCGI_STDOUT or FCGI_STDERR.
+ *
+ * @param iov The data to write.
+ *
+ * @param iovcnt The number of elements in iov.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int fcgi_request_write(
+    fcgi_request *req,
+    enum fcgi_record_type type,
+    const struct iovec *iov,
+    int iovcnt);
+
+/**
+ * Writes the last of a request's output and ends it. The output, the end of
+ * the output streams, and the end of the request are written with a single
+ * system call when possible. Whatever can't be written without blocking is
+ * queued for fcgi_conn_flush(). The request is freed.
+ *
+ * @param req The request to end.
+ *
+ * @param iov Data to write to FCGI_STDOUT before ending the request. Can be
+ *            NULL if iovcnt is 0.
+ *
+ * @param iovcnt The number of elements in iov.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int fcgi_request_finish(
+    fcgi_request *req,
+    const struct iovec *iov,
+    int iovcnt);
+
+#endif // __FCGI_H__
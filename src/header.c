@@ -0,0 +1,220 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021 Ripose
+//
+// This file is part of Valhalla.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License version 3 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Additional permission under GNU AGPL version 3 section 7
+//
+// If you modify this Program, or any covered work, by linking or combining it
+// with FastCGI (or a modified version of that library), containing parts
+// covered by the terms of the FastCGI Open Market Licence, the licensors of
+// this Program grant you additional permission to convey the resulting work.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "header.h"
+
+#include <pthread.h>
+#include <string.h>
+
+/* The number of slots in the name index. A power of 2 well over
+ * VLA_HDR_SIZE. */
+#define INDEX_SIZE 256
+
+/* The names of the headers, indexed by ID. */
+static const char *const header_names[VLA_HDR_SIZE] = {
+    [VLA_HDR_ACCEPT] = "Accept",
+    [VLA_HDR_ACCEPT_CHARSET] = "Accept-Charset",
+    [VLA_HDR_ACCEPT_ENCODING] = "Accept-Encoding",
+    [VLA_HDR_ACCEPT_LANGUAGE] = "Accept-Language",
+    [VLA_HDR_ACCEPT_RANGES] = "Accept-Ranges",
+    [VLA_HDR_ACCESS_CONTROL_ALLOW_CREDENTIALS] = "Access-Control-Allow-Credentials",
+    [VLA_HDR_ACCESS_CONTROL_ALLOW_HEADERS] = "Access-Control-Allow-Headers",
+    [VLA_HDR_ACCESS_CONTROL_ALLOW_METHODS] = "Access-Control-Allow-Methods",
+    [VLA_HDR_ACCESS_CONTROL_ALLOW_ORIGIN] = "Access-Control-Allow-Origin",
+    [VLA_HDR_ACCESS_CONTROL_EXPOSE_HEADERS] = "Access-Control-Expose-Headers",
+    [VLA_HDR_ACCESS_CONTROL_MAX_AGE] = "Access-Control-Max-Age",
+    [VLA_HDR_ACCESS_CONTROL_REQUEST_HEADERS] = "Access-Control-Request-Headers",
+    [VLA_HDR_ACCESS_CONTROL_REQUEST_METHOD] = "Access-Control-Request-Method",
+    [VLA_HDR_AGE] = "Age",
+    [VLA_HDR_ALLOW] = "Allow",
+    [VLA_HDR_AUTHORIZATION] = "Authorization",
+    [VLA_HDR_CACHE_CONTROL] = "Cache-Control",
+    [VLA_HDR_CONNECTION] = "Connection",
+    [VLA_HDR_CONTENT_DISPOSITION] = "Content-Disposition",
+    [VLA_HDR_CONTENT_ENCODING] = "Content-Encoding",
+    [VLA_HDR_CONTENT_LANGUAGE] = "Content-Language",
+    [VLA_HDR_CONTENT_LENGTH] = "Content-Length",
+    [VLA_HDR_CONTENT_LOCATION] = "Content-Location",
+    [VLA_HDR_CONTENT_RANGE] = "Content-Range",
+    [VLA_HDR_CONTENT_SECURITY_POLICY] = "Content-Security-Policy",
+    [VLA_HDR_CONTENT_TYPE] = "Content-Type",
+    [VLA_HDR_COOKIE] = "Cookie",
+    [VLA_HDR_DATE] = "Date",
+    [VLA_HDR_DNT] = "DNT",
+    [VLA_HDR_ETAG] = "ETag",
+    [VLA_HDR_EXPECT] = "Expect",
+    [VLA_HDR_EXPIRES] = "Expires",
+    [VLA_HDR_FORWARDED] = "Forwarded",
+    [VLA_HDR_FROM] = "From",
+    [VLA_HDR_HOST] = "Host",
+    [VLA_HDR_IF_MATCH] = "If-Match",
+    [VLA_HDR_IF_MODIFIED_SINCE] = "If-Modified-Since",
+    [VLA_HDR_IF_NONE_MATCH] = "If-None-Match",
+    [VLA_HDR_IF_RANGE] = "If-Range",
+    [VLA_HDR_IF_UNMODIFIED_SINCE] = "If-Unmodified-Since",
+    [VLA_HDR_KEEP_ALIVE] = "Keep-Alive",
+    [VLA_HDR_LAST_MODIFIED] = "Last-Modified",
+    [VLA_HDR_LINK] = "Link",
+    [VLA_HDR_LOCATION] = "Location",
+    [VLA_HDR_MAX_FORWARDS] = "Max-Forwards",
+    [VLA_HDR_ORIGIN] = "Origin",
+    [VLA_HDR_PRAGMA] = "Pragma",
+    [VLA_HDR_PROXY_AUTHENTICATE] = "Proxy-Authenticate",
+    [VLA_HDR_PROXY_AUTHORIZATION] = "Proxy-Authorization",
+    [VLA_HDR_RANGE] = "Range",
+    [VLA_HDR_REFERER] = "Referer",
+    [VLA_HDR_REFERRER_POLICY] = "Referrer-Policy",
+    [VLA_HDR_RETRY_AFTER] = "Retry-After",
+    [VLA_HDR_SEC_CH_UA] = "Sec-Ch-Ua",
+    [VLA_HDR_SEC_CH_UA_MOBILE] = "Sec-Ch-Ua-Mobile",
+    [VLA_HDR_SEC_CH_UA_PLATFORM] = "Sec-Ch-Ua-Platform",
+    [VLA_HDR_SEC_FETCH_DEST] = "Sec-Fetch-Dest",
+    [VLA_HDR_SEC_FETCH_MODE] = "Sec-Fetch-Mode",
+    [VLA_HDR_SEC_FETCH_SITE] = "Sec-Fetch-Site",
+    [VLA_HDR_SEC_FETCH_USER] = "Sec-Fetch-User",
+    [VLA_HDR_SEC_WEBSOCKET_KEY] = "Sec-WebSocket-Key",
+    [VLA_HDR_SEC_WEBSOCKET_VERSION] = "Sec-WebSocket-Version",
+    [VLA_HDR_SERVER] = "Server",
+    [VLA_HDR_SET_COOKIE] = "Set-Cookie",
+    [VLA_HDR_STATUS] = "Status",
+    [VLA_HDR_STRICT_TRANSPORT_SECURITY] = "Strict-Transport-Security",
+    [VLA_HDR_TE] = "TE",
+    [VLA_HDR_TRAILER] = "Trailer",
+    [VLA_HDR_TRANSFER_ENCODING] = "Transfer-Encoding",
+    [VLA_HDR_UPGRADE] = "Upgrade",
+    [VLA_HDR_UPGRADE_INSECURE_REQUESTS] = "Upgrade-Insecure-Requests",
+    [VLA_HDR_USER_AGENT] = "User-Agent",
+    [VLA_HDR_VARY] = "Vary",
+    [VLA_HDR_VIA] = "Via",
+    [VLA_HDR_WWW_AUTHENTICATE] = "WWW-Authenticate",
+    [VLA_HDR_WARNING] = "Warning",
+    [VLA_HDR_X_CONTENT_TYPE_OPTIONS] = "X-Content-Type-Options",
+    [VLA_HDR_X_FORWARDED_FOR] = "X-Forwarded-For",
+    [VLA_HDR_X_FORWARDED_HOST] = "X-Forwarded-Host",
+    [VLA_HDR_X_FORWARDED_PROTO] = "X-Forwarded-Proto",
+    [VLA_HDR_X_FRAME_OPTIONS] = "X-Frame-Options",
+    [VLA_HDR_X_REAL_IP] = "X-Real-IP",
+    [VLA_HDR_X_REQUESTED_WITH] = "X-Requested-With",
+    [VLA_HDR_X_XSS_PROTECTION] = "X-XSS-Protection",
+};
+
+/* The lengths of header_names. */
+static size_t header_lens[VLA_HDR_SIZE];
+
+/* An open addressing hash of header names to IDs. 0 marks an empty slot. */
+static unsigned char header_index[INDEX_SIZE];
+
+/* Makes sure the index is only built once, however many contexts are
+ * created. */
+static pthread_once_t index_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Lowercases a header name character, so that names compare equal regardless
+ * of case.
+ *
+ * @param c The character to lowercase.
+ *
+ * @return c lowercased.
+ */
+static inline unsigned char fold(unsigned char c)
+{
+    return c | ((unsigned char)(c - 'A') < 26) << 5;
+}
+
+/**
+ * Hashes a header name, ignoring case.
+ *
+ * @param name The header name.
+ *
+ * @param len The length of the name.
+ *
+ * @return The hash of the name.
+ */
+static inline unsigned name_hash(const char *name, size_t len)
+{
+    unsigned h = len;
+    for (size_t i = 0; i < len; ++i)
+    {
+        h = h * 31 + fold(name[i]);
+    }
+    return h ^ h >> 8;
+}
+
+/**
+ * Fills header_index and header_lens.
+ */
+static void build_index(void)
+{
+    for (unsigned id = VLA_HDR_UNKNOWN + 1; id < VLA_HDR_SIZE; ++id)
+    {
+        header_lens[id] = strlen(header_names[id]);
+        unsigned slot = name_hash(header_names[id], header_lens[id]);
+        while (header_index[slot % INDEX_SIZE])
+        {
+            ++slot;
+        }
+        header_index[slot % INDEX_SIZE] = id;
+    }
+}
+
+void header_init(void)
+{
+    pthread_once(&index_once, build_index);
+}
+
+enum vla_header header_id(const char *name, size_t len)
+{
+    for (unsigned slot = name_hash(name, len);
+         header_index[slot % INDEX_SIZE];
+         ++slot)
+    {
+        unsigned id = header_index[slot % INDEX_SIZE];
+        if (header_lens[id] != len)
+        {
+            continue;
+        }
+        size_t i = 0;
+        while (i < len && fold(name[i]) == fold(header_names[id][i]))
+        {
+            ++i;
+        }
+        if (i == len)
+        {
+            return id;
+        }
+    }
+    return VLA_HDR_UNKNOWN;
+}
+
+const char *header_name(enum vla_header id)
+{
+    if (id == VLA_HDR_UNKNOWN || (unsigned)id >= VLA_HDR_SIZE)
+    {
+        return NULL;
+    }
+    return header_names[id];
+}
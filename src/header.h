@@ -0,0 +1,66 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021 Ripose
+//
+// This file is part of Valhalla.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License version 3 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Additional permission under GNU AGPL version 3 section 7
+//
+// If you modify this Program, or any covered work, by linking or combining it
+// with FastCGI (or a modified version of that library), containing parts
+// covered by the terms of the FastCGI Open Market Licence, the licensors of
+// this Program grant you additional permission to convey the resulting work.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __HEADER_H__
+#define __HEADER_H__
+
+#include "include/valhalla.h"
+
+#include <stddef.h>
+
+/* The length of the longest header name with an ID. */
+#define HEADER_NAME_MAX 32
+
+/**
+ * Builds the index of header names. Called by vla_init_io(), so it runs before
+ * any request is handled. Must be called before header_id().
+ */
+void header_init(void);
+
+/**
+ * Gets the ID of a header name. Case is ignored. CGI parameter names (e.g.
+ * 'USER_AGENT') have to be converted to header names first.
+ *
+ * @param name The header name. Doesn't need to be nul terminated.
+ *
+ * @param len The length of the name.
+ *
+ * @return The ID of the header. VLA_HDR_UNKNOWN if it doesn't have one.
+ */
+enum vla_header header_id(const char *name, size_t len);
+
+/**
+ * Gets the name of a header ID.
+ *
+ * @param id The ID of the header.
+ *
+ * @return The name of the header with conventional capitalization. NULL if id
+ *         isn't the ID of a header.
+ */
+const char *header_name(enum vla_header id);
+
+#endif // __HEADER_H__
@@ -33,6 +33,24 @@
 #include <stdint.h>
 #include <time.h>
 
+/* The largest request body accepted, in bytes. Bodies are received completely
+ * before a handler runs, so this bounds the memory a request can use. Requests
+ * with larger bodies are answered with 413 Payload Too Large and their
+ * connection is closed. Can be changed by defining it when building Valhalla.
+ */
+#ifndef VLA_MAX_BODY_SIZE
+#define VLA_MAX_BODY_SIZE (8 * 1024 * 1024)
+#endif
+
+/* The largest total size of a request's CGI parameters, including its headers,
+ * in bytes. Requests with more are answered with 431 Request Header Fields Too
+ * Large and their connection is closed. Can be changed by defining it when
+ * building Valhalla.
+ */
+#ifndef VLA_MAX_PARAMS_SIZE
+#define VLA_MAX_PARAMS_SIZE (256 * 1024)
+#endif
+
 /*
  * Top-level context for Valhalla.
  */
@@ -46,6 +64,12 @@ typedef struct vla_request_private vla_request_private;
 /* Forward declaration. */
 typedef struct vla_request vla_request;
 
+/*
+ * A set of routes built while requests are being accepted, to replace the
+ * routes of a context.
+ */
+typedef struct vla_routes vla_routes;
+
 /*
  * Function pointer type for handler functions.
  */
@@ -78,6 +102,104 @@ enum vla_http_method
     VLA_HTTP_ALL = 0xFFFFFFFF,
 };
 
+/*
+ * IDs of well-known HTTP headers. Headers with these names can be looked up
+ * without hashing their name.
+ */
+enum vla_header
+{
+    /* A header without an ID. */
+    VLA_HDR_UNKNOWN = 0,
+
+    VLA_HDR_ACCEPT,
+    VLA_HDR_ACCEPT_CHARSET,
+    VLA_HDR_ACCEPT_ENCODING,
+    VLA_HDR_ACCEPT_LANGUAGE,
+    VLA_HDR_ACCEPT_RANGES,
+    VLA_HDR_ACCESS_CONTROL_ALLOW_CREDENTIALS,
+    VLA_HDR_ACCESS_CONTROL_ALLOW_HEADERS,
+    VLA_HDR_ACCESS_CONTROL_ALLOW_METHODS,
+    VLA_HDR_ACCESS_CONTROL_ALLOW_ORIGIN,
+    VLA_HDR_ACCESS_CONTROL_EXPOSE_HEADERS,
+    VLA_HDR_ACCESS_CONTROL_MAX_AGE,
+    VLA_HDR_ACCESS_CONTROL_REQUEST_HEADERS,
+    VLA_HDR_ACCESS_CONTROL_REQUEST_METHOD,
+    VLA_HDR_AGE,
+    VLA_HDR_ALLOW,
+    VLA_HDR_AUTHORIZATION,
+    VLA_HDR_CACHE_CONTROL,
+    VLA_HDR_CONNECTION,
+    VLA_HDR_CONTENT_DISPOSITION,
+    VLA_HDR_CONTENT_ENCODING,
+    VLA_HDR_CONTENT_LANGUAGE,
+    VLA_HDR_CONTENT_LENGTH,
+    VLA_HDR_CONTENT_LOCATION,
+    VLA_HDR_CONTENT_RANGE,
+    VLA_HDR_CONTENT_SECURITY_POLICY,
+    VLA_HDR_CONTENT_TYPE,
+    VLA_HDR_COOKIE,
+    VLA_HDR_DATE,
+    VLA_HDR_DNT,
+    VLA_HDR_ETAG,
+    VLA_HDR_EXPECT,
+    VLA_HDR_EXPIRES,
+    VLA_HDR_FORWARDED,
+    VLA_HDR_FROM,
+    VLA_HDR_HOST,
+    VLA_HDR_IF_MATCH,
+    VLA_HDR_IF_MODIFIED_SINCE,
+    VLA_HDR_IF_NONE_MATCH,
+    VLA_HDR_IF_RANGE,
+    VLA_HDR_IF_UNMODIFIED_SINCE,
+    VLA_HDR_KEEP_ALIVE,
+    VLA_HDR_LAST_MODIFIED,
+    VLA_HDR_LINK,
+    VLA_HDR_LOCATION,
+    VLA_HDR_MAX_FORWARDS,
+    VLA_HDR_ORIGIN,
+    VLA_HDR_PRAGMA,
+    VLA_HDR_PROXY_AUTHENTICATE,
+    VLA_HDR_PROXY_AUTHORIZATION,
+    VLA_HDR_RANGE,
+    VLA_HDR_REFERER,
+    VLA_HDR_REFERRER_POLICY,
+    VLA_HDR_RETRY_AFTER,
+    VLA_HDR_SEC_CH_UA,
+    VLA_HDR_SEC_CH_UA_MOBILE,
+    VLA_HDR_SEC_CH_UA_PLATFORM,
+    VLA_HDR_SEC_FETCH_DEST,
+    VLA_HDR_SEC_FETCH_MODE,
+    VLA_HDR_SEC_FETCH_SITE,
+    VLA_HDR_SEC_FETCH_USER,
+    VLA_HDR_SEC_WEBSOCKET_KEY,
+    VLA_HDR_SEC_WEBSOCKET_VERSION,
+    VLA_HDR_SERVER,
+    VLA_HDR_SET_COOKIE,
+    VLA_HDR_STATUS,
+    VLA_HDR_STRICT_TRANSPORT_SECURITY,
+    VLA_HDR_TE,
+    VLA_HDR_TRAILER,
+    VLA_HDR_TRANSFER_ENCODING,
+    VLA_HDR_UPGRADE,
+    VLA_HDR_UPGRADE_INSECURE_REQUESTS,
+    VLA_HDR_USER_AGENT,
+    VLA_HDR_VARY,
+    VLA_HDR_VIA,
+    VLA_HDR_WWW_AUTHENTICATE,
+    VLA_HDR_WARNING,
+    VLA_HDR_X_CONTENT_TYPE_OPTIONS,
+    VLA_HDR_X_FORWARDED_FOR,
+    VLA_HDR_X_FORWARDED_HOST,
+    VLA_HDR_X_FORWARDED_PROTO,
+    VLA_HDR_X_FRAME_OPTIONS,
+    VLA_HDR_X_REAL_IP,
+    VLA_HDR_X_REQUESTED_WITH,
+    VLA_HDR_X_XSS_PROTECTION,
+
+    /* The number of IDs. Not a header. */
+    VLA_HDR_SIZE,
+};
+
 /*
  * Struct tied to the current web request.
  * Used for getting information about the request and sending a response.
@@ -188,6 +310,50 @@ enum vla_handle_code
     VLA_HANDLE_IGNORE_TERM = 0,
 };
 
+/*
+ * I/O backends requests can be accepted with.
+ */
+enum vla_io_backend
+{
+    /* An epoll event loop. Available on every Linux kernel. */
+    VLA_IO_EPOLL,
+
+    /*
+     * An io_uring event loop with multishot accepts, multishot receives into
+     * registered buffers, and batched submissions.
+     */
+    VLA_IO_URING,
+};
+
+/* Counters of the requests and workers of a context. */
+typedef struct vla_stats
+{
+    /* Requests whose route was found in the hash of static routes. */
+    uint64_t route_static_hits;
+
+    /* Requests whose route was found by walking the route tree. */
+    uint64_t route_dynamic_hits;
+
+    /* Requests that no route matched. */
+    uint64_t route_misses;
+
+    /* Requests whose route lookup was answered by the worker's route cache.
+     * These are also counted by the three counters above.
+     */
+    uint64_t route_cache_hits;
+
+    /* Requests whose route had to be looked up. */
+    uint64_t route_cache_misses;
+
+    /* Workers that accepted requests with the io_uring backend. */
+    uint64_t uring_workers;
+
+    /* Workers that accepted requests with the epoll backend, including those
+     * that fell back to it because io_uring isn't supported.
+     */
+    uint64_t epoll_workers;
+} vla_stats;
+
 /* Struct defining an HTTP cookie. */
 typedef struct vla_cookie_t
 {
@@ -236,12 +402,41 @@ typedef struct vla_cookie_t
  */
 
 /**
- * Creates a new Valhalla context.
+ * Creates a new Valhalla context that accepts requests with epoll.
  *
  * @return A vla_context. Should be freed by vla_free(). NULL on error.
  */
 vla_context *vla_init();
 
+/**
+ * Creates a new Valhalla context that accepts requests with the given I/O
+ * backend.
+ *
+ * @param backend The I/O backend. VLA_IO_URING falls back to VLA_IO_EPOLL if
+ *                the kernel doesn't support the io_uring features it needs
+ *                (Linux 5.19 or newer).
+ *
+ * @return A vla_context. Should be freed by vla_free(). NULL on error.
+ */
+vla_context *vla_init_io(enum vla_io_backend backend);
+
+/**
+ * Opens a socket to accept requests on. By default, requests are accepted on
+ * the socket inherited from the process that started this one (e.g.
+ * spawn-fcgi).
+ *
+ * @param ctx The context to accept requests for.
+ *
+ * @param path The address to listen on. ":port" and "host:port" listen on a TCP
+ *             port, anything else is treated as the path of a Unix domain
+ *             socket.
+ *
+ * @param backlog The maximum length of the queue of pending connections.
+ *
+ * @return 0 on success, -1 if the socket could not be opened.
+ */
+int vla_listen(vla_context *ctx, const char *path, int backlog);
+
 /**
  * Frees dynamically allocated memory.
  *
@@ -262,7 +457,9 @@ int vla_free(void *ptr);
 void vla_init_cookie(vla_cookie_t *cookie);
 
 /**
- * Adds a new route. Routes cannot be deleted.
+ * Adds a new route. Routes cannot be deleted, but every route can be replaced at
+ * once with vla_routes_publish(). Must not be called while requests are being
+ * accepted.
  *
  * An example call to this function looks like:
  *
@@ -287,12 +484,16 @@ void vla_init_cookie(vla_cookie_t *cookie);
  * @param ctx The context of this Valhalla instance.
  *
  * @param methods The methods this route should respond to.
- *                HTTP verb flags defined in the vla_http_method enum.
+ *                HTTP verb flags defined in the vla_http_method enum. A route
+ *                with a GET handler also handles HEAD requests unless it has a
+ *                HEAD handler. The response body is never sent for HEAD
+ *                requests.
  *
  * @param route The location of the route. If a route contains a ':', everything
  *              after the colon up to the next '/' (or end of the string if that
- *              comes first) is matched. If a route contains a '*', everything
- *              after that '*' is matched.
+ *              comes first) is matched. The matched text can be read with
+ *              vla_request_param_get() using the name following the colon. If
+ *              a route contains a '*', everything after that '*' is matched.
  *
  *
  * @param handler A function for handling an incoming request.
@@ -322,7 +523,7 @@ void vla_init_cookie(vla_cookie_t *cookie);
  *                       to be a void *.
  *
  * @return 0 if the route was added, 1 if the route overlaps with another, -1 if
- *         the route doesn't start with '/'.
+ *         the route doesn't start with '/' or has more than 16 captures.
  */
 int vla_add_route(
     vla_context *ctx,
@@ -333,7 +534,68 @@ int vla_add_route(
     ...);
 
 /**
- * Sets the handler to handle requests when no matching route is found.
+ * Creates an empty set of routes. Routes are added to it with vla_routes_add()
+ * and it replaces the routes of a context with vla_routes_publish(). Neither
+ * needs to stop accepting requests.
+ *
+ * @return The set of routes, or NULL if memory could not be allocated. Must be
+ *         freed with vla_free() unless it was published.
+ */
+vla_routes *vla_routes_new();
+
+/**
+ * Adds a new route to a set of routes. Takes the same arguments as
+ * vla_add_route(), apart from the set of routes.
+ *
+ * @param routes The set of routes to add to. Must not have been published.
+ *
+ * @return 0 if the route was added, 1 if the route overlaps with another, -1 if
+ *         the route doesn't start with '/' or has more than 16 captures.
+ */
+int vla_routes_add(
+    vla_routes *routes,
+    uint32_t methods,
+    const char *route,
+    vla_handler_func handler,
+    void *handler_arg,
+    ...);
+
+/**
+ * Replaces every route of a context with a set of routes. Can be called at any
+ * time, including from a handler while requests are being accepted. The not
+ * found handler is kept.
+ *
+ * Requests that start after this function returns use the new routes. Requests
+ * in progress finish with the routes they started with. The replaced routes are
+ * freed once no request is using them, which is checked by this function and
+ * vla_routes_reclaim(). Workers never wait for a publish.
+ *
+ * The children of vla_accept_prefork() have their own copy of the routes, so a
+ * publish in one of them only affects that child.
+ *
+ * @param ctx The context to replace the routes of.
+ *
+ * @param routes The new routes. Owned by the context on success.
+ *
+ * @return 0 on success, -1 on memory error. The routes of the context are
+ *         unchanged on error.
+ */
+int vla_routes_publish(vla_context *ctx, vla_routes *routes);
+
+/**
+ * Frees the routes replaced by vla_routes_publish() that no request is using
+ * anymore.
+ *
+ * @param ctx The context to free the replaced routes of.
+ *
+ * @return The number of replaced route sets that requests are still using.
+ */
+size_t vla_routes_reclaim(vla_context *ctx);
+
+/**
+ * Sets the handler to handle requests when no matching route is found. Requests
+ * to a route that only lacks a handler for their method are instead answered
+ * with 405 Method Not Allowed and an Allow header listing the route's methods.
  *
  * @param ctx The context of this Valhalla instance.
  *
@@ -374,12 +636,73 @@ int vla_set_not_found_handler(
 /**
  * Accepts incoming web requests. Blocks while waiting.
  *
+ * Any number of connections from the web server are served at once. A
+ * connection is kept open after a request if the web server asks for it, such
+ * as nginx with fastcgi_keep_conn enabled. A request is handled once its body
+ * has been received completely.
+ *
  * @param ctx The context containing the route information.
  *
  * @return 0 if every request was handled successfully, -1 otherwise.
  */
 int vla_accept(vla_context *ctx);
 
+/**
+ * Accepts incoming web requests on multiple threads. Blocks until every thread
+ * has stopped.
+ *
+ * Every thread accepts and handles requests independently of the others, so
+ * handlers and middleware must be thread-safe. Routes can only be changed while
+ * this function is running with vla_routes_publish(). The not found handler
+ * must not be changed.
+ *
+ * Once a handler returns VLA_HANDLE_RESPOND_TERM or VLA_HANDLE_IGNORE_TERM, no
+ * thread will accept another request. Threads that are handling a request
+ * finish it before stopping.
+ *
+ * @param ctx The context containing the route information.
+ *
+ * @param n The number of threads to accept requests on. vla_accept_threads(ctx,
+ *          1) is equivalent to vla_accept(ctx).
+ *
+ * @return 0 if every request was handled successfully, -1 otherwise.
+ */
+int vla_accept_threads(vla_context *ctx, size_t n);
+
+/**
+ * Accepts incoming web requests on preforked processes. Blocks until the
+ * calling process receives SIGINT or SIGTERM.
+ *
+ * The listening socket is opened once by the calling process and shared with n
+ * child processes that each run vla_accept(). A child that exits, either
+ * because it crashed or because a handler returned VLA_HANDLE_RESPOND_TERM or
+ * VLA_HANDLE_IGNORE_TERM, is replaced with a new child. Children that exit
+ * within a second of starting are replaced after a short delay.
+ *
+ * Children are sent SIGTERM when the calling process stops. This function
+ * changes the handlers of SIGINT, SIGTERM, and SIGCHLD while it runs, and
+ * restores them before returning.
+ *
+ * @param ctx The context containing the route information.
+ *
+ * @param n The number of child processes.
+ *
+ * @return 0 after every child stopped, -1 if a child could not be started.
+ */
+int vla_accept_prefork(vla_context *ctx, size_t n);
+
+/**
+ * Gets the counters of the requests handled by this process for a context. Can
+ * be called while requests are being accepted. Each worker counts on its own,
+ * so the counters of a running worker can lag slightly behind. Requests
+ * handled by the children of vla_accept_prefork() are not included.
+ *
+ * @param ctx The context to get the counters of.
+ *
+ * @param[out] stats The counters, summed over every worker.
+ */
+void vla_get_stats(vla_context *ctx, vla_stats *stats);
+
 /*
  *==============================================================================
  * Request
@@ -387,7 +710,53 @@ int vla_accept(vla_context *ctx);
  */
 
 /**
- * Gets the value of the query string from the request.
+ * Gets the text of the request URI matched by a ':name' section of the route.
+ * The text is not copied or URL decoded.
+ *
+ * @param req The vla_request to get the parameter from.
+ *
+ * @param name The name of the parameter, without the ':'.
+ *
+ * @param[out] len The length of the parameter. Can be NULL.
+ *
+ * @return A pointer to the parameter within req->document_uri. Not NULL
+ *         terminated. NULL if the route has no parameter with that name.
+ */
+const char *vla_request_param_get(
+    const vla_request *req,
+    const char *name,
+    size_t *len);
+
+/**
+ * Gets the text of the request URI matched by a ':name' section of the route,
+ * by its position in the route.
+ *
+ * @param req The vla_request to get the parameter from.
+ *
+ * @param i The index of the parameter. The first ':' in the route is 0.
+ *
+ * @param[out] len The length of the parameter. Can be NULL.
+ *
+ * @return A pointer to the parameter within req->document_uri. Not NULL
+ *         terminated. NULL if i is out of range.
+ */
+const char *vla_request_param_get_index(
+    const vla_request *req,
+    size_t i,
+    size_t *len);
+
+/**
+ * Gets the number of parameters captured from the request URI.
+ *
+ * @param req The vla_request to count the parameters of.
+ *
+ * @return The number of parameters.
+ */
+size_t vla_request_param_count(const vla_request *req);
+
+/**
+ * Gets the value of the query string from the request. The query string is
+ * decoded the first time it is accessed.
  *
  * @param req The vla_request to get the query string from.
  *
@@ -417,7 +786,7 @@ int vla_request_query_iterate(
     void *arg);
 
 /**
- * Gets a request header.
+ * Gets a request header. Headers are parsed the first time one is accessed.
  *
  * @param req The vla_request to get the header from.
  *
@@ -428,7 +797,23 @@ int vla_request_query_iterate(
 const char *vla_request_header_get(const vla_request *req, const char *header);
 
 /**
- * Iterates over request headers.
+ * Gets a request header by its ID. Faster than vla_request_header_get since
+ * the name doesn't need to be hashed.
+ *
+ * @param req The vla_request to get the header from.
+ *
+ * @param id The ID of the header to get the value of.
+ *
+ * @return The header if it exists, NULL otherwise. Belongs to the vla_request.
+ */
+const char *vla_request_header_get_id(
+    const vla_request *req,
+    enum vla_header id);
+
+/**
+ * Iterates over request headers. Header names are capitalized conventionally
+ * (e.g. 'User-Agent', 'WWW-Authenticate'), and names without a vla_header ID
+ * have each word capitalized (e.g. 'X-Request-Id').
  *
  * @param req The vla_request to iterate over.
  *
@@ -446,7 +831,8 @@ int vla_request_header_iterate(
     void *arg);
 
 /**
- * Gets the value of the cookie with given name.
+ * Gets the value of the cookie with given name. Cookies are parsed the first
+ * time one is accessed.
  *
  * @param req The request to get the cookie from.
  *
@@ -480,7 +866,8 @@ int vla_request_cookie_iterate(
  *
  * This method will only read the message body up to size on the first
  * call. Subsequent calls will return what portion of the body was already
- * read.
+ * read. The whole body was already received when the handler runs, so size
+ * doesn't limit memory use. VLA_MAX_BODY_SIZE does.
  *
  * If the body should be read in chunks, use vla_request_body_chunk instead. Do
  * not use both.
@@ -792,6 +1179,20 @@ int vla_putf(const vla_request *req, const char *path, int bin);
  */
 int vla_write(const vla_request *req, const char *data, size_t len);
 
+/**
+ * Appends URL-encoded data to the body of a response, without allocating a
+ * temporary copy. Useful for writing links and redirect targets.
+ *
+ * @param req The request to append data to.
+ *
+ * @param data The data to URL encode and append.
+ *
+ * @param len The length of the data.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int vla_write_url_encoded(const vla_request *req, const char *data, size_t len);
+
 /**
  * Sends data directly to the webserver over stderr. Unlike vla_printf, data is
  * not buffered and is sent immediately.
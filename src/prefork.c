@@ -0,0 +1,303 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021 Ripose
+//
+// This file is part of Valhalla.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License version 3 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Additional permission under GNU AGPL version 3 section 7
+//
+// If you modify this Program, or any covered work, by linking or combining it
+// with FastCGI (or a modified version of that library), containing parts
+// covered by the terms of the FastCGI Open Market Licence, the licensors of
+// this Program grant you additional permission to convey the resulting work.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+/* For ppoll. */
+#define _GNU_SOURCE
+
+#include "include/valhalla.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <talloc.h>
+
+#include "context.h"
+
+/* Children that exit sooner than this many nanoseconds after starting are
+ * restarted only after the same delay to avoid spinning on a child that
+ * crashes at startup.
+ */
+#define RESPAWN_MIN_UPTIME 1000000000LL
+
+/* A preforked child process. */
+typedef struct prefork_child
+{
+    /* The process id. -1 if the child isn't running. */
+    pid_t pid;
+
+    /* When the child was started, in nanoseconds of CLOCK_MONOTONIC. */
+    int64_t started;
+
+    /* The child isn't restarted before this time, in nanoseconds of
+     * CLOCK_MONOTONIC.
+     */
+    int64_t not_before;
+} prefork_child;
+
+/* Nonzero once the supervisor received SIGINT or SIGTERM. */
+static volatile sig_atomic_t stop_requested = 0;
+
+/**
+ * Signal handler for SIGINT and SIGTERM.
+ *
+ * @param sig Unused.
+ */
+static void handle_stop(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+/**
+ * Signal handler for SIGCHLD. Only exists to interrupt ppoll.
+ *
+ * @param sig Unused.
+ */
+static void handle_child(int sig)
+{
+    (void)sig;
+}
+
+/**
+ * Gets the time of a monotonic clock.
+ *
+ * @return The time in nanoseconds.
+ */
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Forks a child that accepts requests until it stops.
+ *
+ * @param ctx The context containing the route information.
+ *
+ * @param child The child to start.
+ *
+ * @param mask The signal mask the child should run with.
+ *
+ * @param old_acts The signal actions the child should run with. Indexed by
+ *                 SIGINT, SIGTERM, and SIGCHLD in that order.
+ *
+ * @return 0 on success, -1 if the process could not be forked.
+ */
+static int spawn_child(
+    vla_context *ctx,
+    prefork_child *child,
+    const sigset_t *mask,
+    const struct sigaction *old_acts)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        return -1;
+    }
+    if (pid == 0)
+    {
+        sigaction(SIGINT, &old_acts[0], NULL);
+        sigaction(SIGTERM, &old_acts[1], NULL);
+        sigaction(SIGCHLD, &old_acts[2], NULL);
+        sigprocmask(SIG_SETMASK, mask, NULL);
+        _exit(vla_accept(ctx) ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    child->pid = pid;
+    child->started = now_ns();
+    return 0;
+}
+
+/**
+ * Reaps every child that exited and restarts the ones that are due. Children
+ * that exited too soon after starting are due RESPAWN_MIN_UPTIME later.
+ *
+ * @param ctx The context containing the route information.
+ *
+ * @param children The array of children.
+ *
+ * @param n The number of children.
+ *
+ * @param mask The signal mask children should run with.
+ *
+ * @param old_acts The signal actions children should run with.
+ *
+ * @param[out] next_due When the next child that isn't running is due. -1 if
+ *                      every child is running.
+ *
+ * @return 0 on success, -1 if a child could not be restarted.
+ */
+static int respawn_children(
+    vla_context *ctx,
+    prefork_child *children,
+    size_t n,
+    const sigset_t *mask,
+    const struct sigaction *old_acts,
+    int64_t *next_due)
+{
+    *next_due = -1;
+    for (size_t i = 0; i < n; ++i)
+    {
+        prefork_child *child = &children[i];
+        if (child->pid != -1)
+        {
+            pid_t pid = waitpid(child->pid, NULL, WNOHANG);
+            if (pid == 0 || (pid < 0 && errno != ECHILD))
+            {
+                continue;
+            }
+            int64_t now = now_ns();
+            child->pid = -1;
+            child->not_before = now;
+            if (now - child->started < RESPAWN_MIN_UPTIME)
+            {
+                child->not_before += RESPAWN_MIN_UPTIME;
+            }
+        }
+
+        if (now_ns() < child->not_before)
+        {
+            if (*next_due == -1 || child->not_before < *next_due)
+            {
+                *next_due = child->not_before;
+            }
+        }
+        else if (spawn_child(ctx, child, mask, old_acts))
+        {
+            /* TODO Logging */
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int vla_accept_prefork(vla_context *ctx, size_t n)
+{
+    if (n == 0)
+    {
+        return -1;
+    }
+
+    /* Frozen once here so the children share the route table. */
+    if (context_freeze_routes(ctx))
+    {
+        /* TODO Logging */
+        return -1;
+    }
+
+    prefork_child *children = talloc_array(NULL, prefork_child, n);
+    if (children == NULL)
+    {
+        /* TODO Logging */
+        return -1;
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        children[i].pid = -1;
+        children[i].not_before = 0;
+    }
+
+    /* Signals are blocked outside of ppoll so none are missed between reaping
+     * children and waiting. */
+    sigset_t block, old_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old_mask);
+
+    struct sigaction old_acts[3];
+    struct sigaction act = {.sa_flags = 0};
+    sigemptyset(&act.sa_mask);
+    act.sa_handler = handle_stop;
+    sigaction(SIGINT, &act, &old_acts[0]);
+    sigaction(SIGTERM, &act, &old_acts[1]);
+    act.sa_handler = handle_child;
+    sigaction(SIGCHLD, &act, &old_acts[2]);
+
+    stop_requested = 0;
+    int ret = 0;
+    while (!stop_requested)
+    {
+        int64_t next_due;
+        if (respawn_children(ctx, children, n, &old_mask, old_acts, &next_due))
+        {
+            ret = -1;
+            break;
+        }
+        if (stop_requested)
+        {
+            break;
+        }
+
+        /* Wait for a signal, or until a delayed child is due. */
+        struct timespec timeout, *tp = NULL;
+        if (next_due != -1)
+        {
+            int64_t delay = next_due - now_ns();
+            if (delay < 0)
+            {
+                delay = 0;
+            }
+            timeout.tv_sec = delay / 1000000000;
+            timeout.tv_nsec = delay % 1000000000;
+            tp = &timeout;
+        }
+        ppoll(NULL, 0, tp, &old_mask);
+    }
+
+    /* Stop every child and wait for them to exit. */
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (children[i].pid != -1)
+        {
+            kill(children[i].pid, SIGTERM);
+        }
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (children[i].pid != -1)
+        {
+            while (waitpid(children[i].pid, NULL, 0) < 0 && errno == EINTR);
+        }
+    }
+
+    sigaction(SIGINT, &old_acts[0], NULL);
+    sigaction(SIGTERM, &old_acts[1], NULL);
+    sigaction(SIGCHLD, &old_acts[2], NULL);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    talloc_free(children);
+
+    return ret;
+}
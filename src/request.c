@@ -30,14 +30,16 @@
 #include <assert.h>
 #include <time.h>
 #include <stdio.h>
+#include <string.h>
 
-#include <fcgiapp.h>
 #include <talloc.h>
 
 #include "buffer/sds.h"
 #include "containers/strcasemap.h"
 #include "containers/strmap.h"
 #include "context.h"
+#include "fcgi.h"
+#include "header.h"
 #include "strutil.h"
 
 /**
@@ -75,17 +77,107 @@
 #define SERVER_PORT "SERVER_PORT="
 #define SERVER_NAME "SERVER_NAME="
 
+/* The number of bytes a request's memory pool is sized for. Allocations that
+ * don't fit are made outside of the pool.
+ */
+#define REQUEST_POOL_SIZE (8 * 1024)
+
+/* Response body buffers that grew past this many bytes are shrunk when the
+ * request is reset, so one large response doesn't pin memory for good.
+ */
+#define RES_BODY_KEEP_SIZE (64 * 1024)
+
+/* Hash maps that grew past this many buckets are shrunk back to it when the
+ * request is reset.
+ */
+#define MAP_KEEP_BUCKETS 64
+
+/* Header lists with more fields than this get a hash index of the names
+ * without an ID. Below it, scanning the keys is faster.
+ */
+#define HEADER_INDEX_MIN 32
+
+/* Header lists that grew past this many fields are freed when the request is
+ * reset.
+ */
+#define HEADER_KEEP_FIELDS 64
+
+/* Set in the key of a header without an ID. The other bits are the low bits of
+ * the hash of its name.
+ */
+#define HEADER_KEY_OTHER 0x80
+
+/* Flags for the parts of a request that are parsed on first access. */
+#define PARSED_HEADERS 1
+#define PARSED_QUERY   (1 << 1)
+#define PARSED_COOKIES (1 << 2)
+
+/* A header and its value. */
+typedef struct header_field
+{
+    /* The name of the header. */
+    const char *name;
+
+    /* The value of the header. */
+    const char *value;
+} header_field;
+
+/* HTTP headers in the order they were added. Repeated headers get a field for
+ * every value.
+ */
+typedef struct header_list
+{
+    /* The fields. The capacity can be found with talloc_array_length. */
+    header_field *fields;
+
+    /* The key of every field, so a header can be found with memchr. The ID of
+     * the header, or HEADER_KEY_OTHER and the low bits of its name's hash.
+     */
+    unsigned char *keys;
+
+    /* The number of fields. */
+    size_t size;
+
+    /* The position of the first field of each name without an ID. NULL until
+     * the list grows past HEADER_INDEX_MIN.
+     */
+    khash_t(strcase) *index;
+
+    /* The number of fields the index is up to date with. */
+    size_t indexed;
+} header_list;
+
+/* A header name resolved for searching a header_list. */
+typedef struct header_ref
+{
+    /* The name of the header. */
+    const char *name;
+
+    /* The key of the header's fields. */
+    unsigned char key;
+} header_ref;
+
 typedef struct vla_request_private
 {
     /* The FastCGI request tied to this request. */
-    FCGX_Request *f_req;
+    fcgi_request *f_req;
+
+    /* Memory pool everything allocated for the current request comes out of.
+     * Emptied when the request is reset.
+     */
+    void *arena;
 
     //////////////////
     // Request Info //
     //////////////////
 
-    /* A hash map of HTTP request headers. */
-    khash_t(strcase) *req_hdr_map;
+    /* The PARSED_* flags of the maps below that have been populated. Each map
+     * is populated at most once, the first time it is accessed.
+     */
+    unsigned int parsed;
+
+    /* HTTP request headers. */
+    header_list req_hdrs;
 
     /* A hash map of query string key and values. */
     khash_t(str) *query_map;
@@ -106,8 +198,8 @@ typedef struct vla_request_private
     /* The status code. */
     unsigned int res_status;
 
-    /* A map of HTTP response headers. */
-    khash_t(strcase) *res_hdr_map;
+    /* HTTP response headers. */
+    header_list res_hdrs;
 
     /* Body buffer. */
     sds res_body;
@@ -119,20 +211,16 @@ typedef struct vla_request_private
     /* The handlers for the current request. */
     const route_info_t *info;
 
+    /* How the handlers were found. */
+    route_match match;
+
+    /* Recent route lookups. Kept across requests. */
+    route_cache *route_cache;
+
     /* The current array index into the middleware array. */
     size_t mw_i;
 } vla_request_private;
 
-/* An struct for managing header values. */
-typedef struct header_value_array
-{
-    /* The number of elements in the array. */
-    size_t size;
-
-    /* The array. The maximum capacity can be found with talloc_array_length. */
-    char **arr;
-} header_array;
-
 /*
  *==============================================================================
  * Private
@@ -140,335 +228,540 @@ typedef struct header_value_array
  */
 
 /**
- * Initializes a header_array.
+ * Destructor for vla_request.
  *
- * @param ctx The talloc context this array should be a child of.
+ * @param req The vla_request to destruct.
  *
- * @param cap The initial capacity of the array.
+ * @return 0 on success, -1 on failure.
+ */
+static int request_destructor(vla_request *req)
+{
+    kh_destroy(strcase, req->priv->res_hdrs.index);
+    kh_destroy(strcase, req->priv->req_hdrs.index);
+    kh_destroy(str, req->priv->query_map);
+    kh_destroy(str, req->priv->cookie_map);
+    sdsfree(req->priv->res_body);
+    return 0;
+}
+
+/**
+ * Empties a string map without freeing its buckets, unless it grew past
+ * MAP_KEEP_BUCKETS. The keys and values must already be freed.
  *
- * @return A new header_value_array with an initial capacity of cap. NULL on
- *         error.
+ * @param map The map to clear.
  */
-static header_array *init_header_array(void *ctx, size_t cap)
+static void clear_str_map(khash_t(str) *map)
 {
-    header_array *ha = talloc(ctx, header_array);
-    if (ha == NULL)
+    kh_clear(str, map);
+    if (kh_n_buckets(map) > MAP_KEEP_BUCKETS)
     {
-        return NULL;
+        kh_resize(str, map, MAP_KEEP_BUCKETS);
+    }
+}
+
+/**
+ * Empties a header list. Keeps its memory unless it grew past
+ * HEADER_KEEP_FIELDS.
+ *
+ * @param list The list to clear.
+ */
+static void clear_header_list(header_list *list)
+{
+    if (talloc_array_length(list->keys) > HEADER_KEEP_FIELDS)
+    {
+        TALLOC_FREE(list->fields);
+        TALLOC_FREE(list->keys);
     }
-    ha->size = 0;
-    ha->arr = talloc_array(ha, char *, cap);
-    if (ha->arr == NULL)
+    list->size = 0;
+    list->indexed = 0;
+    if (list->index)
     {
-        talloc_free(ha);
-        return NULL;
+        kh_clear(strcase, list->index);
     }
-    return ha;
 }
 
 /**
- * Appends a value to the array.
+ * Populates the query string map. The query string is copied once and every key
+ * and value is decoded in place within the copy.
  *
- * @param ha The header_array to push a value onto.
+ * @param req The vla_request to add the formatted values to.
  *
- * @param val The value to push onto the array. Must be talloc allocated.
- *            Takes ownership.
+ * @param query The raw query string.
  *
- * @return 0 on success, -1 if memory cannot be allocated.
+ * @return 0 on success, -1 on error.
  */
-static int header_array_push(header_array *ha, char *val)
+static int pop_query_map(vla_request *req, const char *query)
 {
-    size_t cap = talloc_array_length(ha->arr);
-    if (ha->size >= cap)
+    khash_t(str) *map = req->priv->query_map;
+
+    /* Freed along with the arena when the request is reset. */
+    char *copy = su_tstrdup(req->priv->arena, query);
+    if (copy == NULL)
     {
-        char **arr = talloc_realloc(ha, ha->arr, char *, cap * 2);
-        if (arr == NULL)
+        return -1;
+    }
+
+    char *key = copy;
+    while (*key)
+    {
+        /* Stopping at either separator keeps a key without a value from
+         * swallowing the pair after it. */
+        char *val = (char *)su_strpbrknul(key, "=&");
+        if (*val != '=')
+        {
+            key = *val ? val + 1 : val;
+            continue;
+        }
+        val += 1;
+
+        size_t keylen = val - key - 1;
+        char *next = (char *)su_strchrnul(val, '&');
+        size_t vallen = next - val;
+        if (*next == '&')
+        {
+            next += 1;
+        }
+
+        /* Decoding never lengthens a string, so the terminators only
+         * overwrite the separators or characters that were decoded away. */
+        su_url_decode_in_place(key, keylen);
+        su_url_decode_in_place(val, vallen);
+
+        /* A repeated key keeps its first copy and takes the last value. */
+        int ret = 0;
+        khiter_t it = kh_put(str, map, key, &ret);
+        if (ret < 0)
         {
+            /* TODO: Logging */
             return -1;
         }
-        ha->arr = arr;
+        kh_val(map, it) = val;
+
+        key = next;
     }
-    talloc_steal(ha->arr, val);
-    ha->arr[ha->size++] = val;
+
     return 0;
 }
 
 /**
- * Replaces the value at an index.
+ * Resolves the name of a header with an ID.
  *
- * @param ha The header array to replace the value in.
+ * @param id The ID of the header.
  *
- * @param i The index of the value.
- *
- * @param val The value to insert. Must be talloc allocated. Takes ownership.
+ * @return A reference to the header.
  */
-static void header_array_replace(header_array *ha, size_t i, char *val)
+static inline header_ref header_ref_id(enum vla_header id)
 {
-    talloc_free(ha->arr[i]);
-    talloc_steal(ha->arr, val);
-    ha->arr[i] = val;
+    return (header_ref) {.name = header_name(id), .key = id};
 }
 
 /**
- * Removes the value at index i from the array and frees it.
+ * Resolves a header name.
  *
- * @param ha The header array to remove a value from.
+ * @param name The name of the header. Not case sensative.
  *
- * @param i The index of the item to remove. Must be less than size.
+ * @return A reference to the header. Refers to name if it doesn't have an ID.
  */
-static void header_array_remove(header_array *ha, size_t i)
+static header_ref header_ref_name(const char *name)
 {
-    assert(i < ha->size);
-    talloc_free(ha->arr[i]);
-    --ha->size;
-    while (i < ha->size)
+    enum vla_header id = header_id(name, strlen(name));
+    if (id != VLA_HDR_UNKNOWN)
     {
-        ha->arr[i] = ha->arr[i + 1];
-        ++i;
+        return header_ref_id(id);
     }
+    return (header_ref) {
+        .name = name,
+        .key = HEADER_KEY_OTHER | hash_ignorecase(name),
+    };
 }
 
 /**
- * Removes all values from the header array and deallocates memory.
+ * Finds the next field of a header.
+ *
+ * @param list The list to search.
  *
- * @param ha The header array to remove values from.
+ * @param pos The position to start searching from.
+ *
+ * @param ref The header to find.
+ *
+ * @return The position of the field. The size of the list if there isn't one.
  */
-static void header_array_clear(header_array *ha)
+static size_t header_next(const header_list *list, size_t pos, header_ref ref)
 {
-    for (size_t i = 0; i < ha->size; ++i)
+    while (pos < list->size)
     {
-        talloc_free(ha->arr[i]);
+        const unsigned char *key = memchr(
+            list->keys + pos, ref.key, list->size - pos
+        );
+        if (key == NULL)
+        {
+            break;
+        }
+        pos = key - list->keys;
+
+        /* IDs are unique, but hash bits aren't. */
+        if (ref.key < HEADER_KEY_OTHER ||
+            strcase_equal(list->fields[pos].name, ref.name))
+        {
+            return pos;
+        }
+        ++pos;
     }
-    ha->size = 0;
+    return list->size;
 }
 
 /**
- * Destructor for vla_request.
+ * Brings the index of a header list up to date.
  *
- * @param req The vla_request to destruct.
+ * @param list The list to index.
  *
- * @return 0 on success, -1 on failure.
+ * @return 0 on success, -1 on error.
  */
-static int request_destructor(vla_request *req)
+static int header_index(header_list *list)
 {
-    kh_destroy(strcase, req->priv->res_hdr_map);
-    kh_destroy(strcase, req->priv->req_hdr_map);
-    kh_destroy(str, req->priv->query_map);
-    kh_destroy(str, req->priv->cookie_map);
-    sdsfree(req->priv->res_body);
+    if (list->index == NULL)
+    {
+        list->index = kh_init(strcase);
+        if (list->index == NULL)
+        {
+            return -1;
+        }
+    }
+
+    for (; list->indexed < list->size; ++list->indexed)
+    {
+        if (list->keys[list->indexed] < HEADER_KEY_OTHER)
+        {
+            continue;
+        }
+        int ret;
+        khiter_t it = kh_put(
+            strcase, list->index, list->fields[list->indexed].name, &ret
+        );
+        if (ret < 0)
+        {
+            return -1;
+        }
+        else if (ret > 0)
+        {
+            kh_val(list->index, it) = list->indexed;
+        }
+    }
     return 0;
 }
 
 /**
- * Populates the query string map.
+ * Finds a field of a header.
  *
- * @param req The vla_request to add the formatted values to.
+ * @param list The list to search.
  *
- * @param query The raw query string.
+ * @param ref The header to find.
  *
- * @return 0 on success, -1 on error.
+ * @param i Which of the header's fields to find.
+ *
+ * @return The position of the field. The size of the list if there isn't one.
  */
-static int pop_query_map(vla_request *req, const char *query)
+static size_t header_find(header_list *list, header_ref ref, size_t i)
 {
-    khash_t(str) *map = req->priv->query_map;
+    size_t pos;
+    if (ref.key >= HEADER_KEY_OTHER &&
+        list->size > HEADER_INDEX_MIN &&
+        header_index(list) == 0)
+    {
+        khiter_t it = kh_get(strcase, list->index, ref.name);
+        pos = it == kh_end(list->index) ? list->size : kh_val(list->index, it);
+    }
+    else
+    {
+        pos = header_next(list, 0, ref);
+    }
 
-    while (*query)
+    while (i-- && pos < list->size)
     {
-        const char *key = query;
-        const char *val = strchr(key, '=');
-        if (!val)
-        {
-            break;
-        }
-        val += 1;
+        pos = header_next(list, pos + 1, ref);
+    }
+    return pos;
+}
 
-        size_t keylen = val - key - 1;
-        const char *valendptr = su_strchrnul(val, '&');
-        size_t vallen = valendptr - val;
+/**
+ * Counts the fields of a header.
+ *
+ * @param list The list to search.
+ *
+ * @param ref The header to count.
+ *
+ * @return The number of fields with the header's name.
+ */
+static size_t header_count(header_list *list, header_ref ref)
+{
+    size_t count = 0;
+    for (size_t pos = header_find(list, ref, 0);
+         pos < list->size;
+         pos = header_next(list, pos + 1, ref))
+    {
+        ++count;
+    }
+    return count;
+}
 
-        char *t_key = su_url_decode_l(req, key, keylen);
-        if (t_key == NULL)
-        {
-            return -1;
-        }
-        char *t_val = su_url_decode_l(req, val, vallen);
-        if (t_val == NULL)
+/**
+ * Appends a field to a header list.
+ *
+ * @param req The request the list belongs to.
+ *
+ * @param list The list to append to.
+ *
+ * @param ref The header. Its name must outlive the field.
+ *
+ * @param value The value. Must outlive the field.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int header_append(
+    vla_request *req,
+    header_list *list,
+    header_ref ref,
+    const char *value)
+{
+    size_t cap = talloc_array_length(list->keys);
+    if (list->size == cap)
+    {
+        cap = cap ? cap * 2 : 16;
+        header_field *fields = talloc_realloc(
+            req->priv, list->fields, header_field, cap
+        );
+        if (fields == NULL)
         {
-            talloc_free(t_key);
             return -1;
         }
-
-        int ret = 0;
-        khiter_t it = kh_put(str, map, t_key, &ret);
-        switch (ret)
+        list->fields = fields;
+        unsigned char *keys = talloc_realloc(
+            req->priv, list->keys, unsigned char, cap
+        );
+        if (keys == NULL)
         {
-        case 0: // Key already exists
-            talloc_free(t_key);
-            talloc_free(kh_val(map, it));
-            break;
-
-        case 1: // Key doesn't exist
-        case 2: // Key did exist, since deleted
-            kh_key(map, it) = t_key;
-            break;
-
-        case -1: // Error
-        default:
-            talloc_free(t_key);
-            talloc_free(t_val);
-            /* TODO: Logging */
             return -1;
         }
-        kh_val(map, it) = t_val;
-
-        query = val + vallen;
-        if (*query == '&')
-        {
-            query += 1;
-        }
+        list->keys = keys;
     }
 
+    list->fields[list->size] = (header_field) {
+        .name = ref.name,
+        .value = value,
+    };
+    list->keys[list->size] = ref.key;
+    ++list->size;
     return 0;
 }
 
 /**
- * Appends a header to a map. Inserts it if it doesn't exist.
+ * Copies a header value and appends it to a header list.
  *
- * @param req The request associated with this. Used for memory management.
+ * @param req The request the list belongs to.
  *
- * @param map The map to append the header value to.
+ * @param list The list to append to.
  *
- * @param header The header to append to. Not case sensative. Copied to the
- *               heap, so this function does NOT take ownership.
+ * @param ref The header. Its name is copied if it doesn't have an ID.
  *
- * @param value The header value to append. Copied to the heap, so this function
- *              does NOT take ownership.
+ * @param value The value. Copied, so this function does NOT take ownership.
  *
- * @param[out] ind The index of the added header. Can be NULL.
+ * @param[out] ind The index of the value among the header's values. Can be
+ *                 NULL.
  *
  * @return 0 on success, -1 on error.
  */
 static int header_add(
     vla_request *req,
-    khash_t(strcase) *map,
-    const char *header,
+    header_list *list,
+    header_ref ref,
     const char *value,
     size_t *ind)
 {
-    int ret;
-    khiter_t it = kh_put(strcase, map, header, &ret);
-    switch (ret)
+    char *t_val = su_tstrdup(req->priv->arena, value);
+    if (t_val == NULL)
     {
-    case 0: // Key exists
-        break;
-
-    case 1: // Key doesn't exist
-    case 2: // Key did exist, doesn't anymore
+        return -1;
+    }
+    if (ref.key >= HEADER_KEY_OTHER)
     {
-        char *t_key = su_tstrdup(req, header);
-        if (t_key == NULL)
+        ref.name = su_tstrdup(t_val, ref.name);
+        if (ref.name == NULL)
         {
-            kh_del(strcase, map, it);
-            return -1;
-        }
-        kh_key(map, it) = t_key;
-
-        header_array *ha = init_header_array(t_key, 1);
-        if (ha == NULL)
-        {
-            talloc_free(t_key);
-            kh_del(strcase, map, it);
+            talloc_free(t_val);
             return -1;
         }
-        kh_val(map, it) = ha;
-        break;
     }
-
-    default: // Error
-        return -1;
-    }
-
-    header_array *ha = kh_val(map, it);
-    char *t_val = su_tstrdup((void *)kh_key(map, it), value);
-    if (t_val == NULL)
+    if (header_append(req, list, ref, t_val))
     {
+        talloc_free(t_val);
         return -1;
     }
-    header_array_push(ha, t_val);
     if (ind)
     {
-        *ind = ha->size - 1;
+        *ind = header_count(list, ref) - 1;
     }
-
     return 0;
 }
 
 /**
- * Removes all header values for the supplied header from the map.
+ * Removes a field from a header list and frees its value.
  *
- * @param map The map to delete the header from.
+ * @param list The list to remove the field from.
  *
- * @param header The header to delete. Not case sensative.
- *
- * @return 0 on success, -1 if the header doesn't exist.
+ * @param pos The position of the field. Must be less than the size.
  */
-static int header_remove_all(khash_t(strcase) *map, const char *header)
+static void header_remove_at(header_list *list, size_t pos)
 {
-    khiter_t it = kh_get(strcase, map, header);
-    if (it == kh_end(map))
+    assert(pos < list->size);
+    /* Response values are copies, and own the name if it was copied. */
+    talloc_free((char *)list->fields[pos].value);
+
+    --list->size;
+    memmove(
+        &list->fields[pos],
+        &list->fields[pos + 1],
+        (list->size - pos) * sizeof(*list->fields)
+    );
+    memmove(&list->keys[pos], &list->keys[pos + 1], list->size - pos);
+
+    /* Positions after the field moved. */
+    list->indexed = 0;
+    if (list->index)
     {
-        return -1;
+        kh_clear(strcase, list->index);
     }
+}
 
-    talloc_free((char *)kh_key(map, it));
-    kh_del(strcase, map, it);
-
-    return 0;
+/**
+ * Removes every field of a header after the first.
+ *
+ * @param list The list to remove the fields from.
+ *
+ * @param ref The header.
+ *
+ * @param pos The position of the header's first field.
+ */
+static void header_remove_rest(header_list *list, header_ref ref, size_t pos)
+{
+    for (pos = header_next(list, pos + 1, ref);
+         pos < list->size;
+         pos = header_next(list, pos, ref))
+    {
+        header_remove_at(list, pos);
+    }
 }
 
 /**
- * Removes a specific header and value from the map.
+ * Replaces every value of a header with a single value. Appends the header if
+ * it doesn't exist.
+ *
+ * @param req The request the list belongs to.
  *
- * @param map The map to delete the header from.
+ * @param list The list the header is in.
  *
- * @param header The header to delete. Not case sensative.
+ * @param ref The header.
  *
- * @param i The index of the header to remove.
+ * @param value The value. Copied, so this function does NOT take ownership.
  *
- * @return 0 on success, -1 if the header/value doesn't exist.
+ * @return 0 on success, -1 on error.
  */
-static int header_remove(
-    khash_t(strcase) *map,
-    const char *header,
-    size_t i)
+static int header_replace_all(
+    vla_request *req,
+    header_list *list,
+    header_ref ref,
+    const char *value)
 {
-    khiter_t it = kh_get(strcase, map, header);
-    if (it == kh_end(map))
+    size_t pos = header_find(list, ref, 0);
+    if (pos == list->size)
     {
-        return -1;
+        return header_add(req, list, ref, value, NULL);
     }
+    header_remove_rest(list, ref, pos);
 
-    header_array *ha = kh_val(map, it);
-    if (i >= ha->size)
+    char *t_val = su_tstrdup(req->priv->arena, value);
+    if (t_val == NULL)
     {
         return -1;
     }
-    header_array_remove(ha, i);
-
-    /* If that was the only value associated with this header, free the header
-     * as well. */
-    if (ha->size == 0)
+    /* The old value may own the name. */
+    if (ref.key >= HEADER_KEY_OTHER)
     {
-        talloc_free((char *)kh_key(map, it));
-        kh_del(strcase, map, it);
+        talloc_steal(t_val, list->fields[pos].name);
     }
+    talloc_free((char *)list->fields[pos].value);
+    list->fields[pos].value = t_val;
+    return 0;
+}
 
+/**
+ * Calls a function for every header and value in a list, in order.
+ *
+ * @param list The list to iterate over.
+ *
+ * @param callback The function to call. The first argument is the header, and
+ *                 the second is the value. Return 0 to continue iterating,
+ *                 nonzero to stop.
+ *
+ * @param arg The third argument to the callback function.
+ *
+ * @return 0 if every value was iterated over, 1 otherwise.
+ */
+static int header_iterate(
+    const header_list *list,
+    int (*callback)(const char *, const char *, void *),
+    void *arg)
+{
+    for (size_t i = 0; i < list->size; ++i)
+    {
+        if (callback(list->fields[i].name, list->fields[i].value, arg))
+        {
+            return 1;
+        }
+    }
     return 0;
 }
 
 /**
- * Adds an HTTP request header to the header map. If a header is duplicated,
- * creates a comma seperated list.
+ * Converts the name of a CGI parameter to a header name. CGI uppercases names
+ * and replaces '-' with '_', so this capitalizes each word and restores the
+ * '-' (e.g. 'X_FORWARDED_FOR' becomes 'X-Forwarded-For').
+ *
+ * @param[out] dst The header name. Not nul terminated.
+ *
+ * @param src The name of the CGI parameter without the 'HTTP_' prefix.
+ *
+ * @param len The length of the name.
+ */
+static void cgi_header_name(char *dst, const char *src, size_t len)
+{
+    int word_start = 1;
+    for (size_t i = 0; i < len; ++i)
+    {
+        char c = src[i];
+        if (c == '_' || c == '-')
+        {
+            dst[i] = '-';
+            word_start = 1;
+            continue;
+        }
+        if (word_start && c >= 'a' && c <= 'z')
+        {
+            c -= 'a' - 'A';
+        }
+        else if (!word_start && c >= 'A' && c <= 'Z')
+        {
+            c += 'a' - 'A';
+        }
+        dst[i] = c;
+        word_start = 0;
+    }
+}
+
+/**
+ * Adds an HTTP request header to the header list. A repeated header is added as
+ * another field, so its values are kept separately in the order they were
+ * added. Well-known headers are named by header_name(), others by
+ * cgi_header_name().
  *
  * @param req The request to add the header to.
  *
@@ -489,15 +782,33 @@ static int request_add_header(vla_request *req, const char *envstr)
     }
     val += 1;
 
-    /* Duplicate the header value. */
-    char header[val - envstr];
-    for (size_t i = 0; i < sizeof(header) - 1; ++i)
+    /* The value lives as long as the request, so it isn't copied. Neither is
+     * the name of a well-known header. */
+    size_t len = val - envstr - 1;
+    if (len <= HEADER_NAME_MAX)
+    {
+        char name[HEADER_NAME_MAX];
+        cgi_header_name(name, envstr, len);
+        enum vla_header id = header_id(name, len);
+        if (id != VLA_HDR_UNKNOWN)
+        {
+            return header_append(
+                req, &req->priv->req_hdrs, header_ref_id(id), val
+            );
+        }
+    }
+
+    char *header = talloc_array(req->priv->arena, char, len + 1);
+    if (header == NULL)
     {
-        header[i] = envstr[i] == '_' ? '-' : envstr[i];
+        return -1;
     }
-    header[sizeof(header) - 1] = '\0';
+    cgi_header_name(header, envstr, len);
+    header[len] = '\0';
 
-    return header_add(req, req->priv->req_hdr_map, header, val, NULL);
+    return header_append(
+        req, &req->priv->req_hdrs, header_ref_name(header), val
+    );
 }
 
 /**
@@ -510,7 +821,7 @@ static int request_add_header(vla_request *req, const char *envstr)
  */
 static int request_add_cookies(vla_request *req)
 {
-    const char *cookies = vla_request_header_get(req, "Cookie");
+    const char *cookies = vla_request_getenv(req, HTTP_HEADER "COOKIE");
     if (cookies == NULL)
     {
         return 0;
@@ -519,24 +830,35 @@ static int request_add_cookies(vla_request *req)
     while (*cookies)
     {
         const char *name = cookies;
-        const char *name_end = su_strchrnul(name, '=');
+        const char *name_end = su_strpbrknul(name, "=;");
         size_t name_len = name_end - name;
 
         if (*name_end == '\0')
         {
-            return -1;
+            break;
+        }
+        if (*name_end == ';')
+        {
+            /* Cookies without a value are skipped rather than swallowing the
+             * one after them. */
+            cookies = name_end + 1;
+            while (*cookies == ' ')
+            {
+                ++cookies;
+            }
+            continue;
         }
 
         const char *value = name_end + 1;
         const char *value_end = su_strchrnul(value, ';');
         size_t value_len = value_end - value;
 
-        char *t_name = su_tstrndup(req, name, name_len);
+        char *t_name = su_tstrndup(req->priv->arena, name, name_len);
         if (t_name == NULL)
         {
             return -1;
         }
-        char *t_value = su_tstrndup(req, value, value_len);
+        char *t_value = su_tstrndup(req->priv->arena, value, value_len);
         if (t_value == NULL)
         {
             talloc_free(t_name);
@@ -576,153 +898,339 @@ static int request_add_cookies(vla_request *req)
     return 0;
 }
 
+/* The CGI params that are stored in a vla_request. */
+enum cgi_param
+{
+    PARAM_OTHER = 0,
+    PARAM_QUERY_STRING,
+    PARAM_REQUEST_METHOD,
+    PARAM_CONTENT_TYPE,
+    PARAM_CONTENT_LENGTH,
+    PARAM_SCRIPT_NAME,
+    PARAM_REQUEST_URI,
+    PARAM_DOCUMENT_URI,
+    PARAM_DOCUMENT_ROOT,
+    PARAM_SERVER_PROTOCOL,
+    PARAM_REQUEST_SCHEME,
+    PARAM_GATEWAY_INTERFACE,
+    PARAM_SERVER_SOFTWARE,
+    PARAM_REMOTE_ADDR,
+    PARAM_REMOTE_PORT,
+    PARAM_SERVER_ADDR,
+    PARAM_SERVER_PORT,
+    PARAM_SERVER_NAME,
+};
+
 /**
- * Fills the fields a vla_request with the relevant request information.
+ * Evaluates to a param id if an environment string is that param.
  *
- * @param ctx The vla_context attatched to this request.
+ * @param __str The environment string of the form '{NAME}={VAL}'.
  *
- * @param req The request to populate the fields of.
+ * @param __param The param to check for, including the '='.
  *
- * @return 0 on success, -1 on error.
+ * @param __id The id of the param.
+ *
+ * @return __id if the string is the param, PARAM_OTHER otherwise.
  */
-static int request_populate(vla_context *ctx, vla_request *req)
+#define PARAM_IS(__str, __param, __id) \
+    (HAS_PREFIX(__str, __param) ? (__id) : PARAM_OTHER)
+
+/**
+ * Finds which param an environment string holds. The length of the name and
+ * a byte or two of it narrow the candidates down to one, so at most one string
+ * comparison is made.
+ *
+ * @param str The environment string of the form '{NAME}={VAL}'.
+ *
+ * @param len The length of the name.
+ *
+ * @return The param, or PARAM_OTHER if it isn't stored in a vla_request.
+ */
+static enum cgi_param classify_param(const char *str, size_t len)
 {
-    for (const char **str = (const char **)req->priv->f_req->envp; *str; ++str)
+    switch (len)
     {
-        const char *val = strchr(*str, '=') + 1;
-        assert(val != NULL + 1);
-        if (HAS_PREFIX(*str, HTTP_HEADER))
+    case sizeof(SCRIPT_NAME) - 2:
+        switch (str[0])
         {
-            if (request_add_header(req, *str))
+        case 'R':
+            switch (str[7])
             {
-                /* TODO error logging */
-                return -1;
+            case '_':
+                return PARAM_IS(str, REQUEST_URI, PARAM_REQUEST_URI);
+            case 'A':
+                return PARAM_IS(str, REMOTE_ADDR, PARAM_REMOTE_ADDR);
+            case 'P':
+                return PARAM_IS(str, REMOTE_PORT, PARAM_REMOTE_PORT);
             }
-        }
-        else if (HAS_PREFIX(*str, QUERY_STRING))
-        {
-            req->query_str = val;
-            if (pop_query_map(req, val))
+            break;
+
+        case 'S':
+            switch (str[7])
             {
-                /* TODO error logging */
-                return -1;
+            case 'A':
+                return PARAM_IS(str, SERVER_ADDR, PARAM_SERVER_ADDR);
+            case 'P':
+                return PARAM_IS(str, SERVER_PORT, PARAM_SERVER_PORT);
+            case 'N':
+                return str[1] == 'C' ?
+                    PARAM_IS(str, SCRIPT_NAME, PARAM_SCRIPT_NAME) :
+                    PARAM_IS(str, SERVER_NAME, PARAM_SERVER_NAME);
             }
+            break;
         }
-        else if (HAS_PREFIX(*str, REQUEST_METHOD))
+        break;
+
+    case sizeof(QUERY_STRING) - 2:
+        switch (str[0])
         {
-            if (strcasecmp(val, "GET") == 0)
-            {
-                req->method = VLA_HTTP_GET;
-            }
-            else if (strcasecmp(val, "HEAD") == 0)
-            {
-                req->method = VLA_HTTP_HEAD;
-            }
-            else if (strcasecmp(val, "POST") == 0)
-            {
-                req->method = VLA_HTTP_POST;
-            }
-            else if (strcasecmp(val, "PUT") == 0)
-            {
-                req->method = VLA_HTTP_PUT;
-            }
-            else if (strcasecmp(val, "DELTE") == 0)
-            {
-                req->method = VLA_HTTP_DELETE;
-            }
-            else if (strcasecmp(val, "CONNECT") == 0)
-            {
-                req->method = VLA_HTTP_CONNECT;
-            }
-            else if (strcasecmp(val, "OPTIONS") == 0)
-            {
-                req->method = VLA_HTTP_OPTIONS;
-            }
-            else if (strcasecmp(val, "TRACE") == 0)
-            {
-                req->method = VLA_HTTP_TRACE;
-            }
-            else if (strcasecmp(val, "PATCH") == 0)
-            {
-                req->method = VLA_HTTP_PATCH;
-            }
-            else
-            {
-                req->method = VLA_HTTP_UNKNOWN;
-            }
+        case 'Q':
+            return PARAM_IS(str, QUERY_STRING, PARAM_QUERY_STRING);
+        case 'C':
+            return PARAM_IS(str, CONTENT_TYPE, PARAM_CONTENT_TYPE);
+        case 'D':
+            return PARAM_IS(str, DOCUMENT_URI, PARAM_DOCUMENT_URI);
         }
-        else if (HAS_PREFIX(*str, CONTENT_TYPE))
+        break;
+
+    case sizeof(DOCUMENT_ROOT) - 2:
+        return PARAM_IS(str, DOCUMENT_ROOT, PARAM_DOCUMENT_ROOT);
+
+    case sizeof(REQUEST_METHOD) - 2:
+        switch (str[8])
         {
-            req->content_type = val;
+        case 'M':
+            return PARAM_IS(str, REQUEST_METHOD, PARAM_REQUEST_METHOD);
+        case 'S':
+            return PARAM_IS(str, REQUEST_SCHEME, PARAM_REQUEST_SCHEME);
+        case 'L':
+            return PARAM_IS(str, CONTENT_LENGTH, PARAM_CONTENT_LENGTH);
         }
-        else if (HAS_PREFIX(*str, CONTENT_LENGTH))
+        break;
+
+    case sizeof(SERVER_PROTOCOL) - 2:
+        switch (str[7])
+        {
+        case 'P':
+            return PARAM_IS(str, SERVER_PROTOCOL, PARAM_SERVER_PROTOCOL);
+        case 'S':
+            return PARAM_IS(str, SERVER_SOFTWARE, PARAM_SERVER_SOFTWARE);
+        }
+        break;
+
+    case sizeof(GATEWAY_INTERFACE) - 2:
+        return PARAM_IS(str, GATEWAY_INTERFACE, PARAM_GATEWAY_INTERFACE);
+    }
+    return PARAM_OTHER;
+}
+
+/**
+ * Converts a REQUEST_METHOD value to a vla_http_method. The second and third
+ * letters of every supported method hash to a distinct slot of a lookup table,
+ * so only one string comparison is made.
+ *
+ * @param val The value of the REQUEST_METHOD param.
+ *
+ * @return The method, VLA_HTTP_UNKNOWN if it isn't supported.
+ */
+static enum vla_http_method parse_method(const char *val)
+{
+    static const struct
+    {
+        const char *name;
+        enum vla_http_method method;
+    } methods[32] = {
+        [ 2] = {"POST", VLA_HTTP_POST},
+        [ 4] = {"OPTIONS", VLA_HTTP_OPTIONS},
+        [ 6] = {"HEAD", VLA_HTTP_HEAD},
+        [ 9] = {"PUT", VLA_HTTP_PUT},
+        [17] = {"DELETE", VLA_HTTP_DELETE},
+        [19] = {"TRACE", VLA_HTTP_TRACE},
+        [21] = {"PATCH", VLA_HTTP_PATCH},
+        [25] = {"GET", VLA_HTTP_GET},
+        [29] = {"CONNECT", VLA_HTTP_CONNECT},
+    };
+
+    if (val[0] == '\0' || val[1] == '\0')
+    {
+        return VLA_HTTP_UNKNOWN;
+    }
+    size_t i = ((val[1] | 0x20) + (val[2] | 0x20)) & 31;
+    if (methods[i].name == NULL || strcasecmp(val, methods[i].name) != 0)
+    {
+        return VLA_HTTP_UNKNOWN;
+    }
+    return methods[i].method;
+}
+
+/**
+ * Fills the fields a vla_request with the relevant request information.
+ *
+ * @param req The request to populate the fields of.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int request_populate(vla_request *req)
+{
+    for (const char *const *str = fcgi_request_envp(req->priv->f_req);
+         *str;
+         ++str)
+    {
+        const char *val = strchr(*str, '=') + 1;
+        assert(val != NULL + 1);
+        switch (classify_param(*str, val - *str - 1))
         {
-            int res = sscanf(val, "%zu", &req->content_length);
-            if (res != 1)
+        case PARAM_OTHER:
+            break;
+
+        case PARAM_QUERY_STRING:
+            req->query_str = val;
+            break;
+
+        case PARAM_REQUEST_METHOD:
+            req->method = parse_method(val);
+            break;
+
+        case PARAM_CONTENT_TYPE:
+            req->content_type = val;
+            break;
+
+        case PARAM_CONTENT_LENGTH:
+            if (sscanf(val, "%zu", &req->content_length) != 1)
             {
                 req->content_length = 0;
             }
-        }
-        else if (HAS_PREFIX(*str, SCRIPT_NAME))
-        {
+            break;
+
+        case PARAM_SCRIPT_NAME:
             req->script_name = val;
-        }
-        else if (HAS_PREFIX(*str, REQUEST_URI))
-        {
+            break;
+
+        case PARAM_REQUEST_URI:
             req->request_uri = val;
-        }
-        else if (HAS_PREFIX(*str, DOCUMENT_URI))
-        {
+            break;
+
+        case PARAM_DOCUMENT_URI:
             req->document_uri = val;
-        }
-        else if (HAS_PREFIX(*str, DOCUMENT_ROOT))
-        {
+            break;
+
+        case PARAM_DOCUMENT_ROOT:
             req->document_root = val;
-        }
-        else if (HAS_PREFIX(*str, SERVER_PROTOCOL))
-        {
+            break;
+
+        case PARAM_SERVER_PROTOCOL:
             req->server_protocol = val;
-        }
-        else if (HAS_PREFIX(*str, REQUEST_SCHEME))
-        {
+            break;
+
+        case PARAM_REQUEST_SCHEME:
             req->request_scheme = val;
             req->https = strcasecmp(val, "HTTPS") == 0;
-        }
-        else if (HAS_PREFIX(*str, GATEWAY_INTERFACE))
-        {
+            break;
+
+        case PARAM_GATEWAY_INTERFACE:
             req->gateway_interface = val;
-        }
-        else if (HAS_PREFIX(*str, SERVER_SOFTWARE))
-        {
+            break;
+
+        case PARAM_SERVER_SOFTWARE:
             req->server_software = val;
-        }
-        else if (HAS_PREFIX(*str, REMOTE_ADDR))
-        {
+            break;
+
+        case PARAM_REMOTE_ADDR:
             req->remote_addr = val;
-        }
-        else if (HAS_PREFIX(*str, REMOTE_PORT))
-        {
+            break;
+
+        case PARAM_REMOTE_PORT:
             req->remote_port = val;
-        }
-        else if (HAS_PREFIX(*str, SERVER_ADDR))
-        {
+            break;
+
+        case PARAM_SERVER_ADDR:
             req->server_addr = val;
-        }
-        else if (HAS_PREFIX(*str, SERVER_PORT))
-        {
+            break;
+
+        case PARAM_SERVER_PORT:
             req->server_port = val;
+            break;
+
+        case PARAM_SERVER_NAME:
+            req->server_name = val;
+            break;
         }
-        else if (HAS_PREFIX(*str, SERVER_NAME))
+    }
+
+    return 0;
+}
+
+/**
+ * Populates the request header map if it hasn't been already.
+ *
+ * @param req The request to parse the headers of.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int request_parse_headers(vla_request *req)
+{
+    if (req->priv->parsed & PARSED_HEADERS)
+    {
+        return 0;
+    }
+    req->priv->parsed |= PARSED_HEADERS;
+
+    for (const char *const *str = fcgi_request_envp(req->priv->f_req);
+         *str;
+         ++str)
+    {
+        if (HAS_PREFIX(*str, HTTP_HEADER) && request_add_header(req, *str))
         {
-            req->server_name = val;
+            /* TODO error logging */
+            return -1;
         }
     }
+    return 0;
+}
+
+/**
+ * Populates the query string map if it hasn't been already.
+ *
+ * @param req The request to parse the query string of.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int request_parse_query(vla_request *req)
+{
+    if (req->priv->parsed & PARSED_QUERY)
+    {
+        return 0;
+    }
+    req->priv->parsed |= PARSED_QUERY;
+
+    if (req->query_str && pop_query_map(req, req->query_str))
+    {
+        /* TODO error logging */
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Populates the cookie map if it hasn't been already.
+ *
+ * @param req The request to parse the cookies of.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int request_parse_cookies(vla_request *req)
+{
+    if (req->priv->parsed & PARSED_COOKIES)
+    {
+        return 0;
+    }
+    req->priv->parsed |= PARSED_COOKIES;
+
     if (request_add_cookies(req))
     {
         /* TODO: Logging. */
         return -1;
     }
-
     return 0;
 }
 
@@ -732,19 +1240,14 @@ static int request_populate(vla_context *ctx, vla_request *req)
  *==============================================================================
  */
 
-const vla_request *request_new(vla_context *ctx, FCGX_Request *f_req)
+vla_request *request_alloc(void *mem_ctx)
 {
-    static const vla_middleware_func no_middleware[] = {NULL};
-    static const void *no_middleware_args[] = {NULL};
-
-    vla_request *req = talloc(ctx, vla_request);
+    vla_request *req = talloc_zero(mem_ctx, vla_request);
     if (req == NULL)
     {
         return NULL;
     }
-    talloc_set_destructor(req, request_destructor);
-    talloc_set_name_const(req, "Request not yet processed");
-    bzero(req, sizeof(vla_request));
+    talloc_set_name_const(req, "Valhalla Request");
 
     req->priv = talloc(req, vla_request_private);
     if (req->priv == NULL)
@@ -754,78 +1257,111 @@ const vla_request *request_new(vla_context *ctx, FCGX_Request *f_req)
         return NULL;
     }
     *req->priv = (vla_request_private) {
-        .f_req = f_req,
+        .arena = talloc_pool(req, REQUEST_POOL_SIZE),
 
-        .req_hdr_map = kh_init(strcase),
         .query_map = kh_init(str),
         .cookie_map = kh_init(str),
-        .req_body = NULL,
-        .req_body_len = 0,
 
-        .res_status = 0,
-        .res_hdr_map = kh_init(strcase),
         .res_body = sdsempty(),
 
-        .mw_i = 0,
+        .route_cache = route_cache_new(req),
     };
-    if (req->priv->req_hdr_map == NULL ||
+    talloc_set_destructor(req, request_destructor);
+    if (req->priv->arena == NULL ||
         req->priv->query_map == NULL ||
         req->priv->cookie_map == NULL ||
-        req->priv->res_hdr_map == NULL ||
-        req->priv->res_body == NULL)
+        req->priv->res_body == NULL ||
+        req->priv->route_cache == NULL)
     {
         /* TODO Logging */
         talloc_free(req);
         return NULL;
     }
-    if (request_populate(ctx, req))
+
+    return req;
+}
+
+int request_init(vla_request *req, vla_context *ctx, fcgi_request *f_req)
+{
+    req->priv->f_req = f_req;
+    if (req->priv->res_body == NULL)
     {
         /* TODO Logging */
-        talloc_free(req);
-        return NULL;
+        return -1;
     }
-    req->priv->info = context_get_route(ctx, req->document_uri, req->method);
-    if (vla_response_set_status_code(req, 200))
+    if (request_populate(req))
     {
-        /* TODO error logging */
-        talloc_free(req);
-        return NULL;
+        /* TODO Logging */
+        return -1;
     }
-
-    const char *name = talloc_set_name(
-        req, "Request from %s:%s", req->remote_addr, req->remote_port
+    req->priv->info = context_get_route(
+        ctx,
+        req->document_uri,
+        req->method,
+        &req->priv->match,
+        req->priv->route_cache
     );
-    if (name == NULL)
+    if (vla_response_set_status_code(req, 200))
     {
         /* TODO error logging */
-        return NULL;
+        return -1;
     }
 
-    return req;
+    return 0;
 }
 
-int response_header_iterate(
-    const vla_request *req,
-    int (*callback)(const char *, const char *, void *),
-    void *arg)
+void request_reset(vla_request *req)
 {
-    khash_t(strcase) *map = req->priv->res_hdr_map;
-    for (khiter_t it = 0; it < kh_end(map); ++it)
+    vla_request_private *priv = req->priv;
+
+    /* Everything the maps point to lives in the arena. */
+    talloc_free_children(priv->arena);
+    clear_str_map(priv->query_map);
+    clear_str_map(priv->cookie_map);
+    clear_header_list(&priv->req_hdrs);
+    clear_header_list(&priv->res_hdrs);
+
+    if (priv->res_body == NULL)
     {
-        if (!kh_exist(map, it))
-        {
-            continue;
-        }
-        header_array *ha = kh_val(map, it);
-        for (size_t i = 0; i < ha->size; ++i)
+        /* A failed append lost the buffer. */
+        priv->res_body = sdsempty();
+    }
+    else
+    {
+        sdsclear(priv->res_body);
+        if (sdsalloc(priv->res_body) > RES_BODY_KEEP_SIZE)
         {
-            if (callback(kh_key(map, it), ha->arr[i], arg))
+            sds shrunk = sdsRemoveFreeSpace(priv->res_body);
+            if (shrunk)
             {
-                return -1;
+                priv->res_body = shrunk;
             }
         }
     }
-    return 0;
+
+    priv->f_req = NULL;
+    priv->parsed = 0;
+    priv->req_body = NULL;
+    priv->req_body_len = 0;
+    priv->res_status = 0;
+    priv->info = NULL;
+    priv->match = (route_match) {0};
+    priv->mw_i = 0;
+
+    *req = (vla_request) {.priv = priv};
+}
+
+const route_match *request_get_route_match(const vla_request *req)
+{
+    return &req->priv->match;
+}
+
+int response_header_iterate(
+    const vla_request *req,
+    int (*callback)(const char *, const char *, void *),
+    void *arg)
+{
+    return header_iterate(&req->priv->res_hdrs, callback, arg) ? -1 : 0;
 }
 
 const char *response_get_body(const vla_request *req)
@@ -848,8 +1384,57 @@ size_t response_get_body_length(const vla_request *req)
  *==============================================================================
  */
 
+const char *vla_request_param_get(
+    const vla_request *req,
+    const char *name,
+    size_t *len)
+{
+    const route_info_t *info = req->priv->info;
+    size_t n = vla_request_param_count(req);
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (strcmp(info->params[i], name) == 0)
+        {
+            return vla_request_param_get_index(req, i, len);
+        }
+    }
+    return NULL;
+}
+
+const char *vla_request_param_get_index(
+    const vla_request *req,
+    size_t i,
+    size_t *len)
+{
+    if (i >= vla_request_param_count(req))
+    {
+        return NULL;
+    }
+    const route_capture *cap = &req->priv->match.captures[i];
+    if (len)
+    {
+        *len = cap->len;
+    }
+    return req->document_uri + cap->offset;
+}
+
+size_t vla_request_param_count(const vla_request *req)
+{
+    const vla_request_private *priv = req->priv;
+    if (priv->info == NULL || priv->match.type == ROUTE_MATCH_NONE)
+    {
+        return 0;
+    }
+    return priv->info->n_params < priv->match.n_captures ?
+        priv->info->n_params : priv->match.n_captures;
+}
+
 const char *vla_request_query_get(const vla_request *req, const char *key)
 {
+    if (request_parse_query((vla_request *)req))
+    {
+        return NULL;
+    }
     khash_t(str) *map = req->priv->query_map;
     khiter_t it = kh_get(str, map, key);
     if (it == kh_end(map))
@@ -864,6 +1449,10 @@ int vla_request_query_iterate(
     int (*callback)(const char *, const char *, void *),
     void *arg)
 {
+    if (request_parse_query((vla_request *)req))
+    {
+        return 1;
+    }
     khash_t(str) *map = req->priv->query_map;
     for (khiter_t it = 0; it < kh_end(map); ++it)
     {
@@ -880,13 +1469,28 @@ int vla_request_query_iterate(
 
 const char *vla_request_header_get(const vla_request *req, const char *header)
 {
-    khiter_t it = kh_get(strcase, req->priv->req_hdr_map, header);
-    if (it == kh_end(req->priv->req_hdr_map))
+    if (request_parse_headers((vla_request *)req))
+    {
+        return NULL;
+    }
+    header_list *list = &req->priv->req_hdrs;
+    size_t pos = header_find(list, header_ref_name(header), 0);
+    return pos < list->size ? list->fields[pos].value : NULL;
+}
+
+const char *vla_request_header_get_id(
+    const vla_request *req,
+    enum vla_header id)
+{
+    if (id == VLA_HDR_UNKNOWN ||
+        (unsigned)id >= VLA_HDR_SIZE ||
+        request_parse_headers((vla_request *)req))
     {
         return NULL;
     }
-    header_array *ha = kh_val(req->priv->req_hdr_map, it);
-    return ha->arr[0];
+    header_list *list = &req->priv->req_hdrs;
+    size_t pos = header_next(list, 0, header_ref_id(id));
+    return pos < list->size ? list->fields[pos].value : NULL;
 }
 
 int vla_request_header_iterate(
@@ -894,22 +1498,19 @@ int vla_request_header_iterate(
     int (*callback)(const char *, const char *, void *),
     void *arg)
 {
-    khash_t(strcase) *map = req->priv->req_hdr_map;
-    for (khiter_t it = 0; it < kh_end(map); ++it)
+    if (request_parse_headers((vla_request *)req))
     {
-        if (kh_exist(map, it))
-        {
-            if (callback(kh_key(map, it), kh_val(map, it), arg))
-            {
-                return 1;
-            }
-        }
+        return 1;
     }
-    return 0;
+    return header_iterate(&req->priv->req_hdrs, callback, arg);
 }
 
 const char *vla_request_cookie_get(const vla_request *req, const char *name)
 {
+    if (request_parse_cookies((vla_request *)req))
+    {
+        return NULL;
+    }
     khiter_t it = kh_get(str, req->priv->cookie_map, name);
     if (it == kh_end(req->priv->cookie_map))
     {
@@ -923,6 +1524,10 @@ int vla_request_cookie_iterate(
     int (*callback)(const char *, const char *, void *),
     void *arg)
 {
+    if (request_parse_cookies((vla_request *)req))
+    {
+        return 1;
+    }
     khash_t(str) *map = req->priv->cookie_map;
     for (khiter_t it = 0; it < kh_end(map); ++it)
     {
@@ -947,12 +1552,12 @@ const char *vla_request_body_get(const vla_request *req, size_t size)
 
     if (!priv->req_body)
     {
-        priv->req_body = talloc_array(req, char, size + 1);
+        priv->req_body = talloc_array(priv->arena, char, size + 1);
         if (priv->req_body == NULL)
         {
             return NULL;
         }
-        priv->req_body_len = FCGX_GetStr(priv->req_body, size, priv->f_req->in);
+        priv->req_body_len = fcgi_request_read(priv->f_req, priv->req_body, size);
         priv->req_body[priv->req_body_len] = '\0';
     }
     return priv->req_body;
@@ -965,14 +1570,22 @@ size_t vla_request_body_get_length(const vla_request *req)
 
 size_t vla_request_body_chunk(const vla_request *req, void *buffer, size_t cap)
 {
-    FCGX_Request *f_req = req->priv->f_req;
-    char *buf = buffer;
-    return FCGX_GetStr(buf, cap, f_req->in);
+    return fcgi_request_read(req->priv->f_req, buffer, cap);
 }
 
 const char *vla_request_getenv(const vla_request *req, const char *var)
 {
-    return FCGX_GetParam(var, req->priv->f_req->envp);
+    size_t var_len = strlen(var);
+    for (const char *const *str = fcgi_request_envp(req->priv->f_req);
+         *str;
+         ++str)
+    {
+        if (strncmp(*str, var, var_len) == 0 && (*str)[var_len] == '=')
+        {
+            return *str + var_len + 1;
+        }
+    }
+    return NULL;
 }
 
 int vla_request_env_iterate(
@@ -980,22 +1593,18 @@ int vla_request_env_iterate(
     int (*callback)(const char *, const char *, void *),
     void *arg)
 {
-    for (const char **str = (const char **)req->priv->f_req->envp; *str; ++str)
+    for (const char *const *str = fcgi_request_envp(req->priv->f_req);
+         *str;
+         ++str)
     {
         const char *val = strchr(*str, '=') + 1;
         assert(val != NULL + 1);
         size_t key_len = val - *str - 1;
-        char *key = talloc_array(req, char, key_len + 1);
-        if (key == NULL)
-        {
-            return -1;
-        }
-        strncpy(key, *str, key_len);
+        char key[key_len + 1];
+        memcpy(key, *str, key_len);
         key[key_len] = '\0';
 
-        int ret = callback(key, val, arg);
-        talloc_free(key);
-        if (ret)
+        if (callback(key, val, arg))
         {
             return 1;
         }
@@ -1041,7 +1650,13 @@ int vla_response_header_add(
     const char *value,
     size_t *ind)
 {
-    return header_add((void *)req, req->priv->res_hdr_map, header, value, ind);
+    return header_add(
+        (vla_request *)req,
+        &req->priv->res_hdrs,
+        header_ref_name(header),
+        value,
+        ind
+    );
 }
 
 int vla_response_header_replace(
@@ -1050,25 +1665,25 @@ int vla_response_header_replace(
     const char *value,
     size_t i)
 {
-    khash_t(strcase) *map = req->priv->res_hdr_map;
-
-    khiter_t it = kh_get(strcase, map, header);
-    if (it == kh_end(map))
+    header_list *list = &req->priv->res_hdrs;
+    header_ref ref = header_ref_name(header);
+    size_t pos = header_find(list, ref, i);
+    if (pos == list->size)
     {
         return -1;
     }
-
-    header_array *ha = kh_val(map, it);
-    if (i >= ha->size)
+    char *t_val = su_tstrdup(req->priv->arena, value);
+    if (t_val == NULL)
     {
         return -1;
     }
-    char *t_val = su_tstrdup(NULL, value);
-    if (t_val == NULL)
+    /* The old value may own the name. */
+    if (ref.key >= HEADER_KEY_OTHER)
     {
-        return -1;
+        talloc_steal(t_val, list->fields[pos].name);
     }
-    header_array_replace(ha, i, t_val);;
+    talloc_free((char *)list->fields[pos].value);
+    list->fields[pos].value = t_val;
 
     return 0;
 }
@@ -1078,23 +1693,11 @@ int vla_response_header_replace_all(
     const char *header,
     const char *value)
 {
-    khash_t(strcase) *map = req->priv->res_hdr_map;
-
-    khiter_t it = kh_get(strcase, map, header);
-    if (it == kh_end(map))
-    {
-        return vla_response_header_add(req, header, value, NULL);
-    }
-
-    header_array *ha = kh_val(map, it);
-    header_array_clear(ha);
-    char *t_val = su_tstrdup(NULL, value);
-    if (t_val == NULL)
-    {
-        /* TODO Error Logging */
-        return -1;
-    }
-    if (header_array_push(ha, t_val))
+    if (header_replace_all(
+            (vla_request *)req,
+            &req->priv->res_hdrs,
+            header_ref_name(header),
+            value))
     {
         /* TODO Error Logging */
         return -1;
@@ -1108,12 +1711,28 @@ int vla_response_header_remove(
     const char *header,
     size_t i)
 {
-    return header_remove(req->priv->res_hdr_map, header, i);
+    header_list *list = &req->priv->res_hdrs;
+    size_t pos = header_find(list, header_ref_name(header), i);
+    if (pos == list->size)
+    {
+        return -1;
+    }
+    header_remove_at(list, pos);
+    return 0;
 }
 
 int vla_response_header_remove_all(const vla_request *req, const char *header)
 {
-    return header_remove_all(req->priv->res_hdr_map, header);
+    header_list *list = &req->priv->res_hdrs;
+    header_ref ref = header_ref_name(header);
+    size_t pos = header_find(list, ref, 0);
+    if (pos == list->size)
+    {
+        return -1;
+    }
+    header_remove_rest(list, ref, pos);
+    header_remove_at(list, pos);
+    return 0;
 }
 
 const char *vla_response_header_get(
@@ -1121,28 +1740,20 @@ const char *vla_response_header_get(
     const char *header,
     size_t i)
 {
-    khiter_t it = kh_get(strcase, req->priv->res_hdr_map, header);
-    if (it == kh_end(req->priv->res_hdr_map))
+    header_list *list = &req->priv->res_hdrs;
+    size_t pos = header_find(list, header_ref_name(header), i);
+    if (pos == list->size)
     {
         return NULL;
     }
-    header_array *ha = kh_val(req->priv->res_hdr_map, it);
-    if (i >= ha->size)
-    {
-        return NULL;
-    }
-    return su_tstrdup((void *)req, ha->arr[i]);
+    return su_tstrdup(req->priv->arena, list->fields[pos].value);
 }
 
 size_t vla_response_header_count(const vla_request *req, const char *header)
 {
-    khiter_t it = kh_get(strcase, req->priv->res_hdr_map, header);
-    if (it == kh_end(req->priv->res_hdr_map))
-    {
-        return 0;
-    }
-    header_array *ha = kh_val(req->priv->res_hdr_map, it);
-    return ha->size;
+    return header_count(
+        (header_list *)&req->priv->res_hdrs, header_ref_name(header)
+    );
 }
 
 int vla_response_set_status_code(const vla_request *req, unsigned int code)
@@ -1151,7 +1762,12 @@ int vla_response_set_status_code(const vla_request *req, unsigned int code)
     char buf[33];
     snprintf(buf, sizeof(buf) - 1, "%u", code);
     buf[sizeof(buf) - 1] = '\0';
-    return vla_response_header_replace_all(req, "Status", buf);
+    return header_replace_all(
+        (vla_request *)req,
+        &req->priv->res_hdrs,
+        header_ref_id(VLA_HDR_STATUS),
+        buf
+    );
 }
 
 unsigned int vla_response_get_status_code(const vla_request *req)
@@ -1161,12 +1777,23 @@ unsigned int vla_response_get_status_code(const vla_request *req)
 
 int vla_response_set_content_type(const vla_request *req, const char *type)
 {
-    return vla_response_header_replace_all(req, "Content-Type", type);
+    return header_replace_all(
+        (vla_request *)req,
+        &req->priv->res_hdrs,
+        header_ref_id(VLA_HDR_CONTENT_TYPE),
+        type
+    );
 }
 
 const char *vla_response_get_content_type(const vla_request *req)
 {
-    return vla_response_header_get(req, "Content-Type", 0);
+    const header_list *list = &req->priv->res_hdrs;
+    size_t pos = header_next(list, 0, header_ref_id(VLA_HDR_CONTENT_TYPE));
+    if (pos == list->size)
+    {
+        return NULL;
+    }
+    return su_tstrdup(req->priv->arena, list->fields[pos].value);
 }
 
 int vla_response_set_cookie(const vla_request *req, const vla_cookie_t *cookie)
@@ -1248,7 +1875,13 @@ int vla_response_set_cookie(const vla_request *req, const vla_cookie_t *cookie)
             return -1;
         }
     }
-    int ret = vla_response_header_add(req, "Set-Cookie", buf, NULL);
+    int ret = header_add(
+        (vla_request *)req,
+        &req->priv->res_hdrs,
+        header_ref_id(VLA_HDR_SET_COOKIE),
+        buf,
+        NULL
+    );
     sdsfree(buf);
     return ret;
 }
@@ -1326,23 +1959,47 @@ int vla_write(const vla_request *req, const char *data, size_t len)
     return 0;
 }
 
-int vla_eprintf(const vla_request *req, const char *fmt, ...)
+int vla_write_url_encoded(const vla_request *req, const char *data, size_t len)
 {
-    va_list ap;
-    va_start(ap, fmt);
-    if (FCGX_VFPrintF(req->priv->f_req->err, fmt, ap) < 0)
+    if (req->priv->res_body == NULL)
     {
         return -1;
     }
-    va_end(ap);
+    sds body = su_url_encode_cat(req->priv->res_body, data, len);
+    if (body == NULL)
+    {
+        return -1;
+    }
+    req->priv->res_body = body;
     return 0;
 }
 
-int vla_eputs(const vla_request *req, const char *s)
+int vla_eprintf(const vla_request *req, const char *fmt, ...)
 {
-    if (FCGX_PutS(s, req->priv->f_req->err) < 0)
+    sds msg = sdsempty();
+    if (msg == NULL)
     {
         return -1;
     }
-    return 0;
+    va_list ap;
+    va_start(ap, fmt);
+    sds tmp = sdscatvprintf(msg, fmt, ap);
+    va_end(ap);
+    if (tmp == NULL)
+    {
+        sdsfree(msg);
+        return -1;
+    }
+    msg = tmp;
+
+    struct iovec iov = {.iov_base = msg, .iov_len = sdslen(msg)};
+    int ret = fcgi_request_write(req->priv->f_req, FCGI_STDERR, &iov, 1);
+    sdsfree(msg);
+    return ret;
+}
+
+int vla_eputs(const vla_request *req, const char *s)
+{
+    struct iovec iov = {.iov_base = (void *)s, .iov_len = strlen(s)};
+    return fcgi_request_write(req->priv->f_req, FCGI_STDERR, &iov, 1);
 }
\ No newline at end of file
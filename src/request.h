@@ -30,19 +30,53 @@
 
 #include "include/valhalla.h"
 
-typedef struct FCGX_Request FCGX_Request;
+#include "route.h"
+
+typedef struct fcgi_request fcgi_request;
+
+/**
+ * Allocates a vla_request that can be reused for any number of requests. The
+ * request is empty until request_init() is called.
+ *
+ * @param mem_ctx The talloc context this request should be a child of. Must not
+ *                be shared with other threads.
+ *
+ * @return A newly allocated vla_request that is a child of mem_ctx. Should be
+ *         freed with talloc_free(). NULL on error.
+ */
+vla_request *request_alloc(void *mem_ctx);
 
 /**
- * Initializes a new vla_request.
+ * Fills an empty vla_request with the information of a FastCGI request.
  *
- * @param ctx The vla_context that this request is a child of.
+ * @param req A request from request_alloc() that is empty.
+ *
+ * @param ctx The vla_context containing the route information.
  *
  * @param f_req The FastCGI request tied to this request.
  *
- * @return A newly allocated vla_request that is a child of ctx. Should be freed
- *         with talloc_free(). NULL on error.
+ * @return 0 on success, -1 on error. request_reset() must be called in both
+ *         cases before the request is used again.
+ */
+int request_init(vla_request *req, vla_context *ctx, fcgi_request *f_req);
+
+/**
+ * Empties a vla_request so it can be used for another FastCGI request. Memory
+ * allocated for the previous request is released, but the hash maps and the
+ * response body keep their capacity unless they grew unusually large.
+ *
+ * @param req The request to reset.
+ */
+void request_reset(vla_request *req);
+
+/**
+ * Gets details about how the handlers of a request were found.
+ *
+ * @param req An initialized request.
+ *
+ * @return The route match. Belongs to the request.
  */
-const vla_request *request_new(vla_context *ctx, FCGX_Request *f_req);
+const route_match *request_get_route_match(const vla_request *req);
 
 /**
  * Iterates through every response header and value.
@@ -30,16 +30,17 @@
 #include <assert.h>
 #include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 
 #include <talloc.h>
 
-#include "containers/khash.h"
 #include "strutil.h"
 
-KHASH_INIT(cn, char, route_node_t *, 1, kh_int_hash_func, kh_int_hash_equal)
-
-/* Used for easily converting vla_http_method flags into lookups. */
+/* Used for easily converting vla_http_method flags into lookups. Each value is
+ * the index of the method's bit in vla_http_method, so a flag is converted with
+ * a count of its trailing zeros.
+ */
 enum http_method_lookup
 {
     HTTP_GET     = 0,
@@ -55,48 +56,210 @@ enum http_method_lookup
     HTTP_SIZE,
 };
 
+/* The vla_http_method flags that have a lookup. */
+#define HTTP_MASK ((1u << HTTP_SIZE) - 1)
+
+/* The names of the methods, indexed by http_method_lookup. */
+static const char *const method_names[HTTP_SIZE] = {
+    [HTTP_GET]     = "GET",
+    [HTTP_HEAD]    = "HEAD",
+    [HTTP_POST]    = "POST",
+    [HTTP_PUT]     = "PUT",
+    [HTTP_DELETE]  = "DELETE",
+    [HTTP_CONNECT] = "CONNECT",
+    [HTTP_OPTIONS] = "OPTIONS",
+    [HTTP_TRACE]   = "TRACE",
+    [HTTP_PATCH]   = "PATCH",
+};
+
+/* The longest Allow header, used for sizing buffers. */
+#define ALLOW_ALL "GET, HEAD, POST, PUT, DELETE, CONNECT, OPTIONS, TRACE, PATCH"
+
+/* The route infos of a route, one per method. */
+typedef struct method_table
+{
+    /* Route infos indexed into via the http_method_lookup enum. */
+    route_info_t *infos[HTTP_SIZE];
+
+    /* The Allow header of a 405 response to the route. NULL if there are no
+     * route infos.
+     */
+    char *allow;
+} method_table;
+
 /* Describes the type of node. */
 enum node_type
 {
     /* Only exact routes should end up on this node. */
     NODE_EXACT,
 
-    /* Capture everything up to the end of the string or the next '/'. */
+    /* Capture everything after the node's prefix up to the end of the string
+     * or the next '/'.
+     */
     NODE_CAPTURE,
 
     /* This node has no children because everything that reaches it matches. */
     NODE_ALL,
 };
 
-/* Node in the route tree. */
+/* The alignment of the first node of a frozen route tree. */
+#define TABLE_ALIGN 64
+
+/* Marks a frozen node that has no route infos. */
+#define NO_INFOS UINT32_MAX
+
+/* A node of a frozen route tree. */
+typedef struct flat_node
+{
+    /* The offset of the node's prefix in the table's characters. */
+    uint32_t prefix;
+
+    /* The length of the prefix. */
+    uint32_t prefix_len;
+
+    /* The offset of the first characters of the children's prefixes in the
+     * table's characters.
+     */
+    uint32_t firsts;
+
+    /* The index of the first child. A node's children are stored next to each
+     * other.
+     */
+    uint32_t children;
+
+    /* The index of the node's method table, NO_INFOS if it has no route
+     * infos.
+     */
+    uint32_t methods;
+
+    /* The number of children. */
+    uint16_t n_children;
+
+    /* The node's enum node_type. */
+    uint8_t type;
+} flat_node;
+
+/* The route tree compiled into a single block of memory by route_freeze(). The
+ * nodes are laid out breadth first, followed by the method tables and the
+ * characters.
+ */
+typedef struct route_table
+{
+    /* The nodes. The root is the first. */
+    const flat_node *nodes;
+
+    /* The method tables of every node that has route infos. */
+    const method_table *methods;
+
+    /* The prefixes and first characters of every node. */
+    const char *chars;
+} route_table;
+
+/* The number of slots in a route cache. Must be a power of two. */
+#define CACHE_SLOTS 256
+
+/* The longest route a route cache holds. */
+#define CACHE_KEY_MAX 96
+
+/* A cached route lookup. */
+typedef struct cache_slot
+{
+    /* The length of the route. 0 if the slot is empty. */
+    size_t len;
+
+    /* The hash of the route. */
+    uint32_t hash;
+
+    /* The method of the lookup. */
+    enum vla_http_method method;
+
+    /* The result of the lookup. */
+    const route_info_t *info;
+
+    /* The match of the lookup. */
+    route_match match;
+
+    /* The route. Not NULL terminated. */
+    char route[CACHE_KEY_MAX];
+} cache_slot;
+
+typedef struct route_cache
+{
+    /* The id of the route tree the slots were filled from. */
+    uint64_t root_id;
+
+    /* The slots, indexed by the hash of the route and method. */
+    cache_slot slots[CACHE_SLOTS];
+} route_cache;
+
+/* The smallest number of slots in the static route hash. */
+#define STATIC_MIN_SLOTS 16
+
+/* A route without captures or match alls in the static route hash. */
+typedef struct static_route
+{
+    /* The full route. NULL if the slot is empty. */
+    const char *path;
+
+    /* The length of the route. */
+    size_t len;
+
+    /* The hash of the route. */
+    uint32_t hash;
+
+    /* The method table of the route's node in the tree. */
+    const method_table *methods;
+} static_route;
+
+/* Node in the route tree. Each node consumes a run of characters, its prefix,
+ * and its type decides what happens to the route after the prefix.
+ */
 typedef struct route_node_t
 {
-    /* An array of route infos indexed into via the http_method_lookup enum. */
-    route_info_t *infos[HTTP_SIZE];
+    /* The route infos of the route ending at this node. */
+    method_table methods;
 
     /* Describes what type of node this is. Determines what kind of children it
      * has.
      */
     enum node_type type;
 
-    /* Map containing all this node's children. Will be NULL is type is
-     * NODE_ALL.
+    /* The number of children. */
+    size_t n_children;
+
+    /* The first character of each child's prefix in ascending order. Kept apart
+     * from the children so finding the right child only touches this array.
      */
-    khash_t(cn) *map;
-} route_node_t;
+    char *firsts;
 
-/**
- * Destructs a route_node_t.
- *
- * @param node The route_node_t to destruct.
- *
- * @return Always 0.
- */
-static int destruct_route_node(route_node_t *node)
-{
-    kh_destroy(cn, node->map);
-    return 0;
-}
+    /* The children, in the same order as firsts. */
+    struct route_node_t **children;
+
+    /* The frozen copy of the tree route_get uses. Only set on the root, and
+     * only between route_freeze() and the next route_add().
+     */
+    route_table *table;
+
+    /* An open addressing hash of every static route, checked before the tree.
+     * Only set on the root. The number of slots is a power of two.
+     */
+    static_route *statics;
+
+    /* The number of routes in statics. */
+    size_t n_statics;
+
+    /* A number no other route tree of the process has. Only set on the root.
+     * Lets route caches tell trees apart even if one is allocated where
+     * another was freed.
+     */
+    uint64_t id;
+
+    /* The length of the prefix. */
+    size_t prefix_len;
+
+    /* The characters this node consumes. Empty for the root. */
+    char prefix[];
+} route_node_t;
 
 /**
  * Initializes a route_node_t.
@@ -106,39 +269,167 @@ static int destruct_route_node(route_node_t *node)
  *
  * @param type The type of the route node. Specifies behavior in the tree.
  *
- * @return An empty route node. NULL on error.
+ * @param prefix The characters the node consumes. Doesn't need to be NULL
+ *               terminated.
+ *
+ * @param prefix_len The length of prefix.
+ *
+ * @return A route node without children. NULL on error.
  */
-static route_node_t *init_route_node(void *parent, enum node_type type)
+static route_node_t *init_route_node(
+    void *parent,
+    enum node_type type,
+    const char *prefix,
+    size_t prefix_len)
 {
-    route_node_t *node = talloc(parent, route_node_t);
+    route_node_t *node = talloc_named_const(
+        parent, offsetof(route_node_t, prefix) + prefix_len + 1, "route_node_t"
+    );
     if (node == NULL)
     {
         /* TODO Logging */
         return NULL;
     }
-    talloc_set_destructor(node, destruct_route_node);
-    bzero(node, sizeof(route_node_t));
+    bzero(node, offsetof(route_node_t, prefix));
     node->type = type;
-    switch (type)
-    {
-    case NODE_EXACT:
-    case NODE_CAPTURE:
-    default:
-        node->map = kh_init(cn);
-        if (node->map == NULL)
-        {
-            /* TODO Logging */
-            talloc_free(node);
-            return NULL;
-        }
-        break;
-    }
+    node->prefix_len = prefix_len;
+    memcpy(node->prefix, prefix, prefix_len);
+    node->prefix[prefix_len] = '\0';
     return node;
 }
 
 route_node_t *route_init_root(void *ctx)
 {
-    return init_route_node(ctx, NODE_EXACT);
+    static uint64_t next_id = 1;
+
+    route_node_t *root = init_route_node(ctx, NODE_EXACT, "", 0);
+    if (root)
+    {
+        root->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    }
+    return root;
+}
+
+/**
+ * Gets the index a child starting with a character has, or would have, in a
+ * node's children.
+ *
+ * @param node The parent node.
+ *
+ * @param c The first character of the child's prefix.
+ *
+ * @return The index of the first child whose prefix starts with c or a greater
+ *         character.
+ */
+static size_t child_index(const route_node_t *node, char c)
+{
+    size_t i = 0;
+    while (i < node->n_children && node->firsts[i] < c)
+    {
+        ++i;
+    }
+    return i;
+}
+
+/**
+ * Gets the child of a node whose prefix starts with a character.
+ *
+ * @param node The parent node.
+ *
+ * @param c The first character of the child's prefix.
+ *
+ * @return The child, NULL if there is none.
+ */
+static route_node_t *find_child(const route_node_t *node, char c)
+{
+    size_t i = child_index(node, c);
+    if (i < node->n_children && node->firsts[i] == c)
+    {
+        return node->children[i];
+    }
+    return NULL;
+}
+
+/**
+ * Inserts a child into a node, keeping the children sorted. There must not be
+ * a child whose prefix starts with the same character.
+ *
+ * @param node The parent node.
+ *
+ * @param child The child to add. Becomes a talloc child of node.
+ *
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+static int add_child(route_node_t *node, route_node_t *child)
+{
+    size_t n = node->n_children;
+    char *firsts = talloc_realloc(node, node->firsts, char, n + 1);
+    if (firsts == NULL)
+    {
+        /* TODO Logging */
+        return -1;
+    }
+    node->firsts = firsts;
+
+    route_node_t **children = talloc_realloc(
+        node, node->children, route_node_t *, n + 1
+    );
+    if (children == NULL)
+    {
+        /* TODO Logging */
+        return -1;
+    }
+    node->children = children;
+
+    size_t i = child_index(node, child->prefix[0]);
+    memmove(firsts + i + 1, firsts + i, n - i);
+    memmove(children + i + 1, children + i, (n - i) * sizeof(*children));
+    firsts[i] = child->prefix[0];
+    children[i] = child;
+    node->n_children = n + 1;
+
+    talloc_steal(node, child);
+    return 0;
+}
+
+/**
+ * Splits a child so that its first len characters become a node of their own,
+ * with the rest of the child below it.
+ *
+ * @param parent The parent of the child.
+ *
+ * @param child The child to split.
+ *
+ * @param len The length of the new node's prefix. Must be shorter than the
+ *            child's prefix.
+ *
+ * @return The new node, which took the child's place. NULL on error.
+ */
+static route_node_t *split_child(
+    route_node_t *parent,
+    route_node_t *child,
+    size_t len)
+{
+    route_node_t *mid = init_route_node(parent, NODE_EXACT, child->prefix, len);
+    if (mid == NULL)
+    {
+        return NULL;
+    }
+    child->prefix_len -= len;
+    memmove(child->prefix, child->prefix + len, child->prefix_len + 1);
+    if (add_child(mid, child))
+    {
+        /* Undo the split so the tree is left as it was. */
+        memmove(child->prefix + len, child->prefix, child->prefix_len + 1);
+        memcpy(child->prefix, mid->prefix, len);
+        child->prefix_len += len;
+        talloc_free(mid);
+        return NULL;
+    }
+
+    size_t i = child_index(parent, mid->prefix[0]);
+    parent->children[i] = mid;
+    return mid;
 }
 
 /**
@@ -156,83 +447,104 @@ static route_node_t *create_route_path(route_node_t *root, const char *route)
     route_node_t *current = root;
     while (*route)
     {
-        khiter_t it = kh_get(cn, current->map, *route);
-        if (it == kh_end(current->map))
+        route_node_t *next = find_child(current, *route);
+        size_t len = 0;
+        if (next == NULL)
         {
+            /* The new node takes everything up to the next capture or match
+             * all. */
+            len = su_strpbrknul(route + 1, ":*") - route;
             enum node_type type = NODE_EXACT;
-            if (route[1] == ':')
+            if (route[len] == ':')
             {
                 type = NODE_CAPTURE;
             }
-            else if (route[1] == '*')
+            else if (route[len] == '*')
             {
                 type = NODE_ALL;
             }
-            route_node_t *next = init_route_node(current, type);
-            if (next == NULL)
-            {
-                /* TODO Logging */
-                return NULL;
-            }
-
-            int ret;
-            it = kh_put(cn, current->map, *route, &ret);
-            switch (ret)
+            next = init_route_node(current, type, route, len);
+            if (next == NULL || add_child(current, next))
             {
-            case 1: // Key doesn't exist
-                kh_key(current->map, it) = *route;
-                kh_val(current->map, it) = next;
-                break;
-
-            case -1: // Error
                 /* TODO Logging */
+                talloc_free(next);
                 return NULL;
-
-            default: // Key exists (should never happen)
-                assert(0);
             }
-            current = next;
         }
         else
         {
-            current = kh_val(current->map, it);
+            while (len < next->prefix_len && route[len] == next->prefix[len])
+            {
+                ++len;
+            }
+            if (len < next->prefix_len)
+            {
+                next = split_child(current, next, len);
+                if (next == NULL)
+                {
+                    /* TODO Logging */
+                    return NULL;
+                }
+            }
         }
+        current = next;
+        route += len;
 
         switch (current->type)
         {
         case NODE_EXACT:
-            if (route[1] == ':' || route[1] == '*')
+            if (*route == ':' || *route == '*')
             {
                 return NULL;
             }
             break;
 
         case NODE_CAPTURE:
-            if (route[1] != ':')
+            if (*route != ':')
             {
                 return NULL;
             }
-            route = su_strchrnul(++route, '/');
-            if (*route == '\0')
-            {
-                return current;
-            }
-            --route;
+            route = su_strchrnul(route, '/');
             break;
 
         case NODE_ALL:
-            if (route[1] != '*')
+            if (*route != '*')
             {
                 return NULL;
             }
             return current;
         }
-
-        ++route;
     }
     return current;
 }
 
+/**
+ * Skips the section of a route a capture node matches, and records it.
+ *
+ * @param start The start of the route being matched.
+ *
+ * @param route The start of the captured section.
+ *
+ * @param[out] match The match to record the capture in. Can be NULL.
+ *
+ * @return The end of the captured section.
+ */
+static inline const char *capture(
+    const char *start,
+    const char *route,
+    route_match *match)
+{
+    const char *end = su_strchrnul(route, '/');
+    if (match && match->n_captures < ROUTE_MAX_CAPTURES)
+    {
+        match->captures[match->n_captures++] = (route_capture) {
+            .offset = route - start,
+            .len = end - route,
+        };
+    }
+    return end;
+}
+
 /**
  * Get the node associated with a route in the tree.
  *
@@ -240,38 +552,410 @@ static route_node_t *create_route_path(route_node_t *root, const char *route)
  *
  * @param route The route this route info should be associated with.
  *
+ * @param[out] match The match to record captures in. Can be NULL.
+ *
  * @return The route node the route leads to, NULL if it doesn't.
  */
-static route_node_t *get_route_node(route_node_t *root, const char *route)
+static route_node_t *get_route_node(
+    route_node_t *root,
+    const char *route,
+    route_match *match)
 {
+    const char *start = route;
     route_node_t *current = root;
     while (*route)
     {
-        khiter_t it = kh_get(cn, current->map, *route);
-        if (it == kh_end(current->map))
+        current = find_child(current, *route);
+        if (current == NULL ||
+            strncmp(route, current->prefix, current->prefix_len) != 0)
         {
             return NULL;
         }
-        current = kh_val(current->map, it);
+        route += current->prefix_len;
 
         switch (current->type)
         {
+        case NODE_EXACT:
+            break;
+
         case NODE_CAPTURE:
-            route = su_strchrnul(++route, '/');
-            if (*route == '\0')
+            route = capture(start, route, match);
+            break;
+
+        case NODE_ALL:
+            return current;
+        }
+    }
+    return current;
+}
+
+/**
+ * Counts what a frozen copy of a route tree needs room for.
+ *
+ * @param node The root of the tree to count.
+ *
+ * @param[out] n_nodes Incremented by the number of nodes.
+ *
+ * @param[out] n_methods Incremented by the number of nodes with route infos.
+ *
+ * @param[out] n_chars Incremented by the number of prefix and first
+ *                     characters.
+ */
+static void count_nodes(
+    const route_node_t *node,
+    size_t *n_nodes,
+    size_t *n_methods,
+    size_t *n_chars)
+{
+    *n_nodes += 1;
+    *n_chars += node->prefix_len + node->n_children;
+    if (node->methods.allow)
+    {
+        *n_methods += 1;
+    }
+    for (size_t i = 0; i < node->n_children; ++i)
+    {
+        count_nodes(node->children[i], n_nodes, n_methods, n_chars);
+    }
+}
+
+int route_freeze(route_node_t *root)
+{
+    if (root->table)
+    {
+        return 0;
+    }
+
+    size_t n_nodes = 0, n_methods = 0, n_chars = 0;
+    count_nodes(root, &n_nodes, &n_methods, &n_chars);
+    if (n_nodes > UINT32_MAX || n_chars > UINT32_MAX)
+    {
+        return -1;
+    }
+
+    /* The nodes come first so the root starts a cache line. Nodes aren't
+     * padded, so the ones after it can straddle two lines. */
+    size_t nodes_size = n_nodes * sizeof(flat_node);
+    nodes_size += -nodes_size % _Alignof(method_table);
+    size_t methods_size = n_methods * sizeof(method_table);
+    route_table *table = talloc_size(
+        root,
+        sizeof(route_table) + TABLE_ALIGN + nodes_size + methods_size + n_chars
+    );
+    /* Breadth first queue of the tree's nodes. A node's index in the queue is
+     * its index in the table. */
+    route_node_t **queue = talloc_array(NULL, route_node_t *, n_nodes);
+    if (table == NULL || queue == NULL)
+    {
+        /* TODO Logging */
+        talloc_free(table);
+        talloc_free(queue);
+        return -1;
+    }
+    talloc_set_name_const(table, "route_table");
+
+    uintptr_t base = (uintptr_t)(table + 1);
+    flat_node *nodes = (flat_node *)(base + -base % TABLE_ALIGN);
+    method_table *methods = (void *)((char *)nodes + nodes_size);
+    char *chars = (char *)(methods + n_methods);
+
+    size_t tail = 1, methods_i = 0, char_i = 0;
+    queue[0] = root;
+    for (size_t i = 0; i < n_nodes; ++i)
+    {
+        const route_node_t *node = queue[i];
+        flat_node *flat = &nodes[i];
+        *flat = (flat_node) {
+            .prefix = char_i,
+            .prefix_len = node->prefix_len,
+            .firsts = char_i + node->prefix_len,
+            .children = tail,
+            .methods = NO_INFOS,
+            .n_children = node->n_children,
+            .type = node->type,
+        };
+        memcpy(chars + char_i, node->prefix, node->prefix_len);
+        char_i += node->prefix_len + node->n_children;
+
+        if (node->methods.allow)
+        {
+            methods[methods_i] = node->methods;
+            flat->methods = methods_i++;
+        }
+        for (size_t j = 0; j < node->n_children; ++j)
+        {
+            chars[flat->firsts + j] = node->firsts[j];
+            queue[tail++] = node->children[j];
+        }
+    }
+    talloc_free(queue);
+
+    table->nodes = nodes;
+    table->methods = methods;
+    table->chars = chars;
+    root->table = table;
+    return 0;
+}
+
+/**
+ * Gets the method table of a frozen node.
+ *
+ * @param table The frozen route tree.
+ *
+ * @param node The node to get the method table of.
+ *
+ * @return The method table, NULL if the node has no route infos.
+ */
+static inline const method_table *flat_methods(
+    const route_table *table,
+    const flat_node *node)
+{
+    return node->methods == NO_INFOS ? NULL : &table->methods[node->methods];
+}
+
+/**
+ * Gets the method table of a route from a frozen route tree.
+ *
+ * @param table The frozen route tree.
+ *
+ * @param route The route to get the method table of.
+ *
+ * @param[out] match The match to record captures in. Can be NULL.
+ *
+ * @return The method table, NULL if the route doesn't exist.
+ */
+static const method_table *table_get(
+    const route_table *table,
+    const char *route,
+    route_match *match)
+{
+    const char *start = route;
+    const flat_node *nodes = table->nodes;
+    const char *chars = table->chars;
+    const flat_node *node = nodes;
+    while (*route)
+    {
+        const char *firsts = chars + node->firsts;
+        size_t n = node->n_children;
+        size_t i = 0;
+        while (i < n && firsts[i] < *route)
+        {
+            ++i;
+        }
+        if (i == n || firsts[i] != *route)
+        {
+            return NULL;
+        }
+        node = nodes + node->children + i;
+
+        /* The first character is already known to match. Prefixes never hold
+         * a '\0', so the end of the route is a mismatch too. */
+        const char *prefix = chars + node->prefix;
+        size_t len = node->prefix_len;
+        for (size_t j = 1; j < len; ++j)
+        {
+            if (route[j] != prefix[j])
             {
-                return current;
+                return NULL;
             }
-            --route;
+        }
+        route += len;
+
+        switch (node->type)
+        {
+        case NODE_EXACT:
+            break;
+
+        case NODE_CAPTURE:
+            route = capture(start, route, match);
             break;
 
         case NODE_ALL:
-            return current;
+            return flat_methods(table, node);
         }
+    }
+    return flat_methods(table, node);
+}
 
-        ++route;
+/**
+ * Hashes a route with FNV-1a and measures its length in the same pass.
+ *
+ * @param route The route to hash.
+ *
+ * @param[out] len The length of the route.
+ *
+ * @return The hash of the route.
+ */
+static uint32_t hash_route(const char *route, size_t *len)
+{
+    uint32_t hash = 2166136261u;
+    const char *c = route;
+    for (; *c; ++c)
+    {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
     }
-    return current;
+    *len = c - route;
+    return hash;
+}
+
+/**
+ * Finds the slot of a route in the static route hash.
+ *
+ * @param statics The slots of the hash. Must have at least one empty slot.
+ *
+ * @param route The route to find.
+ *
+ * @param len The length of the route.
+ *
+ * @param hash The hash of the route.
+ *
+ * @return The slot holding the route, or the empty slot it belongs in.
+ */
+static static_route *static_slot(
+    static_route *statics,
+    const char *route,
+    size_t len,
+    uint32_t hash)
+{
+    size_t mask = talloc_array_length(statics) - 1;
+    size_t i = hash & mask;
+    while (statics[i].path &&
+           (statics[i].hash != hash ||
+            statics[i].len != len ||
+            memcmp(statics[i].path, route, len) != 0))
+    {
+        i = (i + 1) & mask;
+    }
+    return &statics[i];
+}
+
+/**
+ * Gets the method table of a static route.
+ *
+ * @param root The root of the route tree.
+ *
+ * @param route The route to get the method table of.
+ *
+ * @return The method table, NULL if the route isn't a static route.
+ */
+static const method_table *static_get(route_node_t *root, const char *route)
+{
+    if (root->n_statics == 0)
+    {
+        return NULL;
+    }
+    size_t len;
+    uint32_t hash = hash_route(route, &len);
+    return static_slot(root->statics, route, len, hash)->methods;
+}
+
+/**
+ * Adds a static route to the static route hash, growing it so it stays at
+ * most half full. Does nothing if the route is already in it.
+ *
+ * @param root The root of the route tree.
+ *
+ * @param route The route to add.
+ *
+ * @param node The node of the route in the tree.
+ *
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+static int static_add(route_node_t *root, const char *route, route_node_t *node)
+{
+    size_t len;
+    uint32_t hash = hash_route(route, &len);
+
+    size_t n_slots = root->statics ? talloc_array_length(root->statics) : 0;
+    if ((root->n_statics + 1) * 2 > n_slots)
+    {
+        size_t new_n_slots = n_slots ? n_slots * 2 : STATIC_MIN_SLOTS;
+        static_route *statics = talloc_zero_array(
+            root, static_route, new_n_slots
+        );
+        if (statics == NULL)
+        {
+            /* TODO Logging */
+            return -1;
+        }
+        for (size_t i = 0; i < n_slots; ++i)
+        {
+            static_route *old = &root->statics[i];
+            if (old->path)
+            {
+                *static_slot(statics, old->path, old->len, old->hash) = *old;
+            }
+        }
+        talloc_free(root->statics);
+        root->statics = statics;
+    }
+
+    static_route *slot = static_slot(root->statics, route, len, hash);
+    if (slot->path)
+    {
+        return 0;
+    }
+    char *path = talloc_strndup(node, route, len);
+    if (path == NULL)
+    {
+        /* TODO Logging */
+        return -1;
+    }
+    *slot = (static_route) {
+        .path = path,
+        .len = len,
+        .hash = hash,
+        .methods = &node->methods,
+    };
+    root->n_statics += 1;
+    return 0;
+}
+
+/**
+ * Creates the Allow header of a route. HEAD is allowed along with GET, since
+ * GET route infos handle HEAD requests too.
+ *
+ * @param ctx The talloc context the header should be a child of.
+ *
+ * @param table The method table of the route.
+ *
+ * @param methods The lookup bits of methods that are about to be added to the
+ *                route.
+ *
+ * @return The header. NULL if memory could not be allocated.
+ */
+static char *method_allow(
+    void *ctx,
+    const method_table *table,
+    uint32_t methods)
+{
+    for (size_t i = 0; i < HTTP_SIZE; ++i)
+    {
+        if (table->infos[i])
+        {
+            methods |= 1u << i;
+        }
+    }
+    if (methods & (1u << HTTP_GET))
+    {
+        methods |= 1u << HTTP_HEAD;
+    }
+
+    char allow[sizeof(ALLOW_ALL)];
+    size_t len = 0;
+    for (uint32_t m = methods; m; m &= m - 1)
+    {
+        const char *name = method_names[__builtin_ctz(m)];
+        size_t name_len = strlen(name);
+        if (len)
+        {
+            memcpy(allow + len, ", ", 2);
+            len += 2;
+        }
+        memcpy(allow + len, name, name_len);
+        len += name_len;
+    }
+    return talloc_strndup(ctx, allow, len);
 }
 
 route_info_t *route_info_create(
@@ -304,6 +988,8 @@ route_info_t *route_info_create(
         .hdlr_arg = hdlr_arg,
         .mw = talloc_array(info, vla_middleware_func, mw_len + 1),
         .mw_args = talloc_array(info, void *, mw_len + 1),
+        .params = NULL,
+        .n_params = 0,
     };
     if (info->mw == NULL || info->mw_args == NULL)
     {
@@ -326,6 +1012,38 @@ route_info_t *route_info_create(
     return info;
 }
 
+/**
+ * Counts the captures of a route, and optionally copies their names.
+ *
+ * @param route The route.
+ *
+ * @param[out] names An array to copy the names into, with room for every
+ *                   capture. Each name is a talloc child of the array. Can be
+ *                   NULL.
+ *
+ * @return The number of captures, -1 if a name could not be copied.
+ */
+static ssize_t route_params(const char *route, const char **names)
+{
+    ssize_t n = 0;
+    const char *c = su_strpbrknul(route, ":*");
+    while (*c == ':')
+    {
+        const char *end = su_strchrnul(c + 1, '/');
+        if (names)
+        {
+            names[n] = talloc_strndup(names, c + 1, end - c - 1);
+            if (names[n] == NULL)
+            {
+                return -1;
+            }
+        }
+        ++n;
+        c = su_strpbrknul(end, ":*");
+    }
+    return n;
+}
+
 int route_add(
     route_node_t *root,
     uint32_t methods,
@@ -334,8 +1052,10 @@ int route_add(
     void *hdlr_arg,
     va_list ap)
 {
-    /* Make sure the route starts with a '/' */
-    if (*route != '/')
+    /* Make sure the route starts with a '/' and its captures fit in a
+     * route_match. */
+    ssize_t n_params = route_params(route, NULL);
+    if (*route != '/' || n_params > ROUTE_MAX_CAPTURES)
     {
         return -1;
     }
@@ -348,17 +1068,19 @@ int route_add(
     }
 
     /* Make sure the route doesn't already exist. */
-    if (methods & VLA_HTTP_GET     && node->infos[HTTP_GET]     ||
-        methods & VLA_HTTP_HEAD    && node->infos[HTTP_HEAD]    ||
-        methods & VLA_HTTP_POST    && node->infos[HTTP_POST]    ||
-        methods & VLA_HTTP_PUT     && node->infos[HTTP_PUT]     ||
-        methods & VLA_HTTP_DELETE  && node->infos[HTTP_DELETE]  ||
-        methods & VLA_HTTP_CONNECT && node->infos[HTTP_CONNECT] ||
-        methods & VLA_HTTP_OPTIONS && node->infos[HTTP_OPTIONS] ||
-        methods & VLA_HTTP_TRACE   && node->infos[HTTP_TRACE]   ||
-        methods & VLA_HTTP_PATCH   && node->infos[HTTP_PATCH])
+    methods &= HTTP_MASK;
+    for (uint32_t m = methods; m; m &= m - 1)
     {
-        return 1;
+        if (node->methods.infos[__builtin_ctz(m)])
+        {
+            return 1;
+        }
+    }
+
+    /* Routes without captures or match alls can be found without the tree. */
+    if (*su_strpbrknul(route, ":*") == '\0' && static_add(root, route, node))
+    {
+        return -2;
     }
 
     /* Initialize the route_info_t. */
@@ -367,62 +1089,202 @@ int route_add(
     {
         return -2;
     }
+    char *allow = NULL;
+    if (methods && (allow = method_allow(node, &node->methods, methods)) == NULL)
+    {
+        talloc_free(info);
+        return -2;
+    }
+    if (n_params)
+    {
+        info->params = talloc_array(info, const char *, n_params);
+        if (info->params == NULL || route_params(route, info->params) < 0)
+        {
+            /* TODO Logging */
+            talloc_free(info);
+            talloc_free(allow);
+            return -2;
+        }
+        info->n_params = n_params;
+    }
+
+    /* The frozen tree would miss the new route. Nodes created above have no
+     * route infos, so it matched the same routes until now. */
+    TALLOC_FREE(root->table);
 
     /* Insert the route info into the tree. */
-    if (methods & VLA_HTTP_GET)
-        node->infos[HTTP_GET] = info;
-    if (methods & VLA_HTTP_HEAD)
-        node->infos[HTTP_HEAD] = info;
-    if (methods & VLA_HTTP_POST)
-        node->infos[HTTP_POST] = info;
-    if (methods & VLA_HTTP_PUT)
-        node->infos[HTTP_PUT] = info;
-    if (methods & VLA_HTTP_DELETE)
-        node->infos[HTTP_DELETE] = info;
-    if (methods & VLA_HTTP_CONNECT)
-        node->infos[HTTP_CONNECT] = info;
-    if (methods & VLA_HTTP_OPTIONS)
-        node->infos[HTTP_OPTIONS] = info;
-    if (methods & VLA_HTTP_TRACE)
-        node->infos[HTTP_TRACE] = info;
-    if (methods & VLA_HTTP_PATCH)
-        node->infos[HTTP_PATCH] = info;
+    for (uint32_t m = methods; m; m &= m - 1)
+    {
+        node->methods.infos[__builtin_ctz(m)] = info;
+    }
+    if (allow)
+    {
+        talloc_free(node->methods.allow);
+        node->methods.allow = allow;
+    }
 
     return 0;
 }
 
-const route_info_t *route_get(
-    route_node_t *root,
-    const char *route,
+/**
+ * Gets the route info for a method. HEAD requests are handled by the GET route
+ * info if there is no HEAD route info.
+ *
+ * @param methods The method table of a route.
+ *
+ * @param method The method to get the route info of.
+ *
+ * @return The route info, NULL if there is none for the method.
+ */
+static inline const route_info_t *method_info(
+    const method_table *methods,
     enum vla_http_method method)
 {
-    route_node_t *node = get_route_node(root, route);
-    if (node == NULL)
+    if (method == VLA_HTTP_UNKNOWN || method > VLA_HTTP_PATCH)
     {
         return NULL;
     }
+    const route_info_t *info = methods->infos[__builtin_ctz(method)];
+    if (info == NULL && method == VLA_HTTP_HEAD)
+    {
+        info = methods->infos[HTTP_GET];
+    }
+    return info;
+}
+
+/**
+ * Finds the method table of a route in the frozen tree if there is one,
+ * otherwise in the route tree. The hash of static routes isn't used.
+ *
+ * @param root The root of the route tree.
+ *
+ * @param route The route to find.
+ *
+ * @param[out] match Filled with the route's captures. Can be NULL.
+ *
+ * @return The method table of the route, NULL if no route matches.
+ */
+static inline const method_table *tree_get(
+    route_node_t *root,
+    const char *route,
+    route_match *match)
+{
+    if (root->table)
+    {
+        return table_get(root->table, route, match);
+    }
+    route_node_t *node = get_route_node(root, route, match);
+    return node ? &node->methods : NULL;
+}
+
+const route_info_t *route_lookup(
+    route_node_t *root,
+    const char *route,
+    enum vla_http_method method,
+    route_match *match)
+{
+    if (match)
+    {
+        match->cached = 0;
+        match->n_captures = 0;
+    }
 
-    switch (method)
-    {
-    case VLA_HTTP_GET:
-        return node->infos[HTTP_GET];
-    case VLA_HTTP_HEAD:
-        return node->infos[HTTP_HEAD];
-    case VLA_HTTP_POST:
-        return node->infos[HTTP_POST];
-    case VLA_HTTP_PUT:
-        return node->infos[HTTP_PUT];
-    case VLA_HTTP_DELETE:
-        return node->infos[HTTP_DELETE];
-    case VLA_HTTP_CONNECT:
-        return node->infos[HTTP_CONNECT];
-    case VLA_HTTP_OPTIONS:
-        return node->infos[HTTP_OPTIONS];
-    case VLA_HTTP_TRACE:
-        return node->infos[HTTP_TRACE];
-    case VLA_HTTP_PATCH:
-        return node->infos[HTTP_PATCH];
+    enum route_match_type type = ROUTE_MATCH_STATIC;
+    const method_table *methods = static_get(root, route);
+    if (methods == NULL)
+    {
+        type = ROUTE_MATCH_DYNAMIC;
+        methods = tree_get(root, route, match);
     }
 
-    return NULL;
+    const route_info_t *info = methods ? method_info(methods, method) : NULL;
+    if (match)
+    {
+        match->type = info ? type : ROUTE_MATCH_NONE;
+        match->allow = methods && info == NULL ? methods->allow : NULL;
+    }
+    return info;
+}
+
+route_cache *route_cache_new(void *ctx)
+{
+    /* Empty slots have a length of 0. */
+    return talloc_zero(ctx, route_cache);
+}
+
+/**
+ * Copies a route match, leaving out unused captures.
+ *
+ * @param[out] dst The match to copy to.
+ *
+ * @param src The match to copy.
+ */
+static inline void copy_match(route_match *dst, const route_match *src)
+{
+    dst->type = src->type;
+    dst->allow = src->allow;
+    dst->n_captures = src->n_captures;
+    memcpy(
+        dst->captures, src->captures, src->n_captures * sizeof(route_capture)
+    );
+}
+
+const route_info_t *route_cache_lookup(
+    route_cache *cache,
+    route_node_t *root,
+    const char *route,
+    enum vla_http_method method,
+    route_match *match)
+{
+    if (cache->root_id != root->id)
+    {
+        /* The slots point into another tree, which may be freed already. */
+        for (size_t i = 0; i < CACHE_SLOTS; ++i)
+        {
+            cache->slots[i].len = 0;
+        }
+        cache->root_id = root->id;
+    }
+
+    size_t len;
+    uint32_t hash = hash_route(route, &len);
+    cache_slot *slot = &cache->slots[(hash ^ method) & (CACHE_SLOTS - 1)];
+    if (slot->len == len &&
+        slot->hash == hash &&
+        slot->method == method &&
+        memcmp(slot->route, route, len) == 0)
+    {
+        copy_match(match, &slot->match);
+        match->cached = 1;
+        return slot->info;
+    }
+
+    const route_info_t *info = route_lookup(root, route, method, match);
+    if (len > 0 && len <= CACHE_KEY_MAX)
+    {
+        slot->len = len;
+        slot->hash = hash;
+        slot->method = method;
+        slot->info = info;
+        copy_match(&slot->match, match);
+        memcpy(slot->route, route, len);
+    }
+    return info;
+}
+
+const route_info_t *route_get(
+    route_node_t *root,
+    const char *route,
+    enum vla_http_method method)
+{
+    return route_lookup(root, route, method, NULL);
+}
+
+const route_info_t *route_get_tree(
+    route_node_t *root,
+    const char *route,
+    enum vla_http_method method)
+{
+    const method_table *methods = tree_get(root, route, NULL);
+    return methods ? method_info(methods, method) : NULL;
 }
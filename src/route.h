@@ -32,10 +32,61 @@
 
 #include <stdarg.h>
 #include <stdint.h>
+#include <sys/types.h>
+
+/* The maximum number of captures in a route. */
+#define ROUTE_MAX_CAPTURES 16
+
+/* A cache of route lookups. */
+typedef struct route_cache route_cache;
 
 /* A node in the route tree. Returned as a root outside of route.c. */
 typedef struct route_node_t route_node_t;
 
+/* How a route was found. */
+enum route_match_type
+{
+    /* No route matched. */
+    ROUTE_MATCH_NONE,
+
+    /* The route was found in the static route hash. */
+    ROUTE_MATCH_STATIC,
+
+    /* The route was found by walking the route tree. */
+    ROUTE_MATCH_DYNAMIC,
+};
+
+/* A section of a URI matched by a capture. */
+typedef struct route_capture
+{
+    /* The offset of the section from the start of the URI. */
+    uint32_t offset;
+
+    /* The length of the section. */
+    uint32_t len;
+} route_capture;
+
+/* Details about how a route was matched. */
+typedef struct route_match
+{
+    /* How the route was found. */
+    enum route_match_type type;
+
+    /* Nonzero if the match was taken from a route_cache. */
+    int cached;
+
+    /* The Allow header of a 405 response if the route exists, but not for the
+     * method. NULL otherwise.
+     */
+    const char *allow;
+
+    /* The number of captures. */
+    size_t n_captures;
+
+    /* The sections of the URI matched by each capture, in order. */
+    route_capture captures[ROUTE_MAX_CAPTURES];
+} route_match;
+
 /* Information about a route. */
 typedef struct route_info_t
 {
@@ -50,6 +101,12 @@ typedef struct route_info_t
 
     /* A NULL terminated array of middleware function arguments. */
     void **mw_args;
+
+    /* The names of the route's captures, in order. NULL if it has none. */
+    const char **params;
+
+    /* The number of captures. */
+    size_t n_params;
 } route_info_t;
 
 /**
@@ -103,7 +160,8 @@ route_info_t *route_info_create(
  *           and void * arguments. Terminated with a NULL vla_middleware_func.
  *
  * @return 0 on success, 1 if the route overlaps with another, -1 if the route
- *         doesn't start with '/', -2 if memory could not be allocated.
+ *         doesn't start with '/' or has more than ROUTE_MAX_CAPTURES captures,
+ *         -2 if memory could not be allocated.
  */
 int route_add(
     route_node_t *root,
@@ -113,6 +171,78 @@ int route_add(
     void *hdlr_arg,
     va_list ap);
 
+/**
+ * Compiles the route tree into a single block of memory that route_get() uses
+ * from then on. The next route_add() discards it again, so this should be
+ * called once every route has been added.
+ *
+ * @param root The root of the route tree.
+ *
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int route_freeze(route_node_t *root);
+
+/**
+ * Gets handlers for the route and method, and details about how they were
+ * found. Routes without captures or match alls are found in a hash of the
+ * whole route, everything else in the route tree.
+ * HEAD requests get the GET handlers if the route has no HEAD handlers.
+ * Routes are expected to be URL decoded.
+ *
+ * @param root The root of the route tree.
+ *
+ * @param route The route to get.
+ *
+ * @param method The method of the route to get.
+ *
+ * @param[out] match Details about the match. Can be NULL.
+ *
+ * @return The route_info_t of the route and method if it exists, NULL
+ *         otherwise.
+ */
+const route_info_t *route_lookup(
+    route_node_t *root,
+    const char *route,
+    enum vla_http_method method,
+    route_match *match);
+
+/**
+ * Creates an empty route cache. A route cache is a small direct-mapped cache of
+ * route_lookup() results for repeated URIs. It must only be used by one thread,
+ * and only while no routes are added to the trees it is used with. Using it with
+ * a different route tree empties it.
+ *
+ * @param ctx The talloc context the cache should be a child of.
+ *
+ * @return The cache. NULL if memory could not be allocated.
+ */
+route_cache *route_cache_new(void *ctx);
+
+/**
+ * Gets handlers for the route and method like route_lookup(), but returns the
+ * result of an earlier lookup of the same route and method from the cache if
+ * there is one.
+ *
+ * @param cache The cache.
+ *
+ * @param root The root of the route tree.
+ *
+ * @param route The route to get.
+ *
+ * @param method The method of the route to get.
+ *
+ * @param[out] match Details about the match. Must not be NULL.
+ *
+ * @return The route_info_t of the route and method if it exists, NULL
+ *         otherwise.
+ */
+const route_info_t *route_cache_lookup(
+    route_cache *cache,
+    route_node_t *root,
+    const char *route,
+    enum vla_http_method method,
+    route_match *match);
+
 /**
  * Gets handlers for the route and method.
  * Routes are expected to be URL decoded.
@@ -131,4 +261,24 @@ const route_info_t *route_get(
     const char *route,
     enum vla_http_method method);
 
+/**
+ * Gets handlers for the route and method like route_get(), but always walks
+ * the route tree, or the frozen tree once route_freeze() was called. Static
+ * routes aren't looked up in their hash. Lets benchmarks compare the two trees
+ * on any route.
+ *
+ * @param root The root of the route tree.
+ *
+ * @param route The route to get.
+ *
+ * @param method The method of the route to get.
+ *
+ * @return The route_info_t of the route and method if it exists, NULL
+ *         otherwise.
+ */
+const route_info_t *route_get_tree(
+    route_node_t *root,
+    const char *route,
+    enum vla_http_method method);
+
 #endif // __ROUTE_H__
\ No newline at end of file
@@ -25,20 +25,115 @@
 //
 ////////////////////////////////////////////////////////////////////////////////
 
+/* For strchrnul. */
+#define _GNU_SOURCE
+
 #include "strutil.h"
 
-#include <ctype.h>
+#include <stdint.h>
 #include <string.h>
 
 #include <talloc.h>
 
-const char *su_strchrnul(const char *s, int c)
+#include "buffer/sds.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+
+/* Scanning reads whole aligned blocks, which can run past the terminator into
+ * memory the sanitizers don't consider part of the string. An aligned block
+ * never crosses a page, so the reads themselves are safe. */
+#define SCAN_NO_SANITIZE __attribute__((no_sanitize_address, no_sanitize_thread))
+
+#if defined(__AVX2__)
+/* The size and alignment of the blocks a string is scanned in. */
+#define SCAN_BLOCK 32
+
+/**
+ * Finds the delimiters and nul terminators in an aligned block.
+ *
+ * @param block The block. Must be aligned to SCAN_BLOCK.
+ *
+ * @param delims The nul-terminated set of delimiters.
+ *
+ * @return A mask of the positions in the block that are delimiters or nul.
+ */
+SCAN_NO_SANITIZE static inline uint32_t delim_mask(
+    const char *block,
+    const char *delims)
 {
-    while (*s && *s != c)
+    __m256i c = _mm256_load_si256((const __m256i *)block);
+    __m256i found = _mm256_cmpeq_epi8(c, _mm256_setzero_si256());
+    for (; *delims; ++delims)
     {
-        ++s;
+        found = _mm256_or_si256(
+            found, _mm256_cmpeq_epi8(c, _mm256_set1_epi8(*delims))
+        );
     }
-    return s;
+    return _mm256_movemask_epi8(found);
+}
+#else
+/* The size and alignment of the blocks a string is scanned in. */
+#define SCAN_BLOCK 16
+
+/**
+ * Finds the delimiters and nul terminators in an aligned block.
+ *
+ * @param block The block. Must be aligned to SCAN_BLOCK.
+ *
+ * @param delims The nul-terminated set of delimiters.
+ *
+ * @return A mask of the positions in the block that are delimiters or nul.
+ */
+SCAN_NO_SANITIZE static inline uint32_t delim_mask(
+    const char *block,
+    const char *delims)
+{
+    __m128i c = _mm_load_si128((const __m128i *)block);
+    __m128i found = _mm_cmpeq_epi8(c, _mm_setzero_si128());
+    for (; *delims; ++delims)
+    {
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(c, _mm_set1_epi8(*delims)));
+    }
+    return _mm_movemask_epi8(found);
+}
+#endif
+
+SCAN_NO_SANITIZE const char *su_strpbrknul(const char *s, const char *delims)
+{
+    const char *block = (const char *)((uintptr_t)s & -(uintptr_t)SCAN_BLOCK);
+    /* Ignore whatever precedes the string in its first block. */
+    uint32_t mask = delim_mask(block, delims) & (UINT32_MAX << (s - block));
+    while (mask == 0)
+    {
+        block += SCAN_BLOCK;
+        mask = delim_mask(block, delims);
+    }
+    return block + __builtin_ctz(mask);
+}
+
+#else
+
+const char *su_strpbrknul(const char *s, const char *delims)
+{
+    return s + strcspn(s, delims);
+}
+
+#endif
+
+const char *su_strchrnul(const char *s, int c)
+{
+#ifdef __GLIBC__
+    return strchrnul(s, c);
+#else
+    const char delims[] = { c, '\0' };
+    return su_strpbrknul(s, delims);
+#endif
 }
 
 char *su_tstrndup(void *ctx, const char *str, size_t len)
@@ -79,106 +174,370 @@ char *su_tstrdup(void *ctx, const char *str)
 #define NIBBLE_MASK 0xF
 #define NIBBLE_SHIFT 4
 
+/* The value of every hex character, -1 for every other character. */
+static const signed char hex_values[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
 /**
  * Converts a hex character to its integer value.
  *
- * @param ch The character to convert. Must be a valid 0 - F hex character.
+ * @param ch The character to convert.
  *
- * @return The integer equivalent ch.
+ * @return The integer equivalent of ch, -1 if ch isn't a hex character.
  */
-static char from_hex(char ch)
+static inline int from_hex(char ch)
 {
-    return isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10;
+    /* The table is offset by one so every other entry can be left at 0. */
+    return hex_values[(unsigned char)ch] - 1;
 }
 
 /**
- * Converts an integer value to its hex character.
+ * Counts the characters at the start of a URL-encoded string that decode to
+ * themselves, i.e. every character up to the first '%' or '+'. Scans 32 or 16
+ * characters at a time when AVX2 or SSE2 is available.
+ *
+ * @param str The string to scan.
  *
- * @param code The integer value to convert.
+ * @param len The length of the string.
  *
- * @return A hex character corresponding to the lower four bits of code.
+ * @return The number of characters before the first '%' or '+', len if there
+ *         is none.
  */
-static char to_hex(char code)
+static inline size_t plain_run(const char *str, size_t len)
 {
-    static const char *hex = "0123456789ABCDEF";
-    return hex[code & NIBBLE_MASK];
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i percent = _mm256_set1_epi8('%');
+    const __m256i plus = _mm256_set1_epi8('+');
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(str + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(chunk, percent), _mm256_cmpeq_epi8(chunk, plus)
+        ));
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i percent = _mm_set1_epi8('%');
+    const __m128i plus = _mm_set1_epi8('+');
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(str + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(
+            _mm_cmpeq_epi8(chunk, percent), _mm_cmpeq_epi8(chunk, plus)
+        ));
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while (i < len && str[i] != '%' && str[i] != '+')
+    {
+        ++i;
+    }
+    return i;
 }
 
-char *su_url_encode_l(void *ctx, const char *str, size_t len)
+/**
+ * Decodes a URL-encoded string. Runs of characters that decode to themselves
+ * are copied at once. A '%' that isn't followed by two hex characters within
+ * the string is kept as is.
+ *
+ * @param[out] dst Where the decoded string is written. Can be str itself, since
+ *                 a string never grows when it is decoded.
+ *
+ * @param str The URL-encoded string.
+ *
+ * @param len The length of the string.
+ *
+ * @return The length of the decoded string. dst isn't nul terminated.
+ */
+static size_t url_decode(char *dst, const char *str, size_t len)
 {
-    const char *pstr = str;
-    const char *pstr_end = &str[len];
-    char *buf = talloc_array(ctx, char, len * 3 + 1);
-    if (buf == NULL)
+    size_t in = 0, out = 0;
+    while (in < len)
     {
-        return NULL;
-    }
-    char *pbuf = buf;
-    while (pstr < pstr_end)
-    {
-        if (isalnum(*pstr) ||
-            *pstr == '-' ||
-            *pstr == '_' ||
-            *pstr == '.' ||
-            *pstr == '~')
+        size_t run = plain_run(str + in, len - in);
+        if (dst + out != str + in)
+        {
+            memmove(dst + out, str + in, run);
+        }
+        in += run;
+        out += run;
+        if (in == len)
+        {
+            break;
+        }
+
+        int hi, lo;
+        if (str[in] == '+')
         {
-            *pbuf++ = *pstr;
+            dst[out++] = ' ';
+            in += 1;
         }
-        else if (*pstr == ' ')
+        else if (in + 2 < len &&
+                 (hi = from_hex(str[in + 1])) >= 0 &&
+                 (lo = from_hex(str[in + 2])) >= 0)
         {
-            *pbuf++ = '+';
+            dst[out++] = hi << NIBBLE_SHIFT | lo;
+            in += 3;
         }
         else
         {
-            *pbuf++ = '%';
-            *pbuf++ = to_hex(*pstr >> NIBBLE_SHIFT);
-            *pbuf++ = to_hex(*pstr & NIBBLE_MASK);
+            dst[out++] = '%';
+            in += 1;
         }
-        pstr++;
     }
-    *pbuf = '\0';
-    return buf;
+    return out;
 }
 
-char *su_url_encode(void *ctx, const char *str)
+/* How a character is URL encoded. */
+enum url_class
 {
-    return su_url_encode_l(ctx, str, strlen(str));
+    /* Escaped as %XX. The zero value, so only the others need listing. */
+    URL_ESCAPE = 0,
+
+    /* Unreserved characters are kept as they are. */
+    URL_KEEP,
+
+    /* A space is encoded as '+'. */
+    URL_SPACE,
+};
+
+/* The url_class of every character. */
+static const unsigned char url_classes[256] = {
+    ['0' ... '9'] = URL_KEEP,
+    ['A' ... 'Z'] = URL_KEEP,
+    ['a' ... 'z'] = URL_KEEP,
+    ['-'] = URL_KEEP, ['_'] = URL_KEEP, ['.'] = URL_KEEP, ['~'] = URL_KEEP,
+    [' '] = URL_SPACE,
+};
+
+/* The hex characters, indexed by their value. */
+static const char hex_chars[] = "0123456789ABCDEF";
+
+#if defined(__AVX2__) || defined(__SSE2__)
+
+#if defined(__AVX2__)
+/* The number of characters classified at once. */
+#define URL_BLOCK 32
+
+/**
+ * Gets the URL_KEEP characters of a block.
+ *
+ * @param str The block. Must have URL_BLOCK readable characters.
+ *
+ * @param[out] spaces The mask of spaces in the block.
+ *
+ * @return The mask of unreserved characters in the block.
+ */
+static inline uint32_t unreserved_mask(const char *str, uint32_t *spaces)
+{
+    __m256i c = _mm256_loadu_si256((const __m256i *)str);
+    /* Unsigned range checks: c - lo <= hi - lo. */
+    __m256i letter = _mm256_sub_epi8(
+        _mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a')
+    );
+    __m256i digit = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+    __m256i keep = _mm256_or_si256(
+        _mm256_cmpeq_epi8(
+            _mm256_min_epu8(letter, _mm256_set1_epi8(25)), letter
+        ),
+        _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit)
+    );
+    keep = _mm256_or_si256(keep, _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_cmpeq_epi8(c, _mm256_set1_epi8('-')),
+            _mm256_cmpeq_epi8(c, _mm256_set1_epi8('_'))
+        ),
+        _mm256_or_si256(
+            _mm256_cmpeq_epi8(c, _mm256_set1_epi8('.')),
+            _mm256_cmpeq_epi8(c, _mm256_set1_epi8('~'))
+        )
+    ));
+    *spaces = _mm256_movemask_epi8(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')));
+    return _mm256_movemask_epi8(keep);
 }
+#else
+/* The number of characters classified at once. */
+#define URL_BLOCK 16
 
-char *su_url_decode_l(void *ctx, const char *str, size_t len)
+/**
+ * Gets the URL_KEEP characters of a block.
+ *
+ * @param str The block. Must have URL_BLOCK readable characters.
+ *
+ * @param[out] spaces The mask of spaces in the block.
+ *
+ * @return The mask of unreserved characters in the block.
+ */
+static inline uint32_t unreserved_mask(const char *str, uint32_t *spaces)
 {
-    const char *pstr = str;
-    const char *pstr_end = &str[len];
-    char *buf = talloc_array(ctx, char, len + 1);
-    if (buf == NULL)
+    __m128i c = _mm_loadu_si128((const __m128i *)str);
+    /* Unsigned range checks: c - lo <= hi - lo. */
+    __m128i letter = _mm_sub_epi8(
+        _mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a')
+    );
+    __m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i keep = _mm_or_si128(
+        _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(25)), letter),
+        _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit)
+    );
+    keep = _mm_or_si128(keep, _mm_or_si128(
+        _mm_or_si128(
+            _mm_cmpeq_epi8(c, _mm_set1_epi8('-')),
+            _mm_cmpeq_epi8(c, _mm_set1_epi8('_'))
+        ),
+        _mm_or_si128(
+            _mm_cmpeq_epi8(c, _mm_set1_epi8('.')),
+            _mm_cmpeq_epi8(c, _mm_set1_epi8('~'))
+        )
+    ));
+    *spaces = _mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')));
+    return _mm_movemask_epi8(keep);
+}
+#endif
+
+/* A mask of every character of a block. */
+#define URL_BLOCK_MASK ((uint32_t)((1ull << URL_BLOCK) - 1))
+
+#endif
+
+size_t su_url_encoded_len(const char *str, size_t len)
+{
+    size_t escapes = 0;
+    size_t i = 0;
+#ifdef URL_BLOCK
+    for (; i + URL_BLOCK <= len; i += URL_BLOCK)
     {
-        return NULL;
+        uint32_t spaces;
+        uint32_t keep = unreserved_mask(str + i, &spaces);
+        escapes += __builtin_popcount(~(keep | spaces) & URL_BLOCK_MASK);
+    }
+#endif
+    for (; i < len; ++i)
+    {
+        escapes += url_classes[(unsigned char)str[i]] == URL_ESCAPE;
+    }
+    /* Every escape takes two more characters. */
+    return len + escapes * 2;
+}
+
+/**
+ * Counts the unreserved characters at the start of a string.
+ *
+ * @param str The string.
+ *
+ * @param len The length of the string.
+ *
+ * @return The number of characters before the first one that needs encoding.
+ */
+static inline size_t unreserved_run(const char *str, size_t len)
+{
+    size_t i = 0;
+#ifdef URL_BLOCK
+    for (; i + URL_BLOCK <= len; i += URL_BLOCK)
+    {
+        uint32_t spaces;
+        uint32_t other = ~unreserved_mask(str + i, &spaces) & URL_BLOCK_MASK;
+        if (other)
+        {
+            return i + __builtin_ctz(other);
+        }
+    }
+#endif
+    while (i < len && url_classes[(unsigned char)str[i]] == URL_KEEP)
+    {
+        ++i;
     }
-    char *pbuf = buf;
-    while (pstr < pstr_end)
+    return i;
+}
+
+size_t su_url_encode_buf(char *dst, const char *str, size_t len)
+{
+    size_t in = 0, out = 0;
+    while (in < len)
     {
-        if (*pstr == '%')
+        size_t run = unreserved_run(str + in, len - in);
+        memcpy(dst + out, str + in, run);
+        in += run;
+        out += run;
+        if (in == len)
         {
-            if (pstr[1] && pstr[2])
-            {
-                *pbuf++ = from_hex(pstr[1]) << NIBBLE_SHIFT | from_hex(pstr[2]);
-                pstr += 2;
-            }
+            break;
         }
-        else if (*pstr == '+')
+
+        unsigned char c = str[in++];
+        if (url_classes[c] == URL_SPACE)
         {
-            *pbuf++ = ' ';
+            dst[out++] = '+';
         }
         else
         {
-            *pbuf++ = *pstr;
+            dst[out++] = '%';
+            dst[out++] = hex_chars[c >> NIBBLE_SHIFT];
+            dst[out++] = hex_chars[c & NIBBLE_MASK];
         }
-        pstr++;
     }
-    *pbuf = '\0';
+    dst[out] = '\0';
+    return out;
+}
+
+sds su_url_encode_cat(sds s, const char *str, size_t len)
+{
+    size_t enc_len = su_url_encoded_len(str, len);
+    s = sdsMakeRoomFor(s, enc_len);
+    if (s == NULL)
+    {
+        return NULL;
+    }
+    su_url_encode_buf(s + sdslen(s), str, len);
+    sdsIncrLen(s, enc_len);
+    return s;
+}
+
+char *su_url_encode_l(void *ctx, const char *str, size_t len)
+{
+    char *buf = talloc_array(ctx, char, su_url_encoded_len(str, len) + 1);
+    if (buf == NULL)
+    {
+        return NULL;
+    }
+    su_url_encode_buf(buf, str, len);
     return buf;
 }
 
+char *su_url_encode(void *ctx, const char *str)
+{
+    return su_url_encode_l(ctx, str, strlen(str));
+}
+
+char *su_url_decode_l(void *ctx, const char *str, size_t len)
+{
+    char *buf = talloc_array(ctx, char, len + 1);
+    if (buf == NULL)
+    {
+        return NULL;
+    }
+    buf[url_decode(buf, str, len)] = '\0';
+    return buf;
+}
+
+size_t su_url_decode_in_place(char *str, size_t len)
+{
+    size_t dec_len = url_decode(str, str, len);
+    str[dec_len] = '\0';
+    return dec_len;
+}
+
 char *su_url_decode(void *ctx, const char *str)
 {
     return su_url_decode_l(ctx, str, strlen(str));
@@ -30,6 +30,8 @@
 
 #include <stddef.h>
 
+#include "buffer/sds.h"
+
 /**
  * strchr except if the character isn't found, a pointer to the nul terminator
  * is returned.
@@ -43,6 +45,20 @@
  */
 const char *su_strchrnul(const char *s, int c);
 
+/**
+ * Finds the first of a set of delimiters in one pass. Like strpbrk except if
+ * none of the delimiters are found, a pointer to the nul terminator is
+ * returned.
+ *
+ * @param s The string to search through.
+ *
+ * @param delims The delimiters to look for. Meant for a handful of them.
+ *
+ * @return A pointer to the first delimiter in s. A pointer to the nul
+ *         terminator in s if there aren't any.
+ */
+const char *su_strpbrknul(const char *s, const char *delims);
+
 /**
  * Duplicates the first len characters of a string.
  *
@@ -93,6 +109,45 @@ char *su_url_encode(void *ctx, const char *str);
  */
 char *su_url_encode_l(void *ctx, const char *str, size_t len);
 
+/**
+ * Gets the exact length of a string once it is URL encoded.
+ *
+ * @param str The string to URL encode.
+ *
+ * @param len The length of the string.
+ *
+ * @return The length of the URL-encoded string, without a nul terminator.
+ */
+size_t su_url_encoded_len(const char *str, size_t len);
+
+/**
+ * URL encodes a string into a buffer.
+ *
+ * @param[out] dst The buffer. Must have room for su_url_encoded_len() + 1
+ *                 characters. Nul terminated.
+ *
+ * @param str The string to URL encode.
+ *
+ * @param len The length of the string.
+ *
+ * @return The length of the URL-encoded string.
+ */
+size_t su_url_encode_buf(char *dst, const char *str, size_t len);
+
+/**
+ * Appends a URL-encoded string to an sds string.
+ *
+ * @param s The sds string to append to.
+ *
+ * @param str The string to URL encode.
+ *
+ * @param len The length of the string.
+ *
+ * @return The sds string with the URL-encoded string appended. NULL if memory
+ *         could not be allocated, in which case s is still valid.
+ */
+sds su_url_encode_cat(sds s, const char *str, size_t len);
+
 /**
  * Decodes a URL-encoded string.
  *
@@ -117,4 +172,17 @@ char *su_url_decode(void *ctx, const char *str);
  */
 char *su_url_decode_l(void *ctx, const char *str, size_t len);
 
+/**
+ * Decodes a URL-encoded string into the memory it occupies. A '%' that isn't
+ * followed by two hex characters is kept as is.
+ *
+ * @param str The URL-encoded string to decode. Must have room for len + 1
+ *            characters. Nul terminated after decoding.
+ *
+ * @param len The length of the string.
+ *
+ * @return The length of the decoded string.
+ */
+size_t su_url_decode_in_place(char *str, size_t len);
+
 #endif // __STRUTIL_H__
\ No newline at end of file
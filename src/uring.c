@@ -0,0 +1,810 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021 Ripose
+//
+// This file is part of Valhalla.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License version 3 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Additional permission under GNU AGPL version 3 section 7
+//
+// If you modify this Program, or any covered work, by linking or combining it
+// with FastCGI (or a modified version of that library), containing parts
+// covered by the terms of the FastCGI Open Market Licence, the licensors of
+// this Program grant you additional permission to convey the resulting work.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "uring.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+#include <talloc.h>
+
+/* Multishot receives are the newest feature the loop relies on. Kernel headers
+ * that don't define them can't build the loop at all.
+ */
+#ifdef IORING_RECV_MULTISHOT
+
+/* The number of submission queue entries. */
+#define RING_ENTRIES 256
+
+/* The number of receive buffers. Must be a power of 2. */
+#define BUFFER_COUNT 256
+
+/* The size of a receive buffer. */
+#define BUFFER_SIZE (16 * 1024)
+
+/* The id of the receive buffer group. */
+#define BUFFER_GROUP 0
+
+/* The operation a completion belongs to is stored in the low bits of its
+ * user_data. The rest is a pointer to the connection, if any.
+ */
+#define OP_MASK 0x7
+
+/* Operations submitted by the loop. */
+enum uring_op
+{
+    OP_ACCEPT = 1,
+    OP_STOP,
+    OP_RECV,
+    OP_SEND,
+    OP_CANCEL,
+};
+
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+typedef struct uring_loop
+{
+    /* The io_uring file descriptor. */
+    int fd;
+
+    /* The socket connections are accepted on. */
+    int listen_fd;
+
+    /* Becomes readable once the loop should stop. -1 if there is none. */
+    int stop_fd;
+
+    /* The mapping of the submission and completion queue rings. */
+    void *ring;
+
+    /* The size of ring. */
+    size_t ring_size;
+
+    /* The submission queue entries. */
+    struct io_uring_sqe *sqes;
+
+    /* The size of sqes. */
+    size_t sqes_size;
+
+    /* Submission queue ring fields. */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+
+    /* The tail of the submission queue including unpublished entries. */
+    unsigned sq_local_tail;
+
+    /* Completion queue ring fields. */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    struct io_uring_cqe *cqes;
+    unsigned cq_mask;
+
+    /* The ring receive buffers are provided to the kernel with. */
+    struct io_uring_buf_ring *buf_ring;
+
+    /* The size of buf_ring. */
+    size_t buf_ring_size;
+
+    /* The receive buffers. */
+    unsigned char *bufs;
+
+    /* The tail of buf_ring. */
+    unsigned short buf_tail;
+
+    /* Flags of receive submissions. Multishot is dropped if the kernel
+     * rejects it.
+     */
+    unsigned short recv_flags;
+
+    /* The number of submitted operations that will still complete. */
+    size_t inflight;
+
+    /* Nonzero while accepting new connections. */
+    int running;
+} uring_loop;
+
+/* A connection served by the loop. */
+typedef struct uring_conn
+{
+    /* The loop the connection belongs to. */
+    uring_loop *loop;
+
+    /* The FastCGI connection. A child of this struct. */
+    fcgi_conn *fconn;
+
+    /* The socket. */
+    int fd;
+
+    /* Nonzero while a receive is submitted. */
+    int recv_active;
+
+    /* Nonzero once the web server closed its end or the socket failed. */
+    int eof;
+
+    /* Nonzero once the socket was shut down. */
+    int shut;
+
+    /* Output being sent. NULL if no send is submitted. */
+    char *send_buf;
+
+    /* The length of send_buf. */
+    size_t send_len;
+
+    /* The number of bytes of send_buf that were sent. */
+    size_t send_pos;
+} uring_conn;
+
+/*
+ *==============================================================================
+ * Ring
+ *==============================================================================
+ */
+
+/**
+ * Publishes queued submissions to the kernel and optionally waits for a
+ * completion.
+ *
+ * @param loop The loop to submit for.
+ *
+ * @param wait Nonzero to wait for at least one completion.
+ *
+ * @return 0 on success, -1 on error. errno is set on error.
+ */
+static int submit(uring_loop *loop, int wait)
+{
+    store_release(loop->sq_tail, loop->sq_local_tail);
+    unsigned to_submit = loop->sq_local_tail - load_acquire(loop->sq_head);
+    if (to_submit == 0 && !wait)
+    {
+        return 0;
+    }
+    long ret = syscall(
+        __NR_io_uring_enter,
+        loop->fd,
+        to_submit,
+        wait ? 1 : 0,
+        wait ? IORING_ENTER_GETEVENTS : 0,
+        NULL,
+        0
+    );
+    return ret < 0 ? -1 : 0;
+}
+
+/**
+ * Gets a free submission queue entry, submitting queued entries if the queue is
+ * full.
+ *
+ * @param loop The loop to get the entry of.
+ *
+ * @param user_data The user_data of the entry.
+ *
+ * @return A zeroed entry. NULL if the queue is full and could not be submitted.
+ */
+static struct io_uring_sqe *get_sqe(uring_loop *loop, uint64_t user_data)
+{
+    while (loop->sq_local_tail - load_acquire(loop->sq_head) >=
+           loop->sq_entries)
+    {
+        if (submit(loop, 0) && errno != EINTR && errno != EAGAIN &&
+            errno != EBUSY)
+        {
+            return NULL;
+        }
+    }
+
+    unsigned idx = loop->sq_local_tail & loop->sq_mask;
+    struct io_uring_sqe *sqe = &loop->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    loop->sq_array[idx] = idx;
+    ++loop->sq_local_tail;
+    ++loop->inflight;
+    return sqe;
+}
+
+/**
+ * Hands a receive buffer back to the kernel.
+ *
+ * @param loop The loop the buffer belongs to.
+ *
+ * @param bid The id of the buffer.
+ */
+static void recycle_buffer(uring_loop *loop, unsigned short bid)
+{
+    struct io_uring_buf *buf =
+        &loop->buf_ring->bufs[loop->buf_tail & (BUFFER_COUNT - 1)];
+    buf->addr = (uintptr_t)(loop->bufs + (size_t)bid * BUFFER_SIZE);
+    buf->len = BUFFER_SIZE;
+    buf->bid = bid;
+    store_release(&loop->buf_ring->tail, ++loop->buf_tail);
+}
+
+/*
+ *==============================================================================
+ * Connections
+ *==============================================================================
+ */
+
+/**
+ * Submits a receive on a connection.
+ *
+ * @param conn The connection to receive on.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int submit_recv(uring_conn *conn)
+{
+    uring_loop *loop = conn->loop;
+    struct io_uring_sqe *sqe = get_sqe(loop, (uintptr_t)conn | OP_RECV);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->ioprio = loop->recv_flags;
+    conn->recv_active = 1;
+    return 0;
+}
+
+/**
+ * Submits a send of the rest of a connection's output.
+ *
+ * @param conn The connection to send on.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int submit_send(uring_conn *conn)
+{
+    struct io_uring_sqe *sqe = get_sqe(conn->loop, (uintptr_t)conn | OP_SEND);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)(conn->send_buf + conn->send_pos);
+    sqe->len = conn->send_len - conn->send_pos;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    return 0;
+}
+
+/**
+ * Sends the output a connection queued unless a send is already submitted.
+ *
+ * @param conn The connection to flush.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int flush_conn(uring_conn *conn)
+{
+    if (conn->send_buf || conn->eof)
+    {
+        return 0;
+    }
+    conn->send_buf = fcgi_conn_take_output(conn->fconn, conn, &conn->send_len);
+    if (conn->send_buf == NULL)
+    {
+        return 0;
+    }
+    conn->send_pos = 0;
+    return submit_send(conn);
+}
+
+/**
+ * Closes a connection once it's done. A connection is done once the web server
+ * is done with it and all of its output was sent. Its socket is shut down first
+ * if a receive is still submitted, and it's freed once that receive completed.
+ *
+ * @param conn The connection to close.
+ */
+static void close_if_done(uring_conn *conn)
+{
+    if (conn->send_buf)
+    {
+        return;
+    }
+    if (!conn->eof && !fcgi_conn_closing(conn->fconn))
+    {
+        return;
+    }
+    if (conn->recv_active)
+    {
+        if (!conn->shut)
+        {
+            shutdown(conn->fd, SHUT_RDWR);
+            conn->shut = 1;
+        }
+        return;
+    }
+    talloc_free(conn);
+}
+
+/**
+ * Starts serving a newly accepted connection.
+ *
+ * @param loop The loop that accepted the connection.
+ *
+ * @param fd The socket.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int add_conn(uring_loop *loop, int fd)
+{
+    uring_conn *conn = talloc_zero(loop, uring_conn);
+    if (conn == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+    conn->fconn = fcgi_conn_new(conn, fd);
+    if (conn->fconn == NULL)
+    {
+        talloc_free(conn);
+        return -1;
+    }
+    fcgi_conn_defer_writes(conn->fconn);
+    conn->loop = loop;
+    conn->fd = fd;
+
+    if (submit_recv(conn))
+    {
+        talloc_free(conn);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ *==============================================================================
+ * Completions
+ *==============================================================================
+ */
+
+/**
+ * Handles the completion of a receive.
+ *
+ * @param conn The connection data was received on.
+ *
+ * @param cqe The completion.
+ *
+ * @param serve The function serving requests.
+ *
+ * @param arg The argument of serve.
+ *
+ * @return The return value of serve, or -1 on error.
+ */
+static int complete_recv(
+    uring_conn *conn,
+    const struct io_uring_cqe *cqe,
+    uring_serve_func serve,
+    void *arg)
+{
+    uring_loop *loop = conn->loop;
+    int ret = 0;
+
+    if (cqe->res > 0)
+    {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        fcgi_conn_process(
+            conn->fconn, loop->bufs + (size_t)bid * BUFFER_SIZE, cqe->res
+        );
+        recycle_buffer(loop, bid);
+        ret = serve(conn->fconn, arg);
+    }
+    else if (cqe->res == -EINVAL && loop->recv_flags & IORING_RECV_MULTISHOT)
+    {
+        /* Multishot receives are newer than the rest of the loop. */
+        loop->recv_flags &= ~IORING_RECV_MULTISHOT;
+    }
+    else if (cqe->res != -ENOBUFS)
+    {
+        conn->eof = 1;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        conn->recv_active = 0;
+        if (!conn->eof && !conn->shut && !fcgi_conn_closing(conn->fconn) &&
+            submit_recv(conn))
+        {
+            ret = -1;
+        }
+    }
+    if (flush_conn(conn))
+    {
+        ret = -1;
+    }
+    close_if_done(conn);
+    return ret;
+}
+
+/**
+ * Handles the completion of a send.
+ *
+ * @param conn The connection output was sent on.
+ *
+ * @param cqe The completion.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int complete_send(uring_conn *conn, const struct io_uring_cqe *cqe)
+{
+    int ret = 0;
+    if (cqe->res < 0)
+    {
+        conn->eof = 1;
+        TALLOC_FREE(conn->send_buf);
+    }
+    else
+    {
+        conn->send_pos += cqe->res;
+        if (conn->send_pos < conn->send_len)
+        {
+            return submit_send(conn);
+        }
+        TALLOC_FREE(conn->send_buf);
+        ret = flush_conn(conn);
+    }
+    close_if_done(conn);
+    return ret;
+}
+
+/**
+ * Handles a completion.
+ *
+ * @param loop The loop the completion belongs to.
+ *
+ * @param cqe The completion.
+ *
+ * @param serve The function serving requests.
+ *
+ * @param arg The argument of serve.
+ *
+ * @return 0 to keep running, 1 to stop, -1 on error.
+ */
+static int complete(
+    uring_loop *loop,
+    const struct io_uring_cqe *cqe,
+    uring_serve_func serve,
+    void *arg)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        --loop->inflight;
+    }
+
+    void *ptr = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+    switch (cqe->user_data & OP_MASK)
+    {
+    case OP_ACCEPT:
+        if (cqe->res >= 0 && add_conn(loop, cqe->res))
+        {
+            return -1;
+        }
+        if (cqe->res < 0 && cqe->res != -ECONNABORTED && cqe->res != -EINTR)
+        {
+            /* TODO Logging */
+            return -1;
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+        {
+            struct io_uring_sqe *sqe = get_sqe(loop, OP_ACCEPT);
+            if (sqe == NULL)
+            {
+                return -1;
+            }
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = loop->listen_fd;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_CLOEXEC;
+        }
+        return 0;
+
+    case OP_STOP:
+        return 1;
+
+    case OP_RECV:
+        return complete_recv(ptr, cqe, serve, arg);
+
+    case OP_SEND:
+        return complete_send(ptr, cqe);
+
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Cancels every submitted operation and waits for them to complete. Receive
+ * buffers must not be unmapped while the kernel may still write to them.
+ *
+ * @param loop The loop to drain.
+ */
+static void drain(uring_loop *loop)
+{
+    struct io_uring_sqe *sqe = get_sqe(loop, OP_CANCEL);
+    if (sqe == NULL)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+
+    while (loop->inflight > 0)
+    {
+        if (submit(loop, 1) && errno != EINTR)
+        {
+            return;
+        }
+        unsigned head = *loop->cq_head;
+        unsigned tail = load_acquire(loop->cq_tail);
+        for (; head != tail; ++head)
+        {
+            const struct io_uring_cqe *cqe = &loop->cqes[head & loop->cq_mask];
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+            {
+                --loop->inflight;
+            }
+            if ((cqe->user_data & OP_MASK) == OP_CANCEL && cqe->res == -EINVAL)
+            {
+                /* Canceling everything at once isn't supported. Closing the
+                 * ring cancels what's left. */
+                store_release(loop->cq_head, head + 1);
+                return;
+            }
+        }
+        store_release(loop->cq_head, head);
+    }
+}
+
+/*
+ *==============================================================================
+ * Public
+ *==============================================================================
+ */
+
+/**
+ * Destructor for uring_loop.
+ *
+ * @param loop The loop to destruct.
+ *
+ * @return Always 0.
+ */
+static int loop_destructor(uring_loop *loop)
+{
+    if (loop->fd >= 0)
+    {
+        close(loop->fd);
+    }
+    if (loop->ring != MAP_FAILED)
+    {
+        munmap(loop->ring, loop->ring_size);
+    }
+    if (loop->sqes != MAP_FAILED)
+    {
+        munmap(loop->sqes, loop->sqes_size);
+    }
+    if (loop->buf_ring != MAP_FAILED)
+    {
+        munmap(loop->buf_ring, loop->buf_ring_size);
+    }
+    if (loop->bufs != MAP_FAILED)
+    {
+        munmap(loop->bufs, (size_t)BUFFER_COUNT * BUFFER_SIZE);
+    }
+    return 0;
+}
+
+uring_loop *uring_loop_new(void *ctx, int listen_fd, int stop_fd)
+{
+    uring_loop *loop = talloc_zero(ctx, uring_loop);
+    if (loop == NULL)
+    {
+        return NULL;
+    }
+    loop->listen_fd = listen_fd;
+    loop->stop_fd = stop_fd;
+    loop->ring = MAP_FAILED;
+    loop->sqes = MAP_FAILED;
+    loop->buf_ring = MAP_FAILED;
+    loop->bufs = MAP_FAILED;
+    loop->recv_flags = IORING_RECV_MULTISHOT;
+    talloc_set_destructor(loop, loop_destructor);
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    loop->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (loop->fd < 0 ||
+        !(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_NODROP))
+    {
+        goto error;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    loop->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    loop->ring = mmap(
+        NULL, loop->ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, loop->fd, IORING_OFF_SQ_RING
+    );
+    loop->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    loop->sqes = mmap(
+        NULL, loop->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, loop->fd, IORING_OFF_SQES
+    );
+    if (loop->ring == MAP_FAILED || loop->sqes == MAP_FAILED)
+    {
+        goto error;
+    }
+
+    char *ring = loop->ring;
+    loop->sq_head = (unsigned *)(ring + params.sq_off.head);
+    loop->sq_tail = (unsigned *)(ring + params.sq_off.tail);
+    loop->sq_array = (unsigned *)(ring + params.sq_off.array);
+    loop->sq_mask = *(unsigned *)(ring + params.sq_off.ring_mask);
+    loop->sq_entries = params.sq_entries;
+    loop->sq_local_tail = *loop->sq_tail;
+    loop->cq_head = (unsigned *)(ring + params.cq_off.head);
+    loop->cq_tail = (unsigned *)(ring + params.cq_off.tail);
+    loop->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+    loop->cq_mask = *(unsigned *)(ring + params.cq_off.ring_mask);
+
+    /* Receive buffers are picked by the kernel when data arrives, so idle
+     * connections don't hold on to one. */
+    loop->buf_ring_size = BUFFER_COUNT * sizeof(struct io_uring_buf);
+    loop->buf_ring = mmap(
+        NULL, loop->buf_ring_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+    );
+    loop->bufs = mmap(
+        NULL, (size_t)BUFFER_COUNT * BUFFER_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+    );
+    if (loop->buf_ring == MAP_FAILED || loop->bufs == MAP_FAILED)
+    {
+        goto error;
+    }
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uintptr_t)loop->buf_ring,
+        .ring_entries = BUFFER_COUNT,
+        .bgid = BUFFER_GROUP,
+    };
+    if (syscall(
+            __NR_io_uring_register,
+            loop->fd,
+            IORING_REGISTER_PBUF_RING,
+            &reg,
+            1) < 0)
+    {
+        goto error;
+    }
+    for (unsigned short bid = 0; bid < BUFFER_COUNT; ++bid)
+    {
+        recycle_buffer(loop, bid);
+    }
+
+    return loop;
+
+error:
+    talloc_free(loop);
+    return NULL;
+}
+
+int uring_loop_run(uring_loop *loop, uring_serve_func serve, void *arg)
+{
+    struct io_uring_sqe *sqe = get_sqe(loop, OP_ACCEPT);
+    if (sqe == NULL)
+    {
+        /* TODO Logging */
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (loop->stop_fd != -1)
+    {
+        sqe = get_sqe(loop, OP_STOP);
+        if (sqe == NULL)
+        {
+            /* TODO Logging */
+            drain(loop);
+            return -1;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = loop->stop_fd;
+        sqe->poll32_events = POLLIN;
+    }
+
+    int ret = 0;
+    loop->running = 1;
+    while (loop->running)
+    {
+        if (submit(loop, 1))
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            /* TODO Logging */
+            ret = -1;
+            break;
+        }
+
+        unsigned head = *loop->cq_head;
+        unsigned tail = load_acquire(loop->cq_tail);
+        for (; head != tail && loop->running; ++head)
+        {
+            struct io_uring_cqe cqe = loop->cqes[head & loop->cq_mask];
+            store_release(loop->cq_head, head + 1);
+
+            int status = complete(loop, &cqe, serve, arg);
+            if (status)
+            {
+                ret = status < 0 ? -1 : 0;
+                loop->running = 0;
+            }
+        }
+    }
+
+    drain(loop);
+    return ret;
+}
+
+#else
+
+uring_loop *uring_loop_new(void *ctx, int listen_fd, int stop_fd)
+{
+    (void)ctx;
+    (void)listen_fd;
+    (void)stop_fd;
+    return NULL;
+}
+
+int uring_loop_run(uring_loop *loop, uring_serve_func serve, void *arg)
+{
+    (void)loop;
+    (void)serve;
+    (void)arg;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,83 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021 Ripose
+//
+// This file is part of Valhalla.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License version 3 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Additional permission under GNU AGPL version 3 section 7
+//
+// If you modify this Program, or any covered work, by linking or combining it
+// with FastCGI (or a modified version of that library), containing parts
+// covered by the terms of the FastCGI Open Market Licence, the licensors of
+// this Program grant you additional permission to convey the resulting work.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "fcgi.h"
+
+/* An io_uring event loop serving FastCGI connections. */
+typedef struct uring_loop uring_loop;
+
+/**
+ * Handles every request of a connection that was received completely.
+ *
+ * @param conn The connection to handle the requests of.
+ *
+ * @param arg The argument passed to uring_loop_run().
+ *
+ * @return 0 to keep accepting requests, 1 if a handler asked to stop, -1 on
+ *         error.
+ */
+typedef int (*uring_serve_func)(fcgi_conn *conn, void *arg);
+
+/**
+ * Creates an io_uring event loop.
+ *
+ * @param ctx The talloc context the loop should be a child of.
+ *
+ * @param listen_fd The socket to accept connections on.
+ *
+ * @param stop_fd A file descriptor that becomes readable once the loop should
+ *                stop. -1 if there is none.
+ *
+ * @return A new loop. Should be freed with talloc_free(). NULL if io_uring or
+ *         one of the features the loop relies on isn't supported by the kernel,
+ *         or on error.
+ */
+uring_loop *uring_loop_new(void *ctx, int listen_fd, int stop_fd);
+
+/**
+ * Accepts connections and serves them until stop_fd becomes readable, serve
+ * asks to stop, or an error occurs.
+ *
+ * Connections are accepted with a multishot accept and read with multishot
+ * receives into a ring of buffers registered with the kernel. Output is queued
+ * by the connection and sent once serve returns, so every submission and
+ * completion of an iteration is batched into a single system call.
+ *
+ * @param loop The loop to run.
+ *
+ * @param serve Called whenever data was received on a connection.
+ *
+ * @param arg Passed to serve.
+ *
+ * @return 0 if the loop was asked to stop, -1 on error.
+ */
+int uring_loop_run(uring_loop *loop, uring_serve_func serve, void *arg);
+
+#endif // __URING_H__
@@ -117,15 +117,19 @@ void test_add_new_method_route()
 
 void test_get_route()
 {
-    const route_info_t *info = context_get_route(ctx, "/books/4", VLA_HTTP_GET);
+    route_match match;
+    const route_info_t *info = context_get_route(
+        ctx, "/books/4", VLA_HTTP_GET, &match, NULL
+    );
     TEST_ASSERT_NOT_NULL(info);
     TEST_ASSERT_EQUAL_PTR((vla_handler_func)2, info->hdlr);
+    TEST_ASSERT_EQUAL_INT(ROUTE_MATCH_DYNAMIC, match.type);
 }
 
 void test_get_missing_route()
 {
     const route_info_t *info = context_get_route(
-        ctx, "/movies/2", VLA_HTTP_GET
+        ctx, "/movies/2", VLA_HTTP_GET, NULL, NULL
     );
     TEST_ASSERT_NULL(info);
 }
@@ -139,7 +143,7 @@ void test_unknown_route()
         NULL
     );
     const route_info_t *info = context_get_route(
-        ctx, "/movies/2", VLA_HTTP_GET
+        ctx, "/movies/2", VLA_HTTP_GET, NULL, NULL
     );
     TEST_ASSERT_NOT_NULL(info);
     TEST_ASSERT_EQUAL_PTR((vla_handler_func)-1, info->hdlr);
@@ -150,6 +154,52 @@ void test_unknown_route()
     TEST_ASSERT_NULL(info->mw_args[1]);
 }
 
+void test_method_not_allowed()
+{
+    route_match match;
+    const route_info_t *info = context_get_route(
+        ctx, "/books/4", VLA_HTTP_DELETE, &match, NULL
+    );
+    TEST_ASSERT_NOT_NULL(info);
+    TEST_ASSERT_NOT_NULL(info->hdlr);
+    TEST_ASSERT_NULL(info->mw[0]);
+    TEST_ASSERT_EQUAL_STRING("GET, HEAD", match.allow);
+}
+
+void test_publish_routes()
+{
+    route_cache *cache = route_cache_new(ctx);
+    TEST_ASSERT_NOT_NULL(cache);
+    route_match match;
+    const route_info_t *info = context_get_route(
+        ctx, "/books/4", VLA_HTTP_GET, &match, cache
+    );
+    TEST_ASSERT_NOT_NULL(info);
+
+    vla_routes *routes = vla_routes_new();
+    TEST_ASSERT_NOT_NULL(routes);
+    int ret = vla_routes_add(
+        routes,
+        VLA_HTTP_GET,
+        "/movies/:id",
+        (vla_handler_func)8, NULL,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    ret = vla_routes_publish(ctx, routes);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    info = context_get_route(ctx, "/books/4", VLA_HTTP_GET, &match, cache);
+    TEST_ASSERT_NULL(info);
+    info = context_get_route(ctx, "/movies/2", VLA_HTTP_GET, &match, cache);
+    TEST_ASSERT_NOT_NULL(info);
+    TEST_ASSERT_EQUAL_PTR((vla_handler_func)8, info->hdlr);
+    TEST_ASSERT_EQUAL_INT(ROUTE_MATCH_DYNAMIC, match.type);
+
+    /* No requests are in progress, so the old routes were freed already. */
+    TEST_ASSERT_EQUAL_size_t(0, vla_routes_reclaim(ctx));
+}
+
 int main(void)
 {
     UNITY_BEGIN();
@@ -160,6 +210,8 @@ int main(void)
     RUN_TEST(test_get_route);
     RUN_TEST(test_get_missing_route);
     RUN_TEST(test_unknown_route);
+    RUN_TEST(test_method_not_allowed);
+    RUN_TEST(test_publish_routes);
 
     return UNITY_END();
 }
\ No newline at end of file
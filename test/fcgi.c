@@ -0,0 +1,730 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021 Ripose
+//
+// This file is part of Valhalla.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License version 3 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Additional permission under GNU AGPL version 3 section 7
+//
+// If you modify this Program, or any covered work, by linking or combining it
+// with FastCGI (or a modified version of that library), containing parts
+// covered by the terms of the FastCGI Open Market Licence, the licensors of
+// this Program grant you additional permission to convey the resulting work.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "unity/unity.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <talloc.h>
+
+#include "../src/fcgi.h"
+#include "../src/include/valhalla.h"
+
+/* The connection under test and the web server's end of the socket. */
+static fcgi_conn *conn;
+static int server_fd;
+
+/* A byte stream being built to send to the connection. */
+typedef struct stream
+{
+    unsigned char data[4096];
+    size_t len;
+} stream;
+
+void setUp(void)
+{
+    int sv[2];
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK);
+    conn = fcgi_conn_new(NULL, sv[0]);
+    TEST_ASSERT_NOT_NULL(conn);
+    server_fd = sv[1];
+}
+
+void tearDown(void)
+{
+    talloc_free(conn);
+    close(server_fd);
+}
+
+/**
+ * Appends a record to a stream.
+ */
+static void put_record(
+    stream *s,
+    unsigned char type,
+    uint16_t id,
+    const void *content,
+    size_t len,
+    unsigned char padding)
+{
+    unsigned char hdr[8] = {
+        1, type, id >> 8, id & 0xFF, len >> 8, len & 0xFF, padding, 0,
+    };
+    memcpy(s->data + s->len, hdr, sizeof(hdr));
+    s->len += sizeof(hdr);
+    if (len > 0)
+    {
+        memcpy(s->data + s->len, content, len);
+        s->len += len;
+    }
+    memset(s->data + s->len, 0xAA, padding);
+    s->len += padding;
+}
+
+/**
+ * Appends the length of a name or value, in the four byte form if asked to.
+ */
+static size_t put_length(unsigned char *p, size_t len, int wide)
+{
+    if (!wide && len < 0x80)
+    {
+        p[0] = len;
+        return 1;
+    }
+    p[0] = 0x80 | (len >> 24);
+    p[1] = len >> 16;
+    p[2] = len >> 8;
+    p[3] = len;
+    return 4;
+}
+
+/**
+ * Encodes a name-value pair.
+ */
+static size_t put_pair(
+    unsigned char *p,
+    const char *name,
+    const char *value,
+    int wide)
+{
+    size_t name_len = strlen(name), value_len = strlen(value);
+    size_t n = put_length(p, name_len, wide);
+    n += put_length(p + n, value_len, wide);
+    memcpy(p + n, name, name_len);
+    n += name_len;
+    memcpy(p + n, value, value_len);
+    return n + value_len;
+}
+
+/**
+ * Appends a FCGI_BEGIN_REQUEST record for the responder role.
+ */
+static void put_begin(stream *s, uint16_t id, int keep_conn)
+{
+    unsigned char body[8] = {0, 1, keep_conn};
+    put_record(s, FCGI_BEGIN_REQUEST, id, body, sizeof(body), 0);
+}
+
+/**
+ * Sends a stream to the connection in chunks and lets it process each one.
+ *
+ * @return The result of the last fcgi_conn_read() that didn't fail with
+ *         EAGAIN, i.e. -1 on a protocol error.
+ */
+static int feed(const stream *s, size_t chunk)
+{
+    for (size_t off = 0; off < s->len; off += chunk)
+    {
+        size_t len = s->len - off < chunk ? s->len - off : chunk;
+        TEST_ASSERT_EQUAL_INT(len, write(server_fd, s->data + off, len));
+        int ret;
+        while ((ret = fcgi_conn_read(conn)) == 1);
+        if (errno != EAGAIN)
+        {
+            return ret;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Reads everything the connection wrote to the web server.
+ */
+static size_t drain(unsigned char *buf, size_t cap)
+{
+    ssize_t n = read(server_fd, buf, cap);
+    return n < 0 ? 0 : n;
+}
+
+/**
+ * Finds the first record of a type in output written by the connection.
+ *
+ * @return The content of the record, NULL if there is no such record.
+ */
+static const unsigned char *find_record(
+    const unsigned char *buf,
+    size_t len,
+    unsigned char type,
+    uint16_t *id,
+    size_t *content_len)
+{
+    const unsigned char *p = buf, *end = buf + len;
+    while (end - p >= 8)
+    {
+        size_t clen = p[4] << 8 | p[5];
+        if (p[1] == type)
+        {
+            *id = p[2] << 8 | p[3];
+            *content_len = clen;
+            return p + 8;
+        }
+        p += 8 + clen + p[6];
+    }
+    return NULL;
+}
+
+/**
+ * Gets a parameter of a request.
+ */
+static const char *param(const fcgi_request *req, const char *name)
+{
+    size_t len = strlen(name);
+    for (const char *const *env = fcgi_request_envp(req); *env; ++env)
+    {
+        if (strncmp(*env, name, len) == 0 && (*env)[len] == '=')
+        {
+            return *env + len + 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Builds a complete request with the given FCGI_PARAMS content.
+ */
+static void put_request(stream *s, uint16_t id, const void *params, size_t len)
+{
+    put_begin(s, id, 1);
+    put_record(s, FCGI_PARAMS, id, params, len, 0);
+    put_record(s, FCGI_PARAMS, id, NULL, 0, 0);
+    put_record(s, FCGI_STDIN, id, NULL, 0, 0);
+}
+
+void test_fcgi_request()
+{
+    stream s = {.len = 0};
+    unsigned char params[256];
+    size_t len = put_pair(params, "REQUEST_METHOD", "GET", 0);
+    len += put_pair(params + len, "EMPTY", "", 0);
+    len += put_pair(params + len, "QUERY_STRING", "a=1", 0);
+    put_request(&s, 1, params, len);
+
+    TEST_ASSERT_EQUAL_INT(1, feed(&s, s.len));
+    fcgi_request *req = fcgi_conn_next_request(conn);
+    TEST_ASSERT_NOT_NULL(req);
+    TEST_ASSERT_EQUAL_STRING("GET", param(req, "REQUEST_METHOD"));
+    TEST_ASSERT_EQUAL_STRING("", param(req, "EMPTY"));
+    TEST_ASSERT_EQUAL_STRING("a=1", param(req, "QUERY_STRING"));
+    TEST_ASSERT_NULL(fcgi_request_envp(req)[3]);
+    TEST_ASSERT_NULL(fcgi_conn_next_request(conn));
+}
+
+void test_fcgi_split_headers()
+{
+    stream s = {.len = 0};
+    unsigned char params[64];
+    size_t len = put_pair(params, "SCRIPT_NAME", "/split", 0);
+    put_request(&s, 7, params, len);
+
+    /* One byte at a time splits every header and every length. */
+    TEST_ASSERT_EQUAL_INT(1, feed(&s, 1));
+    fcgi_request *req = fcgi_conn_next_request(conn);
+    TEST_ASSERT_NOT_NULL(req);
+    TEST_ASSERT_EQUAL_STRING("/split", param(req, "SCRIPT_NAME"));
+}
+
+void test_fcgi_padding()
+{
+    stream s = {.len = 0};
+    unsigned char params[64];
+    size_t len = put_pair(params, "PATH_INFO", "/padded", 0);
+    unsigned char begin[8] = {0, 1, 1};
+    put_record(&s, FCGI_BEGIN_REQUEST, 1, begin, sizeof(begin), 255);
+    put_record(&s, FCGI_PARAMS, 1, params, len, 3);
+    put_record(&s, FCGI_PARAMS, 1, NULL, 0, 8);
+    put_record(&s, FCGI_STDIN, 1, "body", 4, 4);
+    put_record(&s, FCGI_STDIN, 1, NULL, 0, 1);
+
+    TEST_ASSERT_EQUAL_INT(1, feed(&s, 5));
+    fcgi_request *req = fcgi_conn_next_request(conn);
+    TEST_ASSERT_NOT_NULL(req);
+    TEST_ASSERT_EQUAL_STRING("/padded", param(req, "PATH_INFO"));
+
+    char body[16];
+    TEST_ASSERT_EQUAL_INT(4, fcgi_request_read(req, body, sizeof(body)));
+    TEST_ASSERT_EQUAL_MEMORY("body", body, 4);
+}
+
+void test_fcgi_params_multi_record()
+{
+    stream s = {.len = 0};
+    unsigned char params[256];
+    size_t len = put_pair(params, "HTTP_HOST", "example.com", 0);
+    len += put_pair(params + len, "HTTP_ACCEPT", "text/html", 1);
+
+    /* Split inside the second pair's four byte length and its name. */
+    put_begin(&s, 1, 1);
+    put_record(&s, FCGI_PARAMS, 1, params, 3, 0);
+    put_record(&s, FCGI_PARAMS, 1, params + 3, 21, 0);
+    put_record(&s, FCGI_PARAMS, 1, params + 24, 9, 0);
+    put_record(&s, FCGI_PARAMS, 1, params + 33, len - 33, 0);
+    put_record(&s, FCGI_PARAMS, 1, NULL, 0, 0);
+    put_record(&s, FCGI_STDIN, 1, NULL, 0, 0);
+
+    TEST_ASSERT_EQUAL_INT(1, feed(&s, s.len));
+    fcgi_request *req = fcgi_conn_next_request(conn);
+    TEST_ASSERT_NOT_NULL(req);
+    TEST_ASSERT_EQUAL_STRING("example.com", param(req, "HTTP_HOST"));
+    TEST_ASSERT_EQUAL_STRING("text/html", param(req, "HTTP_ACCEPT"));
+}
+
+void test_fcgi_long_lengths()
+{
+    char value[301];
+    memset(value, 'v', 300);
+    value[300] = '\0';
+
+    stream s = {.len = 0};
+    unsigned char params[512];
+    size_t len = put_pair(params, "HTTP_COOKIE", value, 0);
+    len += put_pair(params + len, "A", "", 1);
+    put_request(&s, 1, params, len);
+
+    TEST_ASSERT_EQUAL_INT(1, feed(&s, s.len));
+    fcgi_request *req = fcgi_conn_next_request(conn);
+    TEST_ASSERT_NOT_NULL(req);
+    TEST_ASSERT_EQUAL_STRING(value, param(req, "HTTP_COOKIE"));
+    TEST_ASSERT_EQUAL_STRING("", param(req, "A"));
+}
+
+void test_fcgi_stdin()
+{
+    stream s = {.len = 0};
+    unsigned char params[64];
+    size_t len = put_pair(params, "CONTENT_LENGTH", "10", 0);
+    put_begin(&s, 1, 1);
+    put_record(&s, FCGI_PARAMS, 1, params, len, 0);
+    put_record(&s, FCGI_PARAMS, 1, NULL, 0, 0);
+    put_record(&s, FCGI_STDIN, 1, "01234", 5, 0);
+
+    /* Not ready until the body was received completely. */
+    TEST_ASSERT_EQUAL_INT(1, feed(&s, s.len));
+    TEST_ASSERT_NULL(fcgi_conn_next_request(conn));
+
+    s.len = 0;
+    put_record(&s, FCGI_STDIN, 1, "56789", 5, 0);
+    put_record(&s, FCGI_STDIN, 1, NULL, 0, 0);
+    TEST_ASSERT_EQUAL_INT(1, feed(&s, s.len));
+    fcgi_request *req = fcgi_conn_next_request(conn);
+    TEST_ASSERT_NOT_NULL(req);
+
+    char body[16];
+    TEST_ASSERT_EQUAL_INT(10, fcgi_request_read(req, body, sizeof(body)));
+    TEST_ASSERT_EQUAL_MEMORY("0123456789", body, 10);
+    TEST_ASSERT_EQUAL_INT(0, fcgi_request_read(req, body, sizeof(body)));
+}
+
+void test_fcgi_multiplexed()
+{
+    stream s = {.len = 0};
+    unsigned char params[64];
+    size_t len = put_pair(params, "N", "1", 0);
+    put_begin(&s, 1, 1);
+    put_begin(&s, 2, 1);
+    put_record(&s, FCGI_PARAMS, 2, params, len, 0);
+    put_record(&s, FCGI_PARAMS, 1, params, len, 0);
+    put_record(&s, FCGI_PARAMS, 2, NULL, 0, 0);
+    put_record(&s, FCGI_PARAMS, 1, NULL, 0, 0);
+    put_record(&s, FCGI_STDIN, 2, NULL, 0, 0);
+    put_record(&s, FCGI_STDIN, 1, NULL, 0, 0);
+
+    TEST_ASSERT_EQUAL_INT(1, feed(&s, s.len));
+    fcgi_request *first = fcgi_conn_next_request(conn);
+    fcgi_request *second = fcgi_conn_next_request(conn);
+    TEST_ASSERT_NOT_NULL(first);
+    TEST_ASSERT_NOT_NULL(second);
+    TEST_ASSERT_NULL(fcgi_conn_next_request(conn));
+
+    /* Requests are handed out in the order they became ready. */
+    TEST_ASSERT_EQUAL_INT(0, fcgi_request_finish(first, NULL, 0));
+    unsigned char out[256];
+    size_t out_len = drain(out, sizeof(out));
+    uint16_t id;
+    size_t clen;
+    TEST_ASSERT_NOT_NULL(
+        find_record(out, out_len, FCGI_END_REQUEST, &id, &clen)
+    );
+    TEST_ASSERT_EQUAL_INT(2, id);
+    TEST_ASSERT_EQUAL_INT(0, fcgi_request_finish(second, NULL, 0));
+}
+
+void test_fcgi_finish()
+{
+    stream s = {.len = 0};
+    unsigned char params[64];
+    size_t len = put_pair(params, "N", "1", 0);
+    put_begin(&s, 3, 0);
+    put_record(&s, FCGI_PARAMS, 3, params, len, 0);
+    put_record(&s, FCGI_PARAMS, 3, NULL, 0, 0);
+    put_record(&s, FCGI_STDIN, 3, NULL, 0, 0);
+
+    TEST_ASSERT_EQUAL_INT(1, feed(&s, s.len));
+    fcgi_request *req = fcgi_conn_next_request(conn);
+    TEST_ASSERT_NOT_NULL(req);
+
+    struct iovec iov[2] = {
+        {.iov_base = "Status: 200\r\n\r\n", .iov_len = 15},
+        {.iov_base = "hello", .iov_len = 5},
+    };
+    TEST_ASSERT_EQUAL_INT(0, fcgi_request_finish(req, iov, 2));
+    TEST_ASSERT_TRUE(fcgi_conn_closing(conn));
+
+    unsigned char out[256];
+    size_t out_len = drain(out, sizeof(out));
+    uint16_t id;
+    size_t clen;
+    const unsigned char *content =
+        find_record(out, out_len, FCGI_STDOUT, &id, &clen);
+    TEST_ASSERT_NOT_NULL(content);
+    TEST_ASSERT_EQUAL_INT(3, id);
+    TEST_ASSERT_EQUAL_INT(20, clen);
+    TEST_ASSERT_EQUAL_MEMORY("Status: 200\r\n\r\nhello", content, 20);
+
+    content = find_record(out, out_len, FCGI_END_REQUEST, &id, &clen);
+    TEST_ASSERT_NOT_NULL(content);
+    TEST_ASSERT_EQUAL_INT(3, id);
+    TEST_ASSERT_EQUAL_INT(8, clen);
+    TEST_ASSERT_EQUAL_INT(0, content[4]);
+}
+
+void test_fcgi_get_values()
+{
+    stream s = {.len = 0};
+    unsigned char query[128];
+    size_t len = put_pair(query, "FCGI_MAX_CONNS", "", 0);
+    len += put_pair(query + len, "FCGI_MPXS_CONNS", "", 1);
+    put_record(&s, FCGI_GET_VALUES, 0, query, len, 2);
+
+    TEST_ASSERT_EQUAL_INT(1, feed(&s, 3));
+
+    unsigned char out[256];
+    size_t out_len = drain(out, sizeof(out));
+    uint16_t id;
+    size_t clen;
+    const unsigned char *content =
+        find_record(out, out_len, FCGI_GET_VALUES_RESULT, &id, &clen);
+    TEST_ASSERT_NOT_NULL(content);
+    TEST_ASSERT_EQUAL_INT(0, id);
+    TEST_ASSERT_EQUAL_INT(18, clen);
+    TEST_ASSERT_EQUAL_MEMORY("\x0F\x01" "FCGI_MPXS_CONNS1", content, 18);
+}
+
+void test_fcgi_get_values_malformed()
+{
+    stream s = {.len = 0};
+    unsigned char query[] = {15, 0, 'F', 'C', 'G', 'I'};
+    put_record(&s, FCGI_GET_VALUES, 0, query, sizeof(query), 0);
+
+    TEST_ASSERT_EQUAL_INT(-1, feed(&s, s.len));
+    TEST_ASSERT_EQUAL_INT(EPROTO, errno);
+    TEST_ASSERT_TRUE(fcgi_conn_closing(conn));
+}
+
+void test_fcgi_abort()
+{
+    stream s = {.len = 0};
+    unsigned char params[64];
+    size_t len = put_pair(params, "N", "1", 0);
+    put_begin(&s, 5, 1);
+    put_record(&s, FCGI_PARAMS, 5, params, len, 0);
+    put_record(&s, FCGI_ABORT_REQUEST, 5, NULL, 0, 0);
+
+    TEST_ASSERT_EQUAL_INT(1, feed(&s, s.len));
+    TEST_ASSERT_NULL(fcgi_conn_next_request(conn));
+    TEST_ASSERT_FALSE(fcgi_conn_closing(conn));
+
+    unsigned char out[256];
+    size_t out_len = drain(out, sizeof(out));
+    uint16_t id;
+    size_t clen;
+    const unsigned char *content =
+        find_record(out, out_len, FCGI_END_REQUEST, &id, &clen);
+    TEST_ASSERT_NOT_NULL(content);
+    TEST_ASSERT_EQUAL_INT(5, id);
+    TEST_ASSERT_EQUAL_INT(0, content[4]);
+
+    /* Records for the aborted request are ignored and its id can be reused. */
+    s.len = 0;
+    put_record(&s, FCGI_STDIN, 5, "x", 1, 0);
+    put_request(&s, 5, params, len);
+    TEST_ASSERT_EQUAL_INT(1, feed(&s, s.len));
+    TEST_ASSERT_NOT_NULL(fcgi_conn_next_request(conn));
+}
+
+void test_fcgi_unknown_role()
+{
+    stream s = {.len = 0};
+    unsigned char body[8] = {0, 2};
+    put_record(&s, FCGI_BEGIN_REQUEST, 1, body, sizeof(body), 0);
+
+    TEST_ASSERT_EQUAL_INT(1, feed(&s, s.len));
+
+    unsigned char out[256];
+    size_t out_len = drain(out, sizeof(out));
+    uint16_t id;
+    size_t clen;
+    const unsigned char *content =
+        find_record(out, out_len, FCGI_END_REQUEST, &id, &clen);
+    TEST_ASSERT_NOT_NULL(content);
+    TEST_ASSERT_EQUAL_INT(1, id);
+    TEST_ASSERT_EQUAL_INT(3, content[4]);
+}
+
+void test_fcgi_unknown_type()
+{
+    stream s = {.len = 0};
+    put_record(&s, 42, 0, "abc", 3, 5);
+
+    TEST_ASSERT_EQUAL_INT(1, feed(&s, s.len));
+    TEST_ASSERT_FALSE(fcgi_conn_closing(conn));
+
+    unsigned char out[256];
+    size_t out_len = drain(out, sizeof(out));
+    uint16_t id;
+    size_t clen;
+    const unsigned char *content =
+        find_record(out, out_len, FCGI_UNKNOWN_TYPE, &id, &clen);
+    TEST_ASSERT_NOT_NULL(content);
+    TEST_ASSERT_EQUAL_INT(0, id);
+    TEST_ASSERT_EQUAL_INT(8, clen);
+    TEST_ASSERT_EQUAL_INT(42, content[0]);
+}
+
+void test_fcgi_bad_version()
+{
+    stream s = {.len = 0};
+    put_begin(&s, 1, 1);
+    s.data[0] = 2;
+
+    TEST_ASSERT_EQUAL_INT(-1, feed(&s, s.len));
+    TEST_ASSERT_EQUAL_INT(EPROTO, errno);
+    TEST_ASSERT_TRUE(fcgi_conn_closing(conn));
+}
+
+void test_fcgi_duplicate_id()
+{
+    stream s = {.len = 0};
+    put_begin(&s, 1, 1);
+    put_begin(&s, 1, 1);
+
+    TEST_ASSERT_EQUAL_INT(-1, feed(&s, s.len));
+    TEST_ASSERT_TRUE(fcgi_conn_closing(conn));
+}
+
+/**
+ * Sends a request with malformed parameters and checks that it's rejected.
+ */
+static void assert_params_rejected(const unsigned char *params, size_t len)
+{
+    stream s = {.len = 0};
+    put_request(&s, 1, params, len);
+
+    TEST_ASSERT_EQUAL_INT(-1, feed(&s, s.len));
+    TEST_ASSERT_EQUAL_INT(EPROTO, errno);
+    TEST_ASSERT_TRUE(fcgi_conn_closing(conn));
+    TEST_ASSERT_NULL(fcgi_conn_next_request(conn));
+}
+
+void test_fcgi_params_truncated_length()
+{
+    /* The name length is cut off. */
+    unsigned char params[] = {1, 1, 'A', 'B', 0x80, 0};
+    assert_params_rejected(params, sizeof(params));
+}
+
+void test_fcgi_params_missing_value_length()
+{
+    unsigned char params[] = {1, 1, 'A', 'B', 1};
+    assert_params_rejected(params, sizeof(params));
+}
+
+void test_fcgi_params_truncated_name()
+{
+    unsigned char params[] = {10, 0, 'A', 'B', 'C'};
+    assert_params_rejected(params, sizeof(params));
+}
+
+void test_fcgi_params_truncated_value()
+{
+    unsigned char params[] = {1, 0x80, 0, 0, 3, 'A', 'B', 'C'};
+    assert_params_rejected(params, sizeof(params));
+}
+
+void test_fcgi_params_huge_lengths()
+{
+    /* Lengths whose sum overflows must not pass the bounds check. */
+    unsigned char params[] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 'A', 'B',
+    };
+    assert_params_rejected(params, sizeof(params));
+}
+
+void test_fcgi_params_after_end()
+{
+    stream s = {.len = 0};
+    unsigned char params[64];
+    size_t len = put_pair(params, "N", "1", 0);
+    put_begin(&s, 1, 1);
+    put_record(&s, FCGI_PARAMS, 1, params, len, 0);
+    put_record(&s, FCGI_PARAMS, 1, NULL, 0, 0);
+
+    /* Enough to move the parameter buffer if it were appended to. */
+    unsigned char late[1024];
+    memset(late, 'x', sizeof(late));
+    put_record(&s, FCGI_PARAMS, 1, late, sizeof(late), 0);
+    put_record(&s, FCGI_STDIN, 1, NULL, 0, 0);
+
+    TEST_ASSERT_EQUAL_INT(-1, feed(&s, s.len));
+    TEST_ASSERT_EQUAL_INT(EPROTO, errno);
+    TEST_ASSERT_TRUE(fcgi_conn_closing(conn));
+    TEST_ASSERT_NULL(fcgi_conn_next_request(conn));
+}
+
+void test_fcgi_params_end_twice()
+{
+    stream s = {.len = 0};
+    unsigned char params[64];
+    size_t len = put_pair(params, "N", "1", 0);
+    put_begin(&s, 1, 1);
+    put_record(&s, FCGI_PARAMS, 1, params, len, 0);
+    put_record(&s, FCGI_PARAMS, 1, NULL, 0, 0);
+    put_record(&s, FCGI_PARAMS, 1, NULL, 0, 0);
+
+    TEST_ASSERT_EQUAL_INT(-1, feed(&s, s.len));
+    TEST_ASSERT_TRUE(fcgi_conn_closing(conn));
+}
+
+/**
+ * Sends records of a type with the largest content until more than limit bytes
+ * were sent or the connection stops reading.
+ */
+static void feed_large(unsigned char type, size_t limit)
+{
+    static unsigned char content[0xFFFF];
+    memset(content, 'x', sizeof(content));
+    for (size_t sent = 0; sent <= limit; sent += sizeof(content))
+    {
+        /* The content is sent in pieces to fit the stream buffer. */
+        stream s = {.data = {1, type, 0, 1, 0xFF, 0xFF, 0, 0}, .len = 8};
+        TEST_ASSERT_EQUAL_INT(1, feed(&s, s.len));
+        for (size_t off = 0; off < sizeof(content); off += 4096)
+        {
+            s.len = sizeof(content) - off < 4096 ? sizeof(content) - off : 4096;
+            memcpy(s.data, content + off, s.len);
+            TEST_ASSERT_EQUAL_INT(1, feed(&s, s.len));
+        }
+        if (fcgi_conn_closing(conn))
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * Checks that a request was answered with an HTTP error and ended.
+ */
+static void assert_refused(const char *status)
+{
+    TEST_ASSERT_TRUE(fcgi_conn_closing(conn));
+    TEST_ASSERT_NULL(fcgi_conn_next_request(conn));
+
+    unsigned char out[256];
+    size_t out_len = drain(out, sizeof(out));
+    uint16_t id;
+    size_t clen;
+    const unsigned char *content =
+        find_record(out, out_len, FCGI_STDOUT, &id, &clen);
+    TEST_ASSERT_NOT_NULL(content);
+    TEST_ASSERT_EQUAL_INT(1, id);
+    TEST_ASSERT_EQUAL_INT(strlen(status), clen);
+    TEST_ASSERT_EQUAL_MEMORY(status, content, clen);
+    TEST_ASSERT_NOT_NULL(
+        find_record(out, out_len, FCGI_END_REQUEST, &id, &clen)
+    );
+}
+
+void test_fcgi_body_too_large()
+{
+    stream s = {.len = 0};
+    unsigned char params[64];
+    size_t len = put_pair(params, "REQUEST_METHOD", "POST", 0);
+    put_begin(&s, 1, 1);
+    put_record(&s, FCGI_PARAMS, 1, params, len, 0);
+    put_record(&s, FCGI_PARAMS, 1, NULL, 0, 0);
+    TEST_ASSERT_EQUAL_INT(1, feed(&s, s.len));
+
+    feed_large(FCGI_STDIN, VLA_MAX_BODY_SIZE);
+    assert_refused("Status: 413 Payload Too Large\r\n\r\n");
+}
+
+void test_fcgi_params_too_large()
+{
+    stream s = {.len = 0};
+    put_begin(&s, 1, 1);
+    TEST_ASSERT_EQUAL_INT(1, feed(&s, s.len));
+
+    feed_large(FCGI_PARAMS, VLA_MAX_PARAMS_SIZE);
+    assert_refused("Status: 431 Request Header Fields Too Large\r\n\r\n");
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_fcgi_request);
+    RUN_TEST(test_fcgi_split_headers);
+    RUN_TEST(test_fcgi_padding);
+    RUN_TEST(test_fcgi_params_multi_record);
+    RUN_TEST(test_fcgi_long_lengths);
+    RUN_TEST(test_fcgi_stdin);
+    RUN_TEST(test_fcgi_multiplexed);
+    RUN_TEST(test_fcgi_finish);
+    RUN_TEST(test_fcgi_get_values);
+    RUN_TEST(test_fcgi_get_values_malformed);
+    RUN_TEST(test_fcgi_abort);
+    RUN_TEST(test_fcgi_unknown_role);
+    RUN_TEST(test_fcgi_unknown_type);
+    RUN_TEST(test_fcgi_bad_version);
+    RUN_TEST(test_fcgi_duplicate_id);
+    RUN_TEST(test_fcgi_params_truncated_length);
+    RUN_TEST(test_fcgi_params_missing_value_length);
+    RUN_TEST(test_fcgi_params_truncated_name);
+    RUN_TEST(test_fcgi_params_truncated_value);
+    RUN_TEST(test_fcgi_params_huge_lengths);
+    RUN_TEST(test_fcgi_params_after_end);
+    RUN_TEST(test_fcgi_params_end_twice);
+    RUN_TEST(test_fcgi_body_too_large);
+    RUN_TEST(test_fcgi_params_too_large);
+
+    return UNITY_END();
+}
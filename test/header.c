@@ -0,0 +1,102 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021 Ripose
+//
+// This file is part of Valhalla.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License version 3 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Additional permission under GNU AGPL version 3 section 7
+//
+// If you modify this Program, or any covered work, by linking or combining it
+// with FastCGI (or a modified version of that library), containing parts
+// covered by the terms of the FastCGI Open Market Licence, the licensors of
+// this Program grant you additional permission to convey the resulting work.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "unity/unity.h"
+
+#include <string.h>
+
+#include "../src/header.h"
+
+void setUp(void)
+{
+    header_init();
+}
+
+void tearDown(void)
+{
+
+}
+
+void test_header_id()
+{
+    TEST_ASSERT_EQUAL_INT(VLA_HDR_COOKIE, header_id("Cookie", 6));
+    TEST_ASSERT_EQUAL_INT(
+        VLA_HDR_CONTENT_TYPE,
+        header_id("Content-Type", sizeof("Content-Type") - 1)
+    );
+}
+
+void test_header_id_case()
+{
+    TEST_ASSERT_EQUAL_INT(
+        VLA_HDR_USER_AGENT,
+        header_id("user-AGENT", sizeof("user-AGENT") - 1)
+    );
+}
+
+void test_header_id_cgi()
+{
+    /* CGI parameter names have to be converted before looking them up. */
+    TEST_ASSERT_EQUAL_INT(
+        VLA_HDR_UNKNOWN,
+        header_id("X_FORWARDED_FOR", sizeof("X_FORWARDED_FOR") - 1)
+    );
+}
+
+void test_header_id_unknown()
+{
+    TEST_ASSERT_EQUAL_INT(VLA_HDR_UNKNOWN, header_id("X-Test", 6));
+    TEST_ASSERT_EQUAL_INT(VLA_HDR_UNKNOWN, header_id("Cookies", 7));
+    TEST_ASSERT_EQUAL_INT(VLA_HDR_UNKNOWN, header_id("Cookie", 5));
+    TEST_ASSERT_EQUAL_INT(VLA_HDR_UNKNOWN, header_id("", 0));
+}
+
+void test_header_name()
+{
+    for (unsigned id = VLA_HDR_UNKNOWN + 1; id < VLA_HDR_SIZE; ++id)
+    {
+        const char *name = header_name(id);
+        TEST_ASSERT_NOT_NULL(name);
+        TEST_ASSERT_EQUAL_INT(id, header_id(name, strlen(name)));
+        TEST_ASSERT_TRUE(strlen(name) <= HEADER_NAME_MAX);
+    }
+    TEST_ASSERT_NULL(header_name(VLA_HDR_UNKNOWN));
+    TEST_ASSERT_NULL(header_name(VLA_HDR_SIZE));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_header_id);
+    RUN_TEST(test_header_id_case);
+    RUN_TEST(test_header_id_cgi);
+    RUN_TEST(test_header_id_unknown);
+    RUN_TEST(test_header_name);
+
+    return UNITY_END();
+}
@@ -0,0 +1,249 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021 Ripose
+//
+// This file is part of Valhalla.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License version 3 as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Additional permission under GNU AGPL version 3 section 7
+//
+// If you modify this Program, or any covered work, by linking or combining it
+// with FastCGI (or a modified version of that library), containing parts
+// covered by the terms of the FastCGI Open Market Licence, the licensors of
+// this Program grant you additional permission to convey the resulting work.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "unity/unity.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/include/valhalla.h"
+
+/* The socket the children accept requests on. */
+static char path[64];
+
+/* The process running vla_accept_prefork(). */
+static pid_t supervisor = -1;
+
+/**
+ * Responds with the process id of the child handling the request.
+ */
+static enum vla_handle_code handler_pid(const vla_request *req, void *arg)
+{
+    (void)arg;
+    vla_printf(req, "%d", (int)getpid());
+    return VLA_HANDLE_RESPOND_ACCEPT;
+}
+
+/**
+ * Forks a supervisor with n children.
+ */
+static void start_supervisor(size_t n)
+{
+    vla_context *ctx = vla_init();
+    TEST_ASSERT_NOT_NULL(ctx);
+    TEST_ASSERT_EQUAL_INT(0, vla_listen(ctx, path, 16));
+    TEST_ASSERT_EQUAL_INT(
+        0, vla_add_route(ctx, VLA_HTTP_GET, "/pid", handler_pid, NULL, NULL)
+    );
+
+    supervisor = fork();
+    TEST_ASSERT_TRUE(supervisor >= 0);
+    if (supervisor == 0)
+    {
+        _exit(vla_accept_prefork(ctx, n) ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    vla_free(ctx);
+}
+
+/**
+ * Gets the time of a monotonic clock in milliseconds.
+ */
+static long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Waits for the supervisor to exit.
+ *
+ * @return The wait status, -1 if it didn't exit within timeout_ms.
+ */
+static int wait_supervisor(long timeout_ms)
+{
+    long deadline = now_ms() + timeout_ms;
+    int status;
+    while (waitpid(supervisor, &status, WNOHANG) == 0)
+    {
+        if (now_ms() > deadline)
+        {
+            return -1;
+        }
+        usleep(10000);
+    }
+    supervisor = -1;
+    return status;
+}
+
+/**
+ * Appends a FastCGI record to buf.
+ */
+static size_t put_record(
+    unsigned char *buf,
+    unsigned char type,
+    const void *content,
+    size_t len)
+{
+    unsigned char hdr[8] = {1, type, 0, 1, len >> 8, len & 0xFF, 0, 0};
+    memcpy(buf, hdr, sizeof(hdr));
+    if (len > 0)
+    {
+        memcpy(buf + sizeof(hdr), content, len);
+    }
+    return sizeof(hdr) + len;
+}
+
+/**
+ * Sends GET /pid to a child.
+ *
+ * @return The process id of the child that answered, -1 on error.
+ */
+static pid_t request_pid(void)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, path);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        close(fd);
+        return -1;
+    }
+
+    static const unsigned char begin[8] = {0, 1, 0};
+    static const unsigned char params[] =
+        "\x0E\x03" "REQUEST_METHOD" "GET"
+        "\x0C\x04" "DOCUMENT_URI" "/pid";
+    unsigned char req[128];
+    size_t len = put_record(req, 1, begin, sizeof(begin));
+    len += put_record(req + len, 4, params, sizeof(params) - 1);
+    len += put_record(req + len, 4, NULL, 0);
+    len += put_record(req + len, 5, NULL, 0);
+    if (write(fd, req, len) != (ssize_t)len)
+    {
+        close(fd);
+        return -1;
+    }
+
+    /* The child closes the connection after responding. */
+    char resp[1024];
+    size_t resp_len = 0;
+    ssize_t n;
+    while (resp_len < sizeof(resp) - 1 &&
+           (n = read(fd, resp + resp_len, sizeof(resp) - 1 - resp_len)) > 0)
+    {
+        resp_len += n;
+    }
+    close(fd);
+
+    /* The body ends the first FCGI_STDOUT record. */
+    if (resp_len < 8 || resp[1] != 6)
+    {
+        return -1;
+    }
+    size_t content_len = (unsigned char)resp[4] << 8 | (unsigned char)resp[5];
+    resp[8 + content_len] = '\0';
+    const char *body = strstr(resp + 8, "\r\n\r\n");
+    return body ? atoi(body + 4) : -1;
+}
+
+void setUp(void)
+{
+    snprintf(path, sizeof(path), "/tmp/valhalla-test-%d.sock", (int)getpid());
+}
+
+void tearDown(void)
+{
+    if (supervisor > 0)
+    {
+        kill(supervisor, SIGKILL);
+        waitpid(supervisor, NULL, 0);
+        supervisor = -1;
+    }
+    unlink(path);
+}
+
+void test_prefork_stop()
+{
+    start_supervisor(2);
+    TEST_ASSERT_TRUE(request_pid() > 0);
+
+    kill(supervisor, SIGTERM);
+    int status = wait_supervisor(2000);
+    TEST_ASSERT_TRUE(WIFEXITED(status));
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, WEXITSTATUS(status));
+}
+
+void test_prefork_respawn()
+{
+    start_supervisor(1);
+    pid_t child = request_pid();
+    TEST_ASSERT_TRUE(child > 0);
+
+    /* The only child is replaced. It died right after starting, so the
+     * replacement is delayed, and the request waits in the backlog. */
+    kill(child, SIGKILL);
+    pid_t replacement = request_pid();
+    TEST_ASSERT_TRUE(replacement > 0);
+    TEST_ASSERT_NOT_EQUAL(child, replacement);
+
+    kill(supervisor, SIGTERM);
+    TEST_ASSERT_TRUE(WIFEXITED(wait_supervisor(2000)));
+}
+
+void test_prefork_stop_while_delayed()
+{
+    start_supervisor(1);
+    pid_t child = request_pid();
+    TEST_ASSERT_TRUE(child > 0);
+
+    /* Stopping doesn't wait for the delayed restart. */
+    kill(child, SIGKILL);
+    usleep(50000);
+    long start = now_ms();
+    kill(supervisor, SIGTERM);
+    TEST_ASSERT_TRUE(WIFEXITED(wait_supervisor(2000)));
+    TEST_ASSERT_TRUE(now_ms() - start < 500);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_prefork_stop);
+    RUN_TEST(test_prefork_respawn);
+    RUN_TEST(test_prefork_stop_while_delayed);
+
+    return UNITY_END();
+}
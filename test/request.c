@@ -424,6 +424,75 @@ void test_get_header_case()
     start_request();
 }
 
+enum vla_handle_code handler_get_header_id(const vla_request *req, void *nul)
+{
+    const char *val = vla_request_header_get_id(req, VLA_HDR_X_REQUESTED_WITH);
+    TEST_ASSERT_EQUAL_STRING("test", val);
+    val = vla_request_header_get(req, "x-requested-with");
+    TEST_ASSERT_EQUAL_STRING("test", val);
+    return VLA_HANDLE_RESPOND_TERM;
+}
+
+void test_get_header_id()
+{
+    const char *route = "/request";
+    int ret = vla_add_route(
+        ctx,
+        VLA_HTTP_GET, route,
+        handler_get_header_id, NULL,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    r_params.headers = curl_slist_append(
+        r_params.headers, "X-Requested-With: test"
+    );
+
+    start_request();
+}
+
+int callback_header_names(const char *name, const char *val, void *count)
+{
+    /* Well-known and other headers are capitalized the same way. */
+    if (strcmp(name, "X-Requested-With") == 0 ||
+        strcmp(name, "X-Test-Header") == 0)
+    {
+        TEST_ASSERT_EQUAL_STRING("test", val);
+        *(int *)count += 1;
+    }
+    return 0;
+}
+
+enum vla_handle_code handler_header_names(const vla_request *req, void *nul)
+{
+    int count = 0;
+    int ret = vla_request_header_iterate(req, callback_header_names, &count);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    TEST_ASSERT_EQUAL_INT(2, count);
+    return VLA_HANDLE_RESPOND_TERM;
+}
+
+void test_header_names()
+{
+    const char *route = "/request";
+    int ret = vla_add_route(
+        ctx,
+        VLA_HTTP_GET, route,
+        handler_header_names, NULL,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    r_params.headers = curl_slist_append(
+        r_params.headers, "x-requested-with: test"
+    );
+    r_params.headers = curl_slist_append(
+        r_params.headers, "X-TEST-HEADER: test"
+    );
+
+    start_request();
+}
+
 enum vla_handle_code handler_get_header_missing(
     const vla_request *req,
     void *nul)
@@ -1102,6 +1171,79 @@ void test_middleware()
     TEST_ASSERT_EQUAL_STRING("Success!", res_body);
 }
 
+/* Discards the body of a response. */
+static size_t discard_body(void *data, size_t size, size_t nmemb, void *nul)
+{
+    return size * nmemb;
+}
+
+/* Sends a GET request to /request using its own curl handle. */
+static void *thread_send_plain_request(void *arg)
+{
+    usleep(1 * 1000); // 1ms
+
+    CURL *curl = curl_easy_init();
+    TEST_ASSERT_NOT_NULL(curl);
+    curl_easy_setopt(curl, CURLOPT_URL, "http://localhost/request");
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_body);
+
+    CURLcode code = curl_easy_perform(curl);
+    TEST_ASSERT_EQUAL(CURLE_OK, code);
+    curl_easy_cleanup(curl);
+
+    return NULL;
+}
+
+/* Counts requests handled across threads. */
+typedef struct thread_counter
+{
+    pthread_mutex_t lock;
+    size_t count;
+} thread_counter;
+
+enum vla_handle_code handler_accept_threads(const vla_request *req, void *ptr)
+{
+    thread_counter *counter = ptr;
+    pthread_mutex_lock(&counter->lock);
+    size_t count = ++counter->count;
+    pthread_mutex_unlock(&counter->lock);
+    vla_puts(req, "Success!");
+    return count < 2 ? VLA_HANDLE_RESPOND_ACCEPT : VLA_HANDLE_RESPOND_TERM;
+}
+
+void test_accept_threads()
+{
+    thread_counter counter = {.count = 0};
+    pthread_mutex_init(&counter.lock, NULL);
+
+    const char *route = "/request";
+    int ret = vla_add_route(
+        ctx,
+        VLA_HTTP_GET, route,
+        handler_accept_threads, &counter,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    pthread_t tids[2];
+    for (size_t i = 0; i < 2; ++i)
+    {
+        int code = pthread_create(
+            &tids[i], NULL, thread_send_plain_request, NULL
+        );
+        TEST_ASSERT_EQUAL_INT(0, code);
+    }
+    ret = vla_accept_threads(ctx, 2);
+    for (size_t i = 0; i < 2; ++i)
+    {
+        pthread_join(tids[i], NULL);
+    }
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    TEST_ASSERT_EQUAL_size_t(2, counter.count);
+
+    pthread_mutex_destroy(&counter.lock);
+}
+
 int main(void)
 {
     UNITY_BEGIN();
@@ -1118,6 +1260,8 @@ int main(void)
 
     RUN_TEST(test_get_header);
     RUN_TEST(test_get_header_case);
+    RUN_TEST(test_get_header_id);
+    RUN_TEST(test_header_names);
     RUN_TEST(test_get_header_missing);
 
     RUN_TEST(test_get_cookie);
@@ -1151,5 +1295,7 @@ int main(void)
 
     RUN_TEST(test_middleware);
 
+    RUN_TEST(test_accept_threads);
+
     return UNITY_END();
 }
\ No newline at end of file
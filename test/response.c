@@ -30,6 +30,7 @@
 #include "../src/request.h"
 
 #include <pthread.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -882,6 +883,49 @@ void test_header_get_multi()
     helper_header_value_exists("x-test-header: ", "Tacos");
 }
 
+enum vla_handle_code handler_header_get_many(const vla_request *req, void *nul)
+{
+    /* Enough headers for the lookups to go through the hash index. */
+    char name[32];
+    char value[32];
+    for (int i = 0; i < 40; ++i)
+    {
+        snprintf(name, sizeof(name), "X-Many-%d", i % 20);
+        snprintf(value, sizeof(value), "%d", i);
+        int ret = vla_response_header_add(req, name, value, NULL);
+        TEST_ASSERT_EQUAL_INT(0, ret);
+    }
+
+    int ret = vla_response_header_remove(req, "x-many-3", 0);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    TEST_ASSERT_EQUAL_size_t(1, vla_response_header_count(req, "x-many-3"));
+    TEST_ASSERT_EQUAL_size_t(2, vla_response_header_count(req, "x-many-4"));
+
+    const char *val = vla_response_header_get(req, "x-many-4", 1);
+    TEST_ASSERT_NOT_NULL(val);
+    TEST_ASSERT_EQUAL_STRING("24", val);
+    ret = vla_free((char *)val);
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    return VLA_HANDLE_RESPOND_TERM;
+}
+
+void test_header_get_many()
+{
+    int ret = vla_add_route(
+        ctx,
+        VLA_HTTP_GET, "/response",
+        handler_header_get_many, NULL,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    start_request();
+
+    helper_header_value_exists("x-many-3: ", "23");
+    helper_header_value_exists("x-many-19: ", "39");
+}
+
 enum vla_handle_code handler_header_get_not_exist(
     const vla_request *req,
     void *nul)
@@ -1737,6 +1781,7 @@ void main()
 
     RUN_TEST(test_header_get);
     RUN_TEST(test_header_get_multi);
+    RUN_TEST(test_header_get_many);
     RUN_TEST(test_header_get_not_exist);
     RUN_TEST(test_header_get_after_remove);
 
@@ -28,6 +28,7 @@
 #include "unity/unity.h"
 
 #include <stdarg.h>
+#include <string.h>
 
 #include <talloc.h>
 
@@ -293,7 +294,7 @@ void test_route_capture_wrong()
     TEST_ASSERT_EQUAL_INT(0, ret);
 
     /* Wrong Method */
-    const route_info_t *info = route_get(root, "/test/1", VLA_HTTP_HEAD);
+    const route_info_t *info = route_get(root, "/test/1", VLA_HTTP_POST);
     TEST_ASSERT_NULL(info);
 
     /* Wrong URI */
@@ -621,6 +622,398 @@ void test_route_any_method()
     talloc_free(root);
 }
 
+void test_route_shared_prefix()
+{
+    route_node_t *root = route_init_root(NULL);
+    TEST_ASSERT_NOT_NULL(root);
+
+    const char *routes[] = {
+        "/books",
+        "/book",
+        "/bookmarks/:id",
+        "/bo",
+        "/authors/:id/books",
+        "/authors",
+    };
+    for (size_t i = 0; i < 6; ++i)
+    {
+        int ret = helper_route_add(
+            root,
+            VLA_HTTP_GET,
+            routes[i],
+            NULL, (void *)(i + 1),
+            NULL
+        );
+        TEST_ASSERT_EQUAL_INT(0, ret);
+    }
+
+    const char *uris[] = {
+        "/books",
+        "/book",
+        "/bookmarks/7",
+        "/bo",
+        "/authors/7/books",
+        "/authors",
+    };
+    for (size_t i = 0; i < 6; ++i)
+    {
+        const route_info_t *info = route_get(root, uris[i], VLA_HTTP_GET);
+        TEST_ASSERT_NOT_NULL(info);
+        TEST_ASSERT_EQUAL_PTR((void *)(i + 1), info->hdlr_arg);
+    }
+
+    TEST_ASSERT_NULL(route_get(root, "/b", VLA_HTTP_GET));
+    TEST_ASSERT_NULL(route_get(root, "/boo", VLA_HTTP_GET));
+    TEST_ASSERT_NULL(route_get(root, "/bookmarks", VLA_HTTP_GET));
+    TEST_ASSERT_NULL(route_get(root, "/authors/7", VLA_HTTP_GET));
+
+    /* Splitting a prefix must not allow a capture where an exact route is. */
+    int ret = helper_route_add(
+        root,
+        VLA_HTTP_GET,
+        "/boo:id",
+        NULL, NULL,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(1, ret);
+
+    talloc_free(root);
+}
+
+void test_route_freeze()
+{
+    route_node_t *root = route_init_root(NULL);
+    TEST_ASSERT_NOT_NULL(root);
+
+    int ret = helper_route_add(
+        root,
+        VLA_HTTP_GET,
+        "/test/:id/book",
+        NULL, (void *)1,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    ret = helper_route_add(
+        root,
+        VLA_HTTP_GET,
+        "/static/*",
+        NULL, (void *)2,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    TEST_ASSERT_EQUAL_INT(0, route_freeze(root));
+
+    const route_info_t *info = route_get(root, "/test/1/book", VLA_HTTP_GET);
+    TEST_ASSERT_NOT_NULL(info);
+    TEST_ASSERT_EQUAL_PTR((void *)1, info->hdlr_arg);
+    info = route_get(root, "/static/css/main.css", VLA_HTTP_GET);
+    TEST_ASSERT_NOT_NULL(info);
+    TEST_ASSERT_EQUAL_PTR((void *)2, info->hdlr_arg);
+    TEST_ASSERT_NULL(route_get(root, "/test/1", VLA_HTTP_GET));
+    TEST_ASSERT_NULL(route_get(root, "/test/1/book", VLA_HTTP_POST));
+
+    /* Adding a route discards the frozen tree. */
+    ret = helper_route_add(
+        root,
+        VLA_HTTP_GET,
+        "/test",
+        NULL, (void *)3,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    info = route_get(root, "/test", VLA_HTTP_GET);
+    TEST_ASSERT_NOT_NULL(info);
+    TEST_ASSERT_EQUAL_PTR((void *)3, info->hdlr_arg);
+
+    talloc_free(root);
+}
+
+void test_route_freeze_rejected_add()
+{
+    route_node_t *root = route_init_root(NULL);
+    TEST_ASSERT_NOT_NULL(root);
+
+    int ret = helper_route_add(
+        root,
+        VLA_HTTP_GET,
+        "/test/:id",
+        NULL, (void *)1,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    TEST_ASSERT_EQUAL_INT(0, route_freeze(root));
+    size_t size = talloc_total_size(root);
+
+    /* Rejected routes leave the tree unchanged, so the frozen tree is kept. */
+    ret = helper_route_add(
+        root,
+        VLA_HTTP_GET,
+        "/test/:id",
+        NULL, (void *)2,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(1, ret);
+    ret = helper_route_add(root, VLA_HTTP_GET, "test", NULL, NULL, NULL);
+    TEST_ASSERT_EQUAL_INT(-1, ret);
+    TEST_ASSERT_EQUAL_size_t(size, talloc_total_size(root));
+
+    const route_info_t *info = route_get(root, "/test/1", VLA_HTTP_GET);
+    TEST_ASSERT_NOT_NULL(info);
+    TEST_ASSERT_EQUAL_PTR((void *)1, info->hdlr_arg);
+
+    talloc_free(root);
+}
+
+void test_route_get_tree()
+{
+    route_node_t *root = route_init_root(NULL);
+    TEST_ASSERT_NOT_NULL(root);
+
+    int ret = helper_route_add(
+        root,
+        VLA_HTTP_GET,
+        "/api/health",
+        NULL, (void *)1,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    /* Static routes are in the tree as well as in their hash. */
+    const route_info_t *info = route_get_tree(root, "/api/health", VLA_HTTP_GET);
+    TEST_ASSERT_NOT_NULL(info);
+    TEST_ASSERT_EQUAL_PTR((void *)1, info->hdlr_arg);
+    TEST_ASSERT_NULL(route_get_tree(root, "/api", VLA_HTTP_GET));
+
+    TEST_ASSERT_EQUAL_INT(0, route_freeze(root));
+    info = route_get_tree(root, "/api/health", VLA_HTTP_GET);
+    TEST_ASSERT_NOT_NULL(info);
+    TEST_ASSERT_EQUAL_PTR((void *)1, info->hdlr_arg);
+    TEST_ASSERT_NULL(route_get_tree(root, "/api/health", VLA_HTTP_POST));
+
+    talloc_free(root);
+}
+
+void test_route_match_type()
+{
+    route_node_t *root = route_init_root(NULL);
+    TEST_ASSERT_NOT_NULL(root);
+
+    int ret = helper_route_add(
+        root,
+        VLA_HTTP_GET,
+        "/api/v1/health",
+        NULL, (void *)1,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    ret = helper_route_add(
+        root,
+        VLA_HTTP_GET,
+        "/api/v1/users/:id",
+        NULL, (void *)2,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    route_match match;
+    const route_info_t *info = route_lookup(
+        root, "/api/v1/health", VLA_HTTP_GET, &match
+    );
+    TEST_ASSERT_NOT_NULL(info);
+    TEST_ASSERT_EQUAL_PTR((void *)1, info->hdlr_arg);
+    TEST_ASSERT_EQUAL_INT(ROUTE_MATCH_STATIC, match.type);
+
+    info = route_lookup(root, "/api/v1/users/7", VLA_HTTP_GET, &match);
+    TEST_ASSERT_NOT_NULL(info);
+    TEST_ASSERT_EQUAL_PTR((void *)2, info->hdlr_arg);
+    TEST_ASSERT_EQUAL_INT(ROUTE_MATCH_DYNAMIC, match.type);
+
+    info = route_lookup(root, "/api/v1/health", VLA_HTTP_POST, &match);
+    TEST_ASSERT_NULL(info);
+    TEST_ASSERT_EQUAL_INT(ROUTE_MATCH_NONE, match.type);
+
+    info = route_lookup(root, "/api/v1", VLA_HTTP_GET, &match);
+    TEST_ASSERT_NULL(info);
+    TEST_ASSERT_EQUAL_INT(ROUTE_MATCH_NONE, match.type);
+
+    talloc_free(root);
+}
+
+void test_route_captures()
+{
+    route_node_t *root = route_init_root(NULL);
+    TEST_ASSERT_NOT_NULL(root);
+
+    int ret = helper_route_add(
+        root,
+        VLA_HTTP_GET,
+        "/users/:user/books/:book",
+        NULL, NULL,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    for (int frozen = 0; frozen < 2; ++frozen)
+    {
+        route_match match;
+        const char *uri = "/users/ripose/books/42";
+        const route_info_t *info = route_lookup(
+            root, uri, VLA_HTTP_GET, &match
+        );
+        TEST_ASSERT_NOT_NULL(info);
+        TEST_ASSERT_EQUAL_size_t(2, info->n_params);
+        TEST_ASSERT_EQUAL_STRING("user", info->params[0]);
+        TEST_ASSERT_EQUAL_STRING("book", info->params[1]);
+
+        TEST_ASSERT_EQUAL_size_t(2, match.n_captures);
+        TEST_ASSERT_EQUAL_UINT32(7, match.captures[0].offset);
+        TEST_ASSERT_EQUAL_UINT32(6, match.captures[0].len);
+        TEST_ASSERT_EQUAL_UINT32(20, match.captures[1].offset);
+        TEST_ASSERT_EQUAL_UINT32(2, match.captures[1].len);
+
+        TEST_ASSERT_EQUAL_INT(0, route_freeze(root));
+    }
+
+    char route[128] = "";
+    for (int i = 0; i <= ROUTE_MAX_CAPTURES; ++i)
+    {
+        strcat(route, "/:a");
+    }
+    ret = helper_route_add(
+        root,
+        VLA_HTTP_GET,
+        route,
+        NULL, NULL,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(-1, ret);
+
+    talloc_free(root);
+}
+
+void test_route_cache()
+{
+    route_node_t *root = route_init_root(NULL);
+    TEST_ASSERT_NOT_NULL(root);
+    route_cache *cache = route_cache_new(root);
+    TEST_ASSERT_NOT_NULL(cache);
+
+    int ret = helper_route_add(
+        root,
+        VLA_HTTP_GET,
+        "/users/:user",
+        NULL, (void *)1,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    const char *uris[] = {"/users/ripose", "/users/ripose", "/users/odin"};
+    const int cached[] = {0, 1, 0};
+    for (size_t i = 0; i < 3; ++i)
+    {
+        route_match match;
+        const route_info_t *info = route_cache_lookup(
+            cache, root, uris[i], VLA_HTTP_GET, &match
+        );
+        TEST_ASSERT_NOT_NULL(info);
+        TEST_ASSERT_EQUAL_PTR((void *)1, info->hdlr_arg);
+        TEST_ASSERT_EQUAL_INT(cached[i], match.cached);
+        TEST_ASSERT_EQUAL_INT(ROUTE_MATCH_DYNAMIC, match.type);
+        TEST_ASSERT_EQUAL_size_t(1, match.n_captures);
+        TEST_ASSERT_EQUAL_UINT32(7, match.captures[0].offset);
+        TEST_ASSERT_EQUAL_UINT32(strlen(uris[i]) - 7, match.captures[0].len);
+    }
+
+    /* The method is part of the key, and misses are cached too. */
+    route_match match;
+    for (int i = 0; i < 2; ++i)
+    {
+        const route_info_t *info = route_cache_lookup(
+            cache, root, "/users/odin", VLA_HTTP_POST, &match
+        );
+        TEST_ASSERT_NULL(info);
+        TEST_ASSERT_EQUAL_INT(i, match.cached);
+        TEST_ASSERT_EQUAL_INT(ROUTE_MATCH_NONE, match.type);
+    }
+
+    talloc_free(root);
+}
+
+void test_route_head_and_allow()
+{
+    route_node_t *root = route_init_root(NULL);
+    TEST_ASSERT_NOT_NULL(root);
+
+    int ret = helper_route_add(
+        root,
+        VLA_HTTP_GET | VLA_HTTP_PUT,
+        "/docs/:id",
+        NULL, (void *)1,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    ret = helper_route_add(
+        root,
+        VLA_HTTP_DELETE,
+        "/docs/:id",
+        NULL, (void *)2,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    ret = helper_route_add(
+        root,
+        VLA_HTTP_GET,
+        "/status",
+        NULL, (void *)3,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(0, ret);
+    ret = helper_route_add(
+        root,
+        VLA_HTTP_HEAD,
+        "/status",
+        NULL, (void *)4,
+        NULL
+    );
+    TEST_ASSERT_EQUAL_INT(0, ret);
+
+    for (int frozen = 0; frozen < 2; ++frozen)
+    {
+        /* HEAD falls back to GET unless the route has a HEAD handler. */
+        route_match match;
+        const route_info_t *info = route_lookup(
+            root, "/docs/3", VLA_HTTP_HEAD, &match
+        );
+        TEST_ASSERT_NOT_NULL(info);
+        TEST_ASSERT_EQUAL_PTR((void *)1, info->hdlr_arg);
+        TEST_ASSERT_NULL(match.allow);
+        info = route_lookup(root, "/status", VLA_HTTP_HEAD, &match);
+        TEST_ASSERT_NOT_NULL(info);
+        TEST_ASSERT_EQUAL_PTR((void *)4, info->hdlr_arg);
+
+        info = route_lookup(root, "/docs/3", VLA_HTTP_POST, &match);
+        TEST_ASSERT_NULL(info);
+        TEST_ASSERT_EQUAL_INT(ROUTE_MATCH_NONE, match.type);
+        TEST_ASSERT_EQUAL_STRING("GET, HEAD, PUT, DELETE", match.allow);
+        info = route_lookup(root, "/status", VLA_HTTP_PATCH, &match);
+        TEST_ASSERT_NULL(info);
+        TEST_ASSERT_EQUAL_STRING("GET, HEAD", match.allow);
+
+        /* Missing routes have nothing to allow. */
+        info = route_lookup(root, "/docs", VLA_HTTP_POST, &match);
+        TEST_ASSERT_NULL(info);
+        TEST_ASSERT_NULL(match.allow);
+        info = route_lookup(root, "/docs/3", VLA_HTTP_UNKNOWN, &match);
+        TEST_ASSERT_NULL(info);
+        TEST_ASSERT_NOT_NULL(match.allow);
+
+        TEST_ASSERT_EQUAL_INT(0, route_freeze(root));
+    }
+
+    talloc_free(root);
+}
+
 int main(void)
 {
     UNITY_BEGIN();
@@ -641,5 +1034,13 @@ int main(void)
     RUN_TEST(test_malformed_route);
     RUN_TEST(test_route_capture_and_match);
     RUN_TEST(test_route_any_method);
+    RUN_TEST(test_route_shared_prefix);
+    RUN_TEST(test_route_freeze);
+    RUN_TEST(test_route_freeze_rejected_add);
+    RUN_TEST(test_route_get_tree);
+    RUN_TEST(test_route_match_type);
+    RUN_TEST(test_route_captures);
+    RUN_TEST(test_route_cache);
+    RUN_TEST(test_route_head_and_allow);
     return UNITY_END();
 }
\ No newline at end of file
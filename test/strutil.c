@@ -67,6 +67,42 @@ void test_strchrnul_empty()
     TEST_ASSERT_EQUAL_CHAR('\0', *ch);
 }
 
+void test_strpbrknul_found()
+{
+    const char *str = "key=value&next";
+    const char *ch = su_strpbrknul(str, "&=");
+    TEST_ASSERT_EQUAL_PTR(&str[3], ch);
+    TEST_ASSERT_EQUAL_CHAR('=', *ch);
+}
+
+void test_strpbrknul_not_found()
+{
+    const char *str = "0123456789";
+    const char *ch = su_strpbrknul(str, ":*");
+    TEST_ASSERT_EQUAL_PTR(&str[10], ch);
+    TEST_ASSERT_EQUAL_CHAR('\0', *ch);
+}
+
+void test_strpbrknul_long()
+{
+    /* Every offset, so delimiters land at both ends of the scanned blocks. */
+    char str[100];
+    memset(str, 'a', sizeof(str) - 1);
+    str[sizeof(str) - 1] = '\0';
+    for (size_t start = 0; start < 40; ++start)
+    {
+        for (size_t at = start; at < sizeof(str) - 1; ++at)
+        {
+            str[at] = ';';
+            TEST_ASSERT_EQUAL_PTR(&str[at], su_strpbrknul(str + start, "=;"));
+            str[at] = 'a';
+        }
+        TEST_ASSERT_EQUAL_PTR(
+            &str[sizeof(str) - 1], su_strpbrknul(str + start, "=;")
+        );
+    }
+}
+
 void test_url_encode()
 {
     const char *str = "test";
@@ -135,6 +171,63 @@ void test_url_encode_l()
     talloc_free(res);
 }
 
+void test_url_encode_long()
+{
+    /* Long enough for escapes on both sides of every vector boundary. */
+    char str[128], enc[384];
+    size_t str_l = 0, enc_l = 0;
+    for (size_t i = 0; str_l < sizeof(str) - 1; ++i)
+    {
+        switch (i % 7)
+        {
+        case 0:
+            str[str_l++] = '/';
+            memcpy(enc + enc_l, "%2F", 3);
+            enc_l += 3;
+            break;
+
+        case 3:
+            str[str_l++] = ' ';
+            enc[enc_l++] = '+';
+            break;
+
+        default:
+            str[str_l++] = 'A' + i % 26;
+            enc[enc_l++] = 'A' + i % 26;
+            break;
+        }
+    }
+    str[str_l] = '\0';
+    enc[enc_l] = '\0';
+
+    TEST_ASSERT_EQUAL_size_t(enc_l, su_url_encoded_len(str, str_l));
+    char *res = su_url_encode(NULL, str);
+    TEST_ASSERT_NOT_NULL(res);
+    TEST_ASSERT_EQUAL_STRING(enc, res);
+    TEST_ASSERT_EQUAL_size_t(enc_l + 1, talloc_get_size(res));
+    talloc_free(res);
+}
+
+void test_url_encode_buf()
+{
+    const char *str = "/a b~";
+    char buf[sizeof("%2Fa+b~")];
+    size_t len = su_url_encode_buf(buf, str, strlen(str));
+    TEST_ASSERT_EQUAL_size_t(sizeof(buf) - 1, len);
+    TEST_ASSERT_EQUAL_STRING("%2Fa+b~", buf);
+}
+
+void test_url_encode_cat()
+{
+    sds s = sdsnew("/next?to=");
+    TEST_ASSERT_NOT_NULL(s);
+    s = su_url_encode_cat(s, "/a b", 4);
+    TEST_ASSERT_NOT_NULL(s);
+    TEST_ASSERT_EQUAL_size_t(sizeof("/next?to=%2Fa+b") - 1, sdslen(s));
+    TEST_ASSERT_EQUAL_STRING("/next?to=%2Fa+b", s);
+    sdsfree(s);
+}
+
 void test_url_decode()
 {
     const char *enc = "%2F%E3%83%86%E3%82%B9%E3%83%88%2F";
@@ -176,6 +269,66 @@ void test_url_decode_l()
     talloc_free(res);
 }
 
+void test_url_decode_malformed()
+{
+    const char *enc = "100%+sure%2x%4";
+    const char *dec = "100% sure%2x%4";
+    char *res = su_url_decode(NULL, enc);
+    TEST_ASSERT_NOT_NULL(res);
+    TEST_ASSERT_EQUAL_STRING(dec, res);
+    talloc_free(res);
+
+    /* The escape is cut off by the length. */
+    res = su_url_decode_l(NULL, "ab%41", 4);
+    TEST_ASSERT_NOT_NULL(res);
+    TEST_ASSERT_EQUAL_STRING("ab%4", res);
+    talloc_free(res);
+}
+
+void test_url_decode_long()
+{
+    /* Long enough for escapes on both sides of every vector boundary. */
+    char enc[256], dec[256];
+    size_t enc_l = 0, dec_l = 0;
+    for (size_t i = 0; enc_l + 3 < sizeof(enc); ++i)
+    {
+        switch (i % 7)
+        {
+        case 0:
+            memcpy(enc + enc_l, "%7e", 3);
+            enc_l += 3;
+            dec[dec_l++] = '~';
+            break;
+
+        case 3:
+            enc[enc_l++] = '+';
+            dec[dec_l++] = ' ';
+            break;
+
+        default:
+            enc[enc_l++] = 'a' + i % 26;
+            dec[dec_l++] = 'a' + i % 26;
+            break;
+        }
+    }
+    enc[enc_l] = '\0';
+    dec[dec_l] = '\0';
+
+    char *res = su_url_decode(NULL, enc);
+    TEST_ASSERT_NOT_NULL(res);
+    TEST_ASSERT_EQUAL_STRING(dec, res);
+    talloc_free(res);
+}
+
+void test_url_decode_in_place()
+{
+    char str[] = "k%20ey=va+lue&next";
+    size_t len = su_url_decode_in_place(str, strchr(str, '&') - str);
+    TEST_ASSERT_EQUAL_size_t(sizeof("k ey=va lue") - 1, len);
+    TEST_ASSERT_EQUAL_STRING("k ey=va lue", str);
+    TEST_ASSERT_EQUAL_STRING("next", str + sizeof("k%20ey=va+lue&") - 1);
+}
+
 int main(void)
 {
     UNITY_BEGIN();
@@ -184,6 +337,10 @@ int main(void)
     RUN_TEST(test_strchrnul_not_found);
     RUN_TEST(test_strchrnul_empty);
 
+    RUN_TEST(test_strpbrknul_found);
+    RUN_TEST(test_strpbrknul_not_found);
+    RUN_TEST(test_strpbrknul_long);
+
     RUN_TEST(test_url_encode);
     RUN_TEST(test_url_encode_empty);
     RUN_TEST(test_url_encode_utf8);
@@ -191,12 +348,18 @@ int main(void)
     RUN_TEST(test_url_encode_match_char);
 
     RUN_TEST(test_url_encode_l);
+    RUN_TEST(test_url_encode_long);
+    RUN_TEST(test_url_encode_buf);
+    RUN_TEST(test_url_encode_cat);
 
     RUN_TEST(test_url_decode);
     RUN_TEST(test_url_decode_empty);
     RUN_TEST(test_url_decode_general);
 
     RUN_TEST(test_url_decode_l);
+    RUN_TEST(test_url_decode_malformed);
+    RUN_TEST(test_url_decode_long);
+    RUN_TEST(test_url_decode_in_place);
 
     return UNITY_END();
 }
\ No newline at end of file